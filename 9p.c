@@ -8,16 +8,16 @@ Why the dot-L variant?
 
 TODO:
 - Yield back to the File Manager while idle (rather than spinning)
-- Range-based IO (rather than a virtio buffer for each page)
 */
 
 #include <DriverServices.h>
 
 #include <stdalign.h>
-#include <stdarg.h>
 #include <string.h>
 
 #include "allocator.h"
+#include "arena.h"
+#include "interruptmask.h"
 #include "printf.h"
 #include "panic.h"
 #include "virtqueue.h"
@@ -25,9 +25,43 @@ TODO:
 #include "9p.h"
 
 enum {
-	NOTAG = 0,
-	ONLYTAG = 1,
+	MAXTAG = 16, // requests in flight at once: the file cache keeps up to 5 between calls,
+	             // a split Tread/Twrite 4 more, and fgetattr3 3 more
+	MAXRET = 2, // return pointers for the reply decoder
+	TBUF = 1024, // room for a Twalk of 16 long names
+	RBUF = 256,
 	STRMAX = 127, // not including the null
+	XLATE = 16, // cached translations of caller buffers
+	XLATEEXT = 64, // extents per cached translation
+	XLATEMIN = 4096, // smaller caller buffers are cheap to translate every time
+	XLATEBYTES = 1024*1024, // most caller memory to keep locked at once
+	PIPELINE = 4, // pieces of a big Tread/Twrite in flight at once
+};
+
+// A request in flight, indexed by its tag number
+struct tag {
+	volatile uint32_t rlen; // nonzero when the reply arrives
+	bool busy;
+	bool orphan; // a Tclunk that nobody will Complete9, freed by reapClunks
+	uint32_t fid; // the fid an orphan is clunking
+	int beenlocked; // bitmask of the locked array
+	struct MemoryBlock locked[4];
+	int8_t held[4]; // translation cache entries, or -1
+
+	// Where to put the reply
+	int (*decode)(struct tag *s); // NULL if the reply has no fields
+	void *ret[MAXRET];
+	void *rbig;
+	uint32_t rbigsize;
+	int rs; // header size, or RBUF if there is no trailer
+
+	// Twalk needs some post-processing
+	uint32_t newfid;
+	uint16_t nwname;
+	uint16_t *retnwqid;
+	struct Qid9 *retqid;
+
+	char *t, *r; // TBUF and RBUF bytes in the arena, so never locked or translated
 };
 
 #define READ16LE(S) ((255 & ((char *)S)[1]) << 8 | (255 & ((char *)S)[0]))
@@ -58,38 +92,118 @@ enum {
    ((char *)P)[7] = (0xFF00000000000000 & (V)) >> 070)
 
 uint32_t Max9;
+uint32_t Piece9;
 
 static uint32_t openfids;
 
 int bufcnt;
-volatile int freebufs;
+
+static struct tag tags[MAXTAG];
+
+// Caller buffers stay locked while their translation is cached,
+// so the physical pages cannot move until the entry is dropped:
+// only big buffers are cached, and idle ones are dropped at accRun
+static struct xlate {
+	char *addr;
+	uint32_t count; // zero if the entry is empty
+	uint16_t users; // requests in flight, which prevent eviction
+	uint8_t recent; // used since the last Idle9
+	uint8_t n;
+	uint32_t age;
+	uint32_t pa[XLATEEXT], sz[XLATEEXT];
+} xlates[XLATE];
+static uint32_t xlateclock;
 
 #define QIDF "0x%02x.%x.%x"
 #define QIDA(qid) qid.type, qid.version, (uint32_t)qid.path
 #define READQID(ptr) (struct Qid9){*(char *)(ptr), READ32LE((char *)(ptr)+1), READ64LE((char *)(ptr)+5)}
 
-static int transact(uint8_t cmd, const char *tfmt, const char *rfmt, ...);
+// Each message has its own marshalling code built from these,
+// which advance a cursor through the request or reply
+static inline char *put8(char *p, uint8_t v) {*p = v; return p + 1;}
+static inline char *put16(char *p, uint16_t v) {WRITE16LE(p, v); return p + 2;}
+static inline char *put32(char *p, uint32_t v) {WRITE32LE(p, v); return p + 4;}
+static inline char *put64(char *p, uint64_t v) {WRITE64LE(p, v); return p + 8;}
+
+// Two strings of this length still fit in a request
+static inline char *putstr(char *p, const char *s) {
+	uint16_t slen = s ? strlen(s) : 0;
+	if (slen > TBUF/2 - 16) panic("9P string too long");
+	WRITE16LE(p, slen);
+	memcpy(p + 2, s, slen);
+	return p + 2 + slen;
+}
+
+static inline uint8_t get8(const char **p) {*p += 1; return *(*p - 1);}
+static inline uint16_t get16(const char **p) {*p += 2; return READ16LE(*p - 2);}
+static inline uint32_t get32(const char **p) {*p += 4; return READ32LE(*p - 4);}
+static inline uint64_t get64(const char **p) {*p += 8; return READ64LE(*p - 8);}
+static inline struct Qid9 getqid(const char **p) {*p += 13; return READQID(*p - 13);}
+
+static int submitWalk(uint32_t fid, uint32_t newfid, uint16_t nwname, const char *const *name, uint16_t *retnwqid, struct Qid9 *retqid);
+static int pieces(uint32_t fid, char *buf, uint64_t offset, uint32_t count, uint32_t *actual_count, bool write);
+static int join(uint32_t *pa, uint32_t *sz, int at, int n, bool before);
+static int send(int tag, uint8_t cmd, char *end, const void *tbig, uint32_t tbigsize);
+static int newTag(void);
+static int freeTags(void);
+static bool reapClunks(bool wait);
+static void settleClunk(uint32_t fid);
+static int rversion(struct tag *s);
+static int rqid(struct tag *s);
+static int rqidiounit(struct tag *s);
+static int rcount(struct tag *s);
+static int rsize(struct tag *s);
+static int rstatus(struct tag *s);
+static int rstatfs(struct tag *s);
+static int rgetattr(struct tag *s);
+static int rwalk(struct tag *s);
+static int hold(char *addr, uint32_t count, bool create);
+static int cached(int x, char *addr, uint32_t count, uint32_t *pa, uint32_t *sz, int max);
+static void unhold(int x);
+static bool drop(int x);
 
 int Init9(int bufs) {
 	enum {Tversion = 100}; // size[4] Tversion tag[2] msize[4] version[s]
 	enum {Rversion = 101}; // size[4] Rversion tag[2] msize[4] version[s]
 
-	if (bufs > 256) bufs = 256;
-	freebufs = bufcnt = bufs;
+	if (bufs > 1024) bufs = 1024;
+	bufcnt = bufs;
+
+	// The caller has set up the arena
+	if (tags[0].t == NULL) {
+		for (int i=0; i<MAXTAG; i++) {
+			tags[i].t = ArenaPush(TBUF);
+			tags[i].r = ArenaPush(RBUF);
+		}
+	}
 
-	Max9 = 4096 * (bufs - 4);
+	// Leave a few buffers for headers and misalignment
+	uint32_t msize = 4096 * (bufs - 4);
 
 	int err;
-	char proto[128];
-	err = transact(Tversion, "ds", "ds",
-		Max9, "9P2000.L",
-		&Max9, proto);
+	char proto[STRMAX+1];
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, msize);
+	p = putstr(p, "9P2000.L");
+	tags[tag].decode = rversion;
+	tags[tag].ret[0] = &msize;
+	tags[tag].ret[1] = proto;
+	err = Complete9(send(tag, Tversion, p, NULL, 0));
 	if (err) return err;
 
 	if (strcmp(proto, "9P2000.L")) {
 		return EPROTONOSUPPORT;
 	}
 
+	// The largest Tread/Twrite payload that the server will not truncate
+	Max9 = msize - 24;
+
+	// One descriptor per page spanned, and up to four for the headers,
+	// but never more than the server will return in one go
+	Piece9 = (bufs > 5) ? 4096 * (bufs - 5) : 512;
+	if (Piece9 > Max9) Piece9 = Max9;
+
 	return 0;
 }
 
@@ -97,9 +211,18 @@ int Attach9(uint32_t fid, uint32_t afid, const char *uname, const char *aname, u
 	enum {Tattach = 104}; // size[4] Tattach tag[2] fid[4] afid[4] uname[s] aname[s] n_uname[4]
 	enum {Rattach = 105}; // size[4] Rattach tag[2] qid[13]
 
-	return transact(Tattach, "ddssd", "Q",
-		fid, afid, uname, aname, n_uname,
-		retqid);
+	settleClunk(fid);
+
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = put32(p, afid);
+	p = putstr(p, uname);
+	p = putstr(p, aname);
+	p = put32(p, n_uname);
+	tags[tag].decode = rqid;
+	tags[tag].ret[0] = retqid;
+	return Complete9(send(tag, Tattach, p, NULL, 0));
 }
 
 int Statfs9(uint32_t fid, struct Statfs9 *ret) {
@@ -107,36 +230,31 @@ int Statfs9(uint32_t fid, struct Statfs9 *ret) {
 	enum {Rstatfs = 9}; // size[4] Rstatfs tag[2] type[4] bsize[4] blocks[8] bfree[8]
 	                    // bavail[8] files[8] ffree[8] fsid[8] namelen[4]
 
-	return transact(Tstatfs, "d", "ddqqqqqqd",
-		fid,
-		&ret->type, &ret->bsize, &ret->blocks, &ret->bfree,
-		&ret->bavail, &ret->files, &ret->ffree, &ret->fsid, &ret->namelen);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	tags[tag].decode = rstatfs;
+	tags[tag].ret[0] = ret;
+	return Complete9(send(tag, Tstatfs, p, NULL, 0));
 }
 
 // Respects the protocol's 16-component maximum
 // call with nwname 0 to duplicate a fid
 int Walk9(uint32_t fid, uint32_t newfid, uint16_t nwname, const char *const *name, uint16_t *retnwqid, struct Qid9 *retqid) {
-	enum {Twalk = 110}; // size[4] Twalk tag[2] fid[4] newfid[4] nwname[2] nwname*(wname[s])
-	enum {Rwalk = 111}; // size[4] Rwalk tag[2] nwqid[2] nwqid*(wqid[13])
-
 	if (newfid < 32 && fid != newfid && (openfids & (1<<newfid))) Clunk9(newfid);
 
 	if (retnwqid) *retnwqid = 0;
 
 	int done = 0;
 	do {
-		char path[1024];
 		int willdo = 0, pathbytes = 0;
 
-		// Pack the names into a buffer, and increment willdo
+		// Count the names that fit in one message
 		while (done+willdo < nwname && willdo < 16) {
 			int slen = strlen(name[done+willdo]);
 
 			// buffer getting too big for us?
-			if (pathbytes+2+slen >= sizeof path) break;
-
-			WRITE16LE(path+pathbytes, slen);
-			memcpy(path+pathbytes+2, name[done+willdo], slen);
+			if (pathbytes+2+slen >= TBUF-32) break;
 
 			pathbytes += 2+slen;
 			willdo++;
@@ -146,105 +264,126 @@ int Walk9(uint32_t fid, uint32_t newfid, uint16_t nwname, const char *const *nam
 		// (except for the nwname 0 case, to duplicate a fid)
 		if (willdo == 0 && nwname != 0) return ENOMEM;
 
-		char qids[16*13];
+		// After the first message, continue on from the new fid
 		uint16_t ok = 0;
-
-		int err = transact(Twalk, "ddwB", "wB",
-			fid, newfid, willdo, path, pathbytes,
-			&ok, qids, sizeof qids);
-
-		if (err) return err;
+		int err = Complete9(submitWalk(done ? newfid : fid, newfid, willdo, name+done,
+			&ok, retqid ? retqid+done : NULL));
 
 		if (retnwqid) *retnwqid += ok;
-		if (retqid) {
-			for (int i=0; i<ok; i++) {
-				char *rawqid = qids + 13*i;
-				retqid[done+i] =
-					(struct Qid9){*rawqid, READ32LE(rawqid+1), READ64LE(rawqid+5)};
-			}
-		}
-
 		done += ok;
 
-		if (ok < willdo) return ENOENT;
+		if (err) return err;
 	} while (done < nwname);
 
-	if (newfid < 32) openfids |= 1<<newfid;
-
 	return 0;
 }
 
 // Panics if you exceed the maximum 16 components
 // Returns 0 if any components of the walk fail (for easy error checking)
 int WalkPath9(uint32_t fid, uint32_t newfid, const char *path) {
-	enum {Twalk = 110}; // size[4] Twalk tag[2] fid[4] newfid[4] nwname[2] nwname*(wname[s])
-	enum {Rwalk = 111}; // size[4] Rwalk tag[2] nwqid[2] nwqid*(wqid[13])
+	int tag = SubmitWalkPath9(fid, newfid, path);
+	int err = Complete9(tag);
+
+	if (err && path[strspn(path, "/")] == 0) {
+		panic("Twalk with 0 components should never fail");
+	}
+
+	return err;
+}
 
+int SubmitWalkPath9(uint32_t fid, uint32_t newfid, const char *path) {
 	if (newfid < 32 && fid != newfid && (openfids & (1<<newfid))) Clunk9(newfid);
 
-	const char *lookhere = path;
-	char packed[1024];
-	char *packhere = packed;
-	int components = 0;
+	char copy[TBUF];
+	const char *components[16];
+	int n = 0;
 
-	for (;;) {
-		int len = 0;
-		while (lookhere[len]!=0 && lookhere[len]!='/') len++;
+	if (strlen(path) >= TBUF-32) {
+		panic("WalkPath9 too many characters");
+	}
+	strcpy(copy, path);
+
+	for (char *lookhere=copy;;) {
+		int len = strcspn(lookhere, "/");
+		bool last = lookhere[len] == 0;
+		lookhere[len] = 0;
 
 		if (len > 0) {
-			if (packhere + 2 + len > packed + sizeof packed) {
-				panic("WalkPath9 too many characters");
-			}
-			if (components == 16) {
+			if (n == 16) {
 				panic("WalkPath9 too many components");
 			}
-
-			packhere[0] = len;
-			packhere[1] = len >> 8;
-			memcpy(packhere+2, lookhere, len);
-			packhere += 2 + len;
-
-			components++;
+			components[n++] = lookhere;
 		}
 
-		if (lookhere[len] == 0) break;
+		if (last) break;
 		lookhere += len + 1;
 	}
 
-	uint16_t ok = 0;
-	char qids[16*13];
+	return submitWalk(fid, newfid, n, components, NULL, NULL);
+}
 
-	int err = transact(Twalk, "ddwB", "wB",
-		fid, newfid, components, packed, packhere - packed,
-		&ok, qids, sizeof qids);
+// Panics if you exceed the maximum 16 components
+int SubmitWalk9(uint32_t fid, uint32_t newfid, uint16_t nwname, const char *const *name, uint16_t *retnwqid, struct Qid9 *retqid) {
+	if (nwname > 16) panic("SubmitWalk9 too many components");
+	if (newfid < 32 && fid != newfid && (openfids & (1<<newfid))) Clunk9(newfid);
 
-	if (err && components==0) {
-		panic("Twalk with 0 components should never fail");
-	}
+	return submitWalk(fid, newfid, nwname, name, retnwqid, retqid);
+}
 
-	if (err) return err;
-	if (ok != components) return ENOENT;
+// Reply is decoded by rwalk
+static int submitWalk(uint32_t fid, uint32_t newfid, uint16_t nwname, const char *const *name, uint16_t *retnwqid, struct Qid9 *retqid) {
+	enum {Twalk = 110}; // size[4] Twalk tag[2] fid[4] newfid[4] nwname[2] nwname*(wname[s])
+	enum {Rwalk = 111}; // size[4] Rwalk tag[2] nwqid[2] nwqid*(wqid[13])
 
-	if (newfid < 32) openfids |= 1<<newfid;
-	return 0;
+	if (retnwqid) *retnwqid = 0;
+	settleClunk(newfid);
+
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = put32(p, newfid);
+	p = put16(p, nwname);
+	for (int i=0; i<nwname; i++) {
+		p = putstr(p, name[i]);
+	}
+
+	tags[tag].decode = rwalk;
+	tags[tag].newfid = newfid;
+	tags[tag].nwname = nwname;
+	tags[tag].retnwqid = retnwqid;
+	tags[tag].retqid = retqid;
+	return send(tag, Twalk, p, NULL, 0);
 }
 
 int Lopen9(uint32_t fid, uint32_t flags, struct Qid9 *retqid, uint32_t *retiounit) {
 	enum {Tlopen = 12}; // size[4] Tlopen tag[2] fid[4] flags[4]
 	enum {Rlopen = 13}; // size[4] Rlopen tag[2] qid[13] iounit[4]
 
-	return transact(Tlopen, "dd", "Qd",
-		fid, flags,
-		retqid, retiounit);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = put32(p, flags);
+	tags[tag].decode = rqidiounit;
+	tags[tag].ret[0] = retqid;
+	tags[tag].ret[1] = retiounit;
+	return Complete9(send(tag, Tlopen, p, NULL, 0));
 }
 
 int Lcreate9(uint32_t fid, uint32_t flags, uint32_t mode, uint32_t gid, const char *name, struct Qid9 *retqid, uint32_t *retiounit) {
 	enum {Tlcreate = 14}; // size[4] Tlcreate tag[2] fid[4] name[s] flags[4] mode[4] gid[4]
 	enum {Rlcreate = 15}; // size[4] Rlcreate tag[2] qid[13] iounit[4]
 
-	return transact(Tlcreate, "dsddd", "Qd",
-		fid, name, flags, mode, gid,
-		retqid, retiounit);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = putstr(p, name);
+	p = put32(p, flags);
+	p = put32(p, mode);
+	p = put32(p, gid);
+	tags[tag].decode = rqidiounit;
+	tags[tag].ret[0] = retqid;
+	tags[tag].ret[1] = retiounit;
+	return Complete9(send(tag, Tlcreate, p, NULL, 0));
 }
 
 int Xattrwalk9(uint32_t fid, uint32_t newfid, const char *name, uint64_t *retsize) {
@@ -252,10 +391,16 @@ int Xattrwalk9(uint32_t fid, uint32_t newfid, const char *name, uint64_t *retsiz
 	enum {Rxattrwalk = 31}; // size[4] Rxattrwalk tag[2] size[8]
 
 	if (newfid < 32 && fid != newfid && (openfids & (1<<newfid))) Clunk9(newfid);
-
-	int err = transact(Txattrwalk, "dds", "q",
-		fid, newfid, name,
-		retsize);
+	settleClunk(newfid);
+
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = put32(p, newfid);
+	p = putstr(p, name);
+	tags[tag].decode = rsize;
+	tags[tag].ret[0] = retsize;
+	int err = Complete9(send(tag, Txattrwalk, p, NULL, 0));
 	if (err) return err;
 
 	if (newfid < 32) openfids |= 1<<newfid;
@@ -266,16 +411,23 @@ int Xattrcreate9(uint32_t fid, const char *name, uint64_t size, uint32_t flags)
 	enum {Txattrcreate = 32}; // size[4] Txattrcreate tag[2] fid[4] name[s] attr_size[8] flags[4]
 	enum {Rxattrcreate = 33}; // size[4] Rxattrcreate tag[2]
 
-	return transact(Txattrcreate, "dsqd", "",
-		fid, name, size, flags);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = putstr(p, name);
+	p = put64(p, size);
+	p = put32(p, flags);
+	return Complete9(send(tag, Txattrcreate, p, NULL, 0));
 }
 
 int Remove9(uint32_t fid) {
 	enum {Tremove = 122}; // size[4] Tremove tag[2] fid[4]
 	enum {Rremove = 123}; // size[4] Rremove tag[2]
 
-	return transact(Tremove, "d", "",
-		fid);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	return Complete9(send(tag, Tremove, p, NULL, 0));
 }
 
 int Unlinkat9(uint32_t fid, const char *name, uint32_t flags) {
@@ -283,25 +435,40 @@ int Unlinkat9(uint32_t fid, const char *name, uint32_t flags) {
 	enum {Runlinkat = 77}; // size[4] Runlinkat tag[2]
 	// only flag is AT_REMOVEDIR = 0x200
 
-	return transact(Tunlinkat, "dsd", "",
-		fid, name, flags);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = putstr(p, name);
+	p = put32(p, flags);
+	return Complete9(send(tag, Tunlinkat, p, NULL, 0));
 }
 
 int Renameat9(uint32_t olddirfid, const char *oldname, uint32_t newdirfid, const char *newname) {
 	enum {Trenameat = 74}; // size[4] Trenameat tag[2] olddirfid[4] oldname[s] newdirfid[4] newname[s]
 	enum {Rrenameat = 75}; // size[4] Rrenameat tag[2]
 
-	return transact(Trenameat, "dsds", "",
-		olddirfid, oldname, newdirfid, newname);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, olddirfid);
+	p = putstr(p, oldname);
+	p = put32(p, newdirfid);
+	p = putstr(p, newname);
+	return Complete9(send(tag, Trenameat, p, NULL, 0));
 }
 
 int Mkdir9(uint32_t dfid, uint32_t mode, uint32_t gid, const char *name, struct Qid9 *retqid) {
 	enum {Tmkdir = 72}; // size[4] Tmkdir tag[2] dfid[4] name[s] mode[4] gid[4]
 	enum {Rmkdir = 73}; // size[4] Rmkdir tag[2] qid[13]
 
-	return transact(Tmkdir, "dsdd", "Q",
-		dfid, name, mode, gid,
-		retqid);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, dfid);
+	p = putstr(p, name);
+	p = put32(p, mode);
+	p = put32(p, gid);
+	tags[tag].decode = rqid;
+	tags[tag].ret[0] = retqid;
+	return Complete9(send(tag, Tmkdir, p, NULL, 0));
 }
 
 int Readdir9(uint32_t fid, uint64_t offset, uint32_t count, uint32_t *retcount, void *retbuf) {
@@ -310,9 +477,18 @@ int Readdir9(uint32_t fid, uint64_t offset, uint32_t count, uint32_t *retcount,
 	                      // "data" = qid[13] offset[8] type[1] name[s]
 
 	if (retcount) *retcount = 0;
-	return transact(Treaddir, "dqd", "dB",
-		fid, offset, count,
-		retcount, retbuf, count);
+
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = put64(p, offset);
+	p = put32(p, count);
+	tags[tag].decode = rcount;
+	tags[tag].ret[0] = retcount;
+	tags[tag].rbig = retbuf;
+	tags[tag].rbigsize = count;
+	tags[tag].rs = 11;
+	return Complete9(send(tag, Treaddir, p, NULL, 0));
 }
 
 void DirRecord9(char **buffer, struct Qid9 *retqid, uint64_t *retoffset, char *rettype, char retname[MAXNAME]) {
@@ -345,6 +521,10 @@ void DirRecord9(char **buffer, struct Qid9 *retqid, uint64_t *retoffset, char *r
 }
 
 int Getattr9(uint32_t fid, uint64_t request_mask, struct Stat9 *ret) {
+	return Complete9(SubmitGetattr9(fid, request_mask, ret));
+}
+
+int SubmitGetattr9(uint32_t fid, uint64_t request_mask, struct Stat9 *ret) {
 	enum {Tgetattr = 24}; // size[4] Tgetattr tag[2] fid[4] request_mask[8]
 	enum {Rgetattr = 25}; // size[4] Rgetattr tag[2] valid[8] qid[13]
 	                      // mode[4] uid[4] gid[4] nlink[8] rdev[8]
@@ -353,16 +533,13 @@ int Getattr9(uint32_t fid, uint64_t request_mask, struct Stat9 *ret) {
 	                      // ctime_sec[8] ctime_nsec[8] btime_sec[8]
 	                      // btime_nsec[8] gen[8] data_version[8]
 
-	return transact(Tgetattr, "dq", "qQdddqqqqqqqqqqqqqqq",
-		fid, request_mask,
-
-		// very many return fields
-		&ret->valid, &ret->qid, &ret->mode, &ret->uid, &ret->gid,
-		&ret->nlink, &ret->rdev, &ret->size, &ret->blksize, &ret->blocks,
-		&ret->atime_sec, &ret->atime_nsec,
-		&ret->mtime_sec, &ret->mtime_nsec,
-		&ret->ctime_sec, &ret->ctime_nsec,
-		NULL, NULL, NULL, NULL); // discard btime, gen and data_version fields
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = put64(p, request_mask);
+	tags[tag].decode = rgetattr;
+	tags[tag].ret[0] = ret;
+	return send(tag, Tgetattr, p, NULL, 0);
 }
 
 int Setattr9(uint32_t fid, uint32_t request_mask, struct Stat9 to) {
@@ -371,23 +548,46 @@ int Setattr9(uint32_t fid, uint32_t request_mask, struct Stat9 to) {
                           // atime_sec[8] atime_nsec[8] mtime_sec[8] mtime_nsec[8]
 	enum {Rsetattr = 27}; // size[4] Rsetattr tag[2]
 
-	return transact(Tsetattr, "dddddqqqqq", "",
-		fid, request_mask,
-		to.mode, to.uid, to.gid, to.size,
-		to.atime_sec, to.atime_nsec, to.mtime_sec, to.mtime_nsec);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = put32(p, request_mask);
+	p = put32(p, to.mode);
+	p = put32(p, to.uid);
+	p = put32(p, to.gid);
+	p = put64(p, to.size);
+	p = put64(p, to.atime_sec);
+	p = put64(p, to.atime_nsec);
+	p = put64(p, to.mtime_sec);
+	p = put64(p, to.mtime_nsec);
+	return Complete9(send(tag, Tsetattr, p, NULL, 0));
 }
 
+// Does not wait for the reply, because a clunk cannot usefully fail,
+// but the fid number is not reused until the reply has come back
 int Clunk9(uint32_t fid) {
 	enum {Tclunk = 120}; // size[4] Tclunk tag[2] fid[4]
 	enum {Rclunk = 121}; // size[4] Rclunk tag[2]
 
 	if (fid < 32) openfids &= ~(1<<fid);
 
-	return transact(Tclunk, "d", "",
-		fid);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	tags[tag].fid = fid;
+	send(tag, Tclunk, p, NULL, 0);
+	tags[tag].orphan = true;
+	return 0;
 }
 
 int Read9(uint32_t fid, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count) {
+	if (count <= Piece9) {
+		return Complete9(SubmitRead9(fid, buf, offset, count, actual_count));
+	}
+	return pieces(fid, buf, offset, count, actual_count, false);
+}
+
+int SubmitRead9(uint32_t fid, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count) {
 	enum {Tread = 116}; // size[4] Tread tag[2] fid[4] offset[8] count[4]
 	enum {Rread = 117}; // size[4] Rread tag[2] count[4] data[count]
 
@@ -396,12 +596,78 @@ int Read9(uint32_t fid, void *buf, uint64_t offset, uint32_t count, uint32_t *ac
 		*actual_count = 0;
 	}
 
-	return transact(Tread, "dqd", "dB",
-		fid, offset, count,
-		actual_count, buf, count);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = put64(p, offset);
+	p = put32(p, count);
+	tags[tag].decode = rcount;
+	tags[tag].ret[0] = actual_count;
+	tags[tag].rbig = buf;
+	tags[tag].rbigsize = count;
+	tags[tag].rs = 11;
+	return send(tag, Tread, p, NULL, 0);
 }
 
 int Write9(uint32_t fid, const void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count) {
+	if (count <= Piece9) {
+		return Complete9(SubmitWrite9(fid, buf, offset, count, actual_count));
+	}
+	return pieces(fid, (char *)buf, offset, count, actual_count, true);
+}
+
+// Split a big read or write into pieces that always fit the descriptor table,
+// keeping a few in flight, and count only up to the first short piece
+static int pieces(uint32_t fid, char *buf, uint64_t offset, uint32_t count, uint32_t *actual_count, bool write) {
+	struct {
+		int tag;
+		uint32_t want, got;
+	} p[PIPELINE];
+	int first = 0, inflight = 0;
+	uint32_t sent = 0, total = 0;
+	bool stop = false;
+	int err = 0;
+
+	if (actual_count) {
+		*actual_count = 0;
+	}
+
+	while (inflight > 0 || (sent < count && !stop)) {
+		// Background requests may hold tags, so only pipeline with tags to spare
+		while (!stop && sent < count && inflight < PIPELINE && (inflight == 0 || freeTags() > 1)) {
+			int k = (first + inflight) % PIPELINE;
+			uint32_t len = count - sent;
+			if (len > Piece9) len = Piece9;
+			p[k].want = len;
+			p[k].tag = write ?
+				SubmitWrite9(fid, buf + sent, offset + sent, len, &p[k].got) :
+				SubmitRead9(fid, buf + sent, offset + sent, len, &p[k].got);
+			sent += len;
+			inflight++;
+		}
+
+		// The pieces after a failed or short one still have to complete
+		int e = Complete9(p[first].tag);
+		if (!stop) {
+			if (e) {
+				err = e;
+				stop = true;
+			} else {
+				total += p[first].got;
+				if (p[first].got != p[first].want) stop = true;
+			}
+		}
+		first = (first + 1) % PIPELINE;
+		inflight--;
+	}
+
+	if (actual_count) {
+		*actual_count = total;
+	}
+	return err;
+}
+
+int SubmitWrite9(uint32_t fid, const void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count) {
 	enum {Twrite = 118}; // size[4] Twrite tag[2] fid[4] offset[8] count[4] data[count]
 	enum {Rwrite = 119}; // size[4] Rwrite tag[2] count[4]
 
@@ -410,240 +676,552 @@ int Write9(uint32_t fid, const void *buf, uint64_t offset, uint32_t count, uint3
 		*actual_count = 0;
 	}
 
-	return transact(Twrite, "dqdB", "d",
-		fid, offset, count, buf, count,
-		actual_count);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = put64(p, offset);
+	p = put32(p, count);
+	tags[tag].decode = rcount;
+	tags[tag].ret[0] = actual_count;
+	return send(tag, Twrite, p, buf, count);
 }
 
 int Fsync9(uint32_t fid) {
 	enum {Tfsync = 50}; // size[4] Tfsync tag[2] fid[4]
 	enum {Rfsync = 51}; // size[4] Rfsync tag[2]
 
-	return transact(Tfsync, "d", "",
-		fid);
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	return Complete9(send(tag, Tfsync, p, NULL, 0));
 }
 
 int Lock9(uint32_t fid, uint8_t type, uint32_t flags, uint64_t start, uint64_t length, uint32_t procid, const char *clientid, uint8_t *retstatus) {
-	enum {Tfsync = 52}; // size[4] Tlock tag[2] fid[4] type[1] flags[4] start[8] length[8] proc_id[4] client_id[s]
-	enum {Rfsync = 53}; // size[4] Rlock tag[2] status[1]
-
-	return transact(Tfsync, "dbdqqds", "b",
-		fid, type, flags, start, length, procid, clientid,
-		retstatus);
+	enum {Tlock = 52}; // size[4] Tlock tag[2] fid[4] type[1] flags[4] start[8] length[8] proc_id[4] client_id[s]
+	enum {Rlock = 53}; // size[4] Rlock tag[2] status[1]
+
+	int tag = newTag();
+	char *p = tags[tag].t + 7;
+	p = put32(p, fid);
+	p = put8(p, type);
+	p = put32(p, flags);
+	p = put64(p, start);
+	p = put64(p, length);
+	p = put32(p, procid);
+	p = putstr(p, clientid);
+	tags[tag].decode = rstatus;
+	tags[tag].ret[0] = retstatus;
+	return Complete9(send(tag, Tlock, p, NULL, 0));
 }
 
-/*
-letter |  Tx  |  Rx  | Tx args      | Rx args       | comment
-b         ok     ok    uint8_t        uint8_t *       byte
-w         ok     ok    uint16_t       uint16_t *      word(16)
-d         ok     ok    uint32_t       uint32_t *      dword(32)
-q         ok     ok    uint64_t       uint64_t *      qword(64)
-s         ok    @end   const char *   char *          string(16-prefix)
-Q                ok                   struct Qid9 *   qid
-B        @end   @end   const void *   void *          large trailing buffer
-                        + uint32_t      + uint32_t
-*/
-
-static int transact(uint8_t cmd, const char *tfmt, const char *rfmt, ...) {
-	char t[256] = {}, r[256] = {}; // enough to store just about anything (not page aligned sadly)
-	int ts=7, rs=7;
-
-	void *tbig = NULL, *rbig = NULL;
-	uint32_t tbigsize = 0, rbigsize = 0;
-
-    va_list va;
-    va_start(va, rfmt);
-
-	for (const char *f=tfmt; *f!=0; f++) {
-		if (*f == 'b') {
-			uint8_t val = va_arg(va, unsigned int); // promoted
-			t[ts++] = val;
-		} else if (*f == 'w') {
-			uint16_t val = va_arg(va, unsigned int); // maybe promoted
-			WRITE16LE(t+ts, val);
-			ts += 2;
-		} else if (*f == 'd') {
-			uint32_t val = va_arg(va, uint32_t);
-			WRITE32LE(t+ts, val);
-			ts += 4;
-		} else if (*f == 'q') {
-			uint64_t val = va_arg(va, uint64_t);
-			WRITE64LE(t+ts, val);
-			ts += 8;
-		} else if (*f == 's') {
-			const char *s = va_arg(va, const char *);
-			uint16_t slen = s ? strlen(s) : 0;
-			WRITE16LE(t+ts, slen);
-			memcpy(t+ts+2, s, slen);
-			ts += 2 + slen;
-		} else if (*f == 'B') {
-			tbig = va_arg(va, void *);
-			tbigsize = va_arg(va, size_t);
-		}
-	}
+// Fill in the header and send the request without waiting for the reply, return the tag
+static int send(int tag, uint8_t cmd, char *end, const void *tbig, uint32_t tbigsize) {
+	struct tag *s = &tags[tag];
+	char *t = s->t;
+	int ts = end - t;
 
 	WRITE32LE(t, ts + tbigsize); // size field
 	*(t+4) = cmd; // T-command number
-	WRITE16LE(t+5, bufcnt - freebufs); // approximates the depth of reentrancy
-
-// 	printf("> ");
-// 	for (int i=0; i<ts; i++) {
-// 		printf("%02x", 255 & t[i]);
-// 	}
-// 	printf(" ");
-// 	for (int i=0; i<tbigsize; i++) {
-// 		printf("%02x", 255 & ((char *)tbig)[i]);
-// 	}
-// 	printf("\n");
-
-	// add up rx buffer size
-	// (unfortunately need to iterate the VA list just to get the "big" buffer)
-    va_list tmpva;
-    va_copy(tmpva, va);
-	for (const char *f=rfmt; *f!=0; f++) {
-		if (*f == 'b') {
-			va_arg(tmpva, unsigned int); // promoted
-			rs += 1;
-		} else if (*f == 'w') {
-			va_arg(tmpva, unsigned int); // maybe promoted
-			rs += 2;
-		} else if (*f == 'd') {
-			va_arg(tmpva, uint32_t);
-			rs += 4;
-		} else if (*f == 'q') {
-			va_arg(tmpva, uint64_t);
-			rs += 8;
-		} else if (*f == 's') { // receiving arbitrary-length strings is yuck!
-			va_arg(tmpva, char *);
-			rs += 2+STRMAX;
-		} else if (*f == 'Q') {
-			va_arg(tmpva, struct Qid9 *);
-			rs += 13;
-		} else if (*f == 'B') {
-			rbig = va_arg(tmpva, void *);
-			rbigsize = va_arg(tmpva, size_t); // this is problematic... the argument is actually hard to find!
-		}
-	}
-	va_end(tmpva);
-
-	// Make room for an Rlerror response to any request (Tclunk doesn't leave enough)
-	// (Assume that if a "B" trailer is supplied, it is large enough)
-	if (rs < 11 && rbigsize == 0) rs = 11;
+	WRITE16LE(t+5, tag);
 
-	long txn = 0, rxn = 0;
-	PhysicalAddress pa[bufcnt];
+	uint16_t txn = 0, rxn = 0;
+	uint32_t pa[bufcnt];
 	uint32_t sz[bufcnt];
 
 	struct MemoryBlock logiranges[] = { // keep the tx before the rx ranges
 		{.address=t, .count=ts},
-		{.address=tbig, .count=tbigsize},
-		{.address=r, .count=rs},
-		{.address=rbig, .count=rbigsize},
+		{.address=(void *)tbig, .count=tbigsize},
+		{.address=s->r, .count=s->rs},
+		{.address=s->rbig, .count=s->rbigsize},
 	};
 
-#define CLEANUP() {for (int i=0; i<4; i++) {if (beenlocked & (1<<i)) {UnlockMemory(logiranges[i].address, logiranges[i].count);}}}
-
-	int beenlocked = 0; // a bitmask for when we clean up
+	s->beenlocked = 0; // a bitmask for when we clean up
 
 	for (int i=0; i<4; i++) {
+		s->locked[i] = logiranges[i];
+		s->held[i] = -1;
 		if (logiranges[i].count == 0) continue;
 
+		// Headers and internal buffers are already locked and translated,
+		// and so are recently used caller buffers
+		int n = ArenaPhysical(logiranges[i].address, logiranges[i].count,
+			pa+txn+rxn, sz+txn+rxn, bufcnt-txn-rxn);
+		if (n < 0 && (s->held[i] = hold(logiranges[i].address, logiranges[i].count, true)) >= 0) {
+			n = cached(s->held[i], logiranges[i].address, logiranges[i].count,
+				pa+txn+rxn, sz+txn+rxn, bufcnt-txn-rxn);
+		}
+		if (n >= 0) {
+			n = join(pa, sz, txn+rxn, n, ((i < 2) ? txn : rxn) > 0);
+			if (i < 2) {
+				txn += n;
+			} else {
+				rxn += n;
+			}
+			continue;
+		}
+
 		if (LockMemory(logiranges[i].address, logiranges[i].count)) {
-			CLEANUP();
 			panic("cannot lock memory");
 		}
 
-		beenlocked |= (1<<i);
+		s->beenlocked |= (1<<i);
 
-		MemoryBlock mbs[256] = {logiranges[i]};
-		unsigned long extents = 255;
+		// Translate in batches of extents, if it is very discontiguous
+		char *addr = logiranges[i].address;
+		uint32_t left = logiranges[i].count;
+		while (left != 0) {
+			MemoryBlock mbs[256] = {{.address=addr, .count=left}};
+			unsigned long extents = 255;
 
-		if (GetPhysical((void *)mbs, &extents) || extents >= 255) {
-			CLEANUP();
-			panic("cannot get physical memory");
-		}
-
-		for (int j=0; j<extents; j++) {
-			if (txn+rxn == bufcnt) panic("too discontiguous");
+			if (GetPhysical((void *)mbs, &extents) || extents == 0) {
+				panic("cannot get physical memory");
+			}
 
-			pa[txn+rxn] = mbs[j+1].address;
-			sz[txn+rxn] = mbs[j+1].count;
-			if (i < 2) {
-				txn++;
-			} else {
-				rxn++;
+			for (int j=0; j<extents; j++) {
+				uint32_t a = (uint32_t)mbs[j+1].address;
+				int last = txn + rxn - 1;
+				if (((i < 2) ? txn : rxn) > 0 && pa[last] + sz[last] == a) {
+					sz[last] += mbs[j+1].count; // physically contiguous with the extent before
+				} else {
+					if (txn+rxn == bufcnt) panic("too discontiguous");
+
+					pa[txn+rxn] = a;
+					sz[txn+rxn] = mbs[j+1].count;
+					if (i < 2) {
+						txn++;
+					} else {
+						rxn++;
+					}
+				}
+
+				addr += mbs[j+1].count;
+				left -= mbs[j+1].count;
 			}
 		}
 	}
 
-	freebufs -= txn + rxn;
-	QSend(0, txn, rxn, (void *)pa, sz, NULL, true/*wait*/);
-	freebufs += txn + rxn;
+	// Waits if the virtqueue is full of other requests
+	QSend(0, txn, rxn, pa, sz, &s->rlen, false/*wait*/);
 
-	CLEANUP();
+	return tag;
+}
+
+// Merge the first of n new extents at "at" into the extent before it, if "before" is on the same side
+// and they are physically adjacent, and return the new count
+static int join(uint32_t *pa, uint32_t *sz, int at, int n, bool before) {
+	if (n == 0 || !before || pa[at-1] + sz[at-1] != pa[at]) return n;
+
+	sz[at-1] += sz[at];
+	memmove(pa+at, pa+at+1, (n-1) * sizeof *pa);
+	memmove(sz+at, sz+at+1, (n-1) * sizeof *sz);
+	return n - 1;
+}
+
+// Wait for the reply, fill in the return fields, and free the tag
+// True if the reply has arrived, so Complete9 will not wait
+bool Done9(int tag) {
+	return tags[tag].rlen != 0;
+}
+
+int Complete9(int tag) {
+	struct tag *s = &tags[tag];
+	char *r = s->r;
+	int err = 0;
 
-// 	printf("< ");
-// 	for (int i=0; i<rs; i++) {
-// 		printf("%02x", 255 & r[i]);
-// 	}
-// 	printf(" ");
-// 	for (int i=0; i<rbigsize; i++) {
-// 		printf("%02x", 255 & ((char *)rbig)[i]);
-// 	}
-// 	printf("\n");
+	QWait(0, &s->rlen);
+
+	for (int i=0; i<4; i++) {
+		if (s->beenlocked & (1<<i)) {
+			UnlockMemory(s->locked[i].address, s->locked[i].count);
+		}
+		if (s->held[i] >= 0) {
+			unhold(s->held[i]);
+		}
+	}
 
 	if (r[4] == 7 /*Rlerror*/) {
-		// The errno field might be split between a header ("bwd" etc in
-		// the format string) and a trailer (the "B" in the format string).
-		uint32_t err = 0;
+		// The errno field might be split between the header
+		// and a trailer (the buffer of an Rread or Rreaddir)
 		char *errbyte = r + 7;
 		for (int i=0; i<4; i++) {
-			if (errbyte == r + rs) errbyte = rbig;
-			err = (uint32_t)(255 & *errbyte) << 24 | err >> 8;
+			if (errbyte == r + s->rs) errbyte = s->rbig;
+			err = (uint32_t)(255 & *errbyte) << 24 | (uint32_t)err >> 8;
 			errbyte++;
 		}
-		return err; // linux E code
-	}
-
-	rs = 7; // rewind to just after the tag field
-	// and notice that we pick up where "va" left off
-	for (const char *f=rfmt; *f!=0; f++) {
-		if (*f == 'b') {
-			uint8_t *ptr = va_arg(va, uint8_t *);
-			if (ptr) *ptr = *(r+rs);
-			rs += 1;
-		} else if (*f == 'w') {
-			uint16_t *ptr = va_arg(va, uint16_t *);
-			if (ptr) *ptr = READ16LE(r+rs);
-			rs += 2;
-		} else if (*f == 'd') {
-			uint32_t *ptr = va_arg(va, uint32_t *);
-			if (ptr) *ptr = READ32LE(r+rs);
-			rs += 4;
-		} else if (*f == 'q') {
-			uint64_t *ptr = va_arg(va, uint64_t *);
-			if (ptr) *ptr = READ64LE(r+rs);
-			rs += 8;
-		} else if (*f == 's') { // receiving arbitrary-length strings is yuck!
-			char *ptr = va_arg(va, char *);
-			uint16_t slen = READ16LE(r+rs);
-			if (ptr) {
-				memcpy(ptr, r+rs+2, slen);
-				*(ptr+slen) = 0; // null terminator
+		// linux E code
+	} else if (s->decode) {
+		err = s->decode(s);
+	}
+
+	short sr = DisableInterrupts();
+	s->busy = false;
+	ReenableInterrupts(sr);
+
+	return err;
+}
+
+static int newTag(void) {
+	reapClunks(false);
+
+	for (;;) {
+		short sr = DisableInterrupts();
+		for (int i=0; i<MAXTAG; i++) {
+			if (!tags[i].busy) {
+				tags[i].busy = true;
+				tags[i].orphan = false;
+				tags[i].rlen = 0;
+				tags[i].decode = NULL;
+				tags[i].rbig = NULL;
+				tags[i].rbigsize = 0;
+				tags[i].rs = RBUF; // Rlerror and Rwalk are longer than they look
+				ReenableInterrupts(sr);
+				return i;
+			}
+		}
+		ReenableInterrupts(sr);
+
+		// The other tags belong to callers, so only a Tclunk can be waited out
+		if (!reapClunks(true)) break;
+	}
+	panic("out of 9P tags");
+	return 0;
+}
+
+static int freeTags(void) {
+	int n = 0;
+	for (int i=0; i<MAXTAG; i++) {
+		if (!tags[i].busy) n++;
+	}
+	return n;
+}
+
+// Free the tags of answered Tclunks, or wait for one if none has been answered
+static bool reapClunks(bool wait) {
+	bool any = false;
+	for (int i=0; i<MAXTAG; i++) {
+		if (tags[i].busy && tags[i].orphan && tags[i].rlen != 0) {
+			tags[i].orphan = false;
+			Complete9(i);
+			any = true;
+		}
+	}
+
+	for (int i=0; i<MAXTAG && wait && !any; i++) {
+		if (tags[i].busy && tags[i].orphan) {
+			tags[i].orphan = false;
+			Complete9(i);
+			any = true;
+		}
+	}
+	return any;
+}
+
+// The server may handle requests out of order, so a Tclunk must be answered
+// before its fid number can be attached or walked to again
+static void settleClunk(uint32_t fid) {
+	for (int i=0; i<MAXTAG; i++) {
+		if (tags[i].busy && tags[i].orphan && tags[i].fid == fid) {
+			tags[i].orphan = false;
+			Complete9(i);
+		}
+	}
+}
+
+// Reply decoders, called by Complete9 unless the reply is Rlerror
+
+static int rversion(struct tag *s) { // msize[4] version[s]
+	const char *p = s->r + 7;
+	uint32_t *msize = s->ret[0];
+	char *version = s->ret[1];
+
+	*msize = get32(&p);
+	uint16_t slen = get16(&p);
+	if (slen > STRMAX) slen = STRMAX;
+	memcpy(version, p, slen);
+	version[slen] = 0;
+	return 0;
+}
+
+static int rqid(struct tag *s) { // qid[13]
+	const char *p = s->r + 7;
+	struct Qid9 *qid = s->ret[0];
+
+	if (qid) *qid = getqid(&p);
+	return 0;
+}
+
+static int rqidiounit(struct tag *s) { // qid[13] iounit[4]
+	const char *p = s->r + 7;
+	struct Qid9 *qid = s->ret[0];
+	uint32_t *iounit = s->ret[1];
+
+	struct Qid9 q = getqid(&p);
+	if (qid) *qid = q;
+	if (iounit) *iounit = get32(&p);
+	return 0;
+}
+
+static int rcount(struct tag *s) { // count[4]
+	const char *p = s->r + 7;
+	uint32_t *count = s->ret[0];
+
+	if (count) *count = get32(&p);
+	return 0;
+}
+
+static int rsize(struct tag *s) { // size[8]
+	const char *p = s->r + 7;
+	uint64_t *size = s->ret[0];
+
+	if (size) *size = get64(&p);
+	return 0;
+}
+
+static int rstatus(struct tag *s) { // status[1]
+	const char *p = s->r + 7;
+	uint8_t *status = s->ret[0];
+
+	if (status) *status = get8(&p);
+	return 0;
+}
+
+static int rstatfs(struct tag *s) {
+	const char *p = s->r + 7;
+	struct Statfs9 *ret = s->ret[0];
+
+	ret->type = get32(&p);
+	ret->bsize = get32(&p);
+	ret->blocks = get64(&p);
+	ret->bfree = get64(&p);
+	ret->bavail = get64(&p);
+	ret->files = get64(&p);
+	ret->ffree = get64(&p);
+	ret->fsid = get64(&p);
+	ret->namelen = get32(&p);
+	return 0;
+}
+
+// Discards btime, gen and data_version fields
+static int rgetattr(struct tag *s) {
+	const char *p = s->r + 7;
+	struct Stat9 *ret = s->ret[0];
+
+	ret->valid = get64(&p);
+	ret->qid = getqid(&p);
+	ret->mode = get32(&p);
+	ret->uid = get32(&p);
+	ret->gid = get32(&p);
+	ret->nlink = get64(&p);
+	ret->rdev = get64(&p);
+	ret->size = get64(&p);
+	ret->blksize = get64(&p);
+	ret->blocks = get64(&p);
+	ret->atime_sec = get64(&p);
+	ret->atime_nsec = get64(&p);
+	ret->mtime_sec = get64(&p);
+	ret->mtime_nsec = get64(&p);
+	ret->ctime_sec = get64(&p);
+	ret->ctime_nsec = get64(&p);
+	return 0;
+}
+
+static int rwalk(struct tag *s) { // nwqid[2] nwqid*(wqid[13])
+	const char *p = s->r + 7;
+
+	uint16_t ok = get16(&p);
+	if (s->retnwqid) *s->retnwqid = ok;
+	if (s->retqid) {
+		for (int i=0; i<ok; i++) {
+			s->retqid[i] = getqid(&p);
+		}
+	}
+
+	if (ok < s->nwname) {
+		return ENOENT;
+	} else if (s->newfid < 32) {
+		openfids |= 1<<s->newfid;
+	}
+	return 0;
+}
+
+// Find or create a cached translation covering the range, and keep it until unhold,
+// return -1 if the range is too discontiguous to cache or every entry is in use
+// (without create, only look up a translation, which is safe at interrupt time)
+static int hold(char *addr, uint32_t count, bool create) {
+	short sr = DisableInterrupts();
+
+	int victim = -1;
+	for (int x=0; x<XLATE; x++) {
+		struct xlate *e = &xlates[x];
+		if (e->count != 0 && addr >= e->addr && addr + count <= e->addr + e->count) {
+			e->users++;
+			e->age = ++xlateclock;
+			e->recent = 1;
+			ReenableInterrupts(sr);
+			return x;
+		}
+
+		if (e->users == 0 && (victim < 0 || e->count == 0 ||
+			(xlates[victim].count != 0 && e->age < xlates[victim].age))) {
+			victim = x;
+		}
+	}
+
+	if (!create || victim < 0 || count < XLATEMIN || count > XLATEBYTES) {
+		ReenableInterrupts(sr);
+		return -1;
+	}
+
+	// Claim the least recently used entry so that nobody else finds it
+	struct xlate *e = &xlates[victim];
+	char *oldaddr = e->addr;
+	uint32_t oldcount = e->count;
+	e->count = 0;
+	e->users = 1;
+	e->age = ++xlateclock;
+	e->recent = 1;
+	ReenableInterrupts(sr);
+
+	if (oldcount != 0) UnlockMemory(oldaddr, oldcount);
+
+	// Drop the oldest idle entries until the new range fits under the cap
+	for (;;) {
+		uint32_t locked = count;
+		int oldest = -1;
+		for (int x=0; x<XLATE; x++) {
+			locked += xlates[x].count;
+			if (xlates[x].count != 0 && xlates[x].users == 0 &&
+				(oldest < 0 || xlates[x].age < xlates[oldest].age)) {
+				oldest = x;
 			}
-			rs += 2 + slen;
-		} else if (*f == 'Q') {
-			struct Qid9 *ptr = va_arg(va, struct Qid9 *);
-			if (ptr) *ptr =
-				(struct Qid9){*(r+rs), READ32LE(r+rs+1), READ64LE(r+rs+5)};
-			rs += 13;
-		} else if (*f == 'B') {
-			va_arg(va, void *);
-			va_arg(va, size_t); // nothing actually to do
 		}
+
+		if (locked <= XLATEBYTES) break;
+
+		if (oldest < 0) {
+			e->users = 0; // everything else locked is in flight
+			return -1;
+		}
+		drop(oldest);
+	}
+
+	if (LockMemory(addr, count)) {
+		panic("cannot lock memory");
 	}
 
-    va_end(va);
+	char *next = addr;
+	uint32_t left = count;
+	int n = 0;
+	while (left != 0) {
+		MemoryBlock mbs[XLATEEXT+1] = {{.address=next, .count=left}};
+		unsigned long extents = XLATEEXT;
+
+		if (GetPhysical((void *)mbs, &extents) || extents == 0) {
+			panic("cannot get physical memory");
+		}
 
-    return 0;
+		for (int j=0; j<extents; j++) {
+			uint32_t a = (uint32_t)mbs[j+1].address;
+			if (n > 0 && e->pa[n-1] + e->sz[n-1] == a) {
+				e->sz[n-1] += mbs[j+1].count; // physically contiguous with the extent before
+			} else {
+				if (n == XLATEEXT) {
+					UnlockMemory(addr, count);
+					e->users = 0;
+					return -1;
+				}
+
+				e->pa[n] = a;
+				e->sz[n] = mbs[j+1].count;
+				n++;
+			}
+
+			next += mbs[j+1].count;
+			left -= mbs[j+1].count;
+		}
+	}
+
+	e->n = n;
+	e->addr = addr;
+	e->count = count; // now visible to other lookups
+	return victim;
+}
+
+// Keep a caller buffer translated across several requests, so that sending them
+// and completing them never locks or unlocks memory, and return -1 if it cannot be
+// (without create, only use a translation that already exists)
+int Hold9(const void *addr, uint32_t count, bool create) {
+	return hold((char *)addr, count, create);
+}
+
+void Unhold9(int held) {
+	unhold(held);
+}
+
+// Copy out the physical extents for part of a cached range
+static int cached(int x, char *addr, uint32_t count, uint32_t *pa, uint32_t *sz, int max) {
+	struct xlate *e = &xlates[x];
+	uint32_t skip = addr - e->addr;
+	int n = 0;
+
+	for (int j=0; j<e->n && count!=0; j++) {
+		if (skip >= e->sz[j]) {
+			skip -= e->sz[j];
+			continue;
+		}
+
+		uint32_t len = e->sz[j] - skip;
+		if (len > count) len = count;
+
+		if (n == max) panic("too discontiguous");
+		pa[n] = e->pa[j] + skip;
+		sz[n] = len;
+		n++;
+
+		skip = 0;
+		count -= len;
+	}
+	return n;
+}
+
+static void unhold(int x) {
+	short sr = DisableInterrupts();
+	xlates[x].users--;
+	ReenableInterrupts(sr);
+}
+
+// Forget an idle translation and unlock its memory
+static bool drop(int x) {
+	struct xlate *e = &xlates[x];
+
+	short sr = DisableInterrupts();
+	char *addr = e->addr;
+	uint32_t count = e->count;
+	bool ok = e->users == 0 && count != 0;
+	if (ok) e->count = 0;
+	ReenableInterrupts(sr);
+
+	if (ok) UnlockMemory(addr, count);
+	return ok;
+}
+
+// True if any caller memory is locked by a cached translation
+bool Pinned9(void) {
+	for (int x=0; x<XLATE; x++) {
+		if (xlates[x].count != 0) return true;
+	}
+	return false;
+}
+
+// Called at accRun: drop translations unused since the last call,
+// and return true if any caller memory is still locked
+bool Idle9(void) {
+	bool pinned = false;
+	for (int x=0; x<XLATE; x++) {
+		struct xlate *e = &xlates[x];
+		if (!e->recent) drop(x);
+		e->recent = 0;
+		if (e->count != 0) pinned = true;
+	}
+	return pinned;
 }
@@ -4,6 +4,13 @@
 // A synchronous 9P2000.u interface backing onto Virtio.
 // Functions return true on failure.
 
+// The Submit functions return a tag without waiting for the reply,
+// so that independent requests can be in flight together.
+// Every tag must be passed to Complete9, which returns the error,
+// and the return pointers must remain valid until then.
+// Done9 tells whether Complete9 would have to wait.
+// Clunk9 sends its request and returns at once, and the reply is reaped later.
+
 // Track use of FID 0-31 and automatically clunk when reuse is attempted
 
 #pragma once
@@ -185,6 +192,7 @@ enum {
 };
 
 extern uint32_t Max9;
+extern uint32_t Piece9; // caller bytes that can never need more descriptors than we have
 
 struct Qid9 {
 	uint8_t type;
@@ -244,4 +252,15 @@ int Clunk9(uint32_t fid);
 int Read9(uint32_t fid, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
 int Write9(uint32_t fid, const void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
 int Fsync9(uint32_t fid);
+int Complete9(int tag);
+bool Done9(int tag);
+bool Idle9(void);
+bool Pinned9(void);
+int Hold9(const void *addr, uint32_t count, bool create);
+void Unhold9(int held);
+int SubmitWalk9(uint32_t fid, uint32_t newfid, uint16_t nwname, const char *const *name, uint16_t *retnwqid, struct Qid9 *retqid);
+int SubmitWalkPath9(uint32_t fid, uint32_t newfid, const char *path);
+int SubmitGetattr9(uint32_t fid, uint64_t request_mask, struct Stat9 *ret);
+int SubmitRead9(uint32_t fid, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
+int SubmitWrite9(uint32_t fid, const void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
 int Lock9(uint32_t fid, uint8_t type, uint32_t flags, uint64_t start, uint64_t length, uint32_t procid, const char *clientid, uint8_t *retstatus);
@@ -0,0 +1,75 @@
+/* Copyright (c) 2024 Elliot Nunn */
+/* Licensed under the MIT license */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "allocator.h"
+#include "cleanup.h"
+#include "panic.h"
+
+#include "arena.h"
+
+enum {
+	MAXPAGES = 128,
+	ALIGN = 16,
+};
+
+static char *base;
+static size_t npages, top;
+static uint32_t phys[MAXPAGES];
+
+bool ArenaInit(size_t bytes) {
+	if (base != NULL) return true;
+
+	npages = (bytes + 0xfff) / 0x1000;
+	if (npages > MAXPAGES) panic("arena too big");
+
+	base = AllocPages(npages, phys);
+	if (base == NULL) return false;
+
+	RegisterCleanupVoidPtr(FreePages, base);
+	top = 0;
+	return true;
+}
+
+void *ArenaPush(size_t bytes) {
+	bytes = (bytes + ALIGN - 1) & ~(ALIGN - 1);
+	if (base == NULL || top + bytes > npages * 0x1000) panic("arena full");
+
+	void *ret = base + top;
+	top += bytes;
+	return ret;
+}
+
+void ArenaPop(void *ptr) {
+	top = (char *)ptr - base;
+}
+
+int ArenaPhysical(const void *addr, uint32_t count, uint32_t *physaddrs, uint32_t *sizes, int max) {
+	const char *p = addr;
+	if (base == NULL || p < base || p + count > base + npages * 0x1000) return -1;
+
+	int n = 0;
+	size_t off = p - base;
+	while (count != 0) {
+		uint32_t pa = phys[off / 0x1000] + off % 0x1000;
+		uint32_t len = 0x1000 - off % 0x1000;
+		if (len > count) len = count;
+
+		// Merge physically adjacent pages into one extent
+		if (n != 0 && physaddrs[n-1] + sizes[n-1] == pa) {
+			sizes[n-1] += len;
+		} else {
+			if (n == max) panic("too discontiguous");
+			physaddrs[n] = pa;
+			sizes[n] = len;
+			n++;
+		}
+
+		off += len;
+		count -= len;
+	}
+	return n;
+}
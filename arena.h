@@ -0,0 +1,23 @@
+/* Copyright (c) 2024 Elliot Nunn */
+/* Licensed under the MIT license */
+
+// Driver-wide memory that is locked and translated once at startup,
+// so I/O buffers carved from it need no LockMemory/GetPhysical per request.
+// Allocation is stack-like: ArenaPop frees everything pushed since.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Allocate the arena (once per driver), false on failure
+bool ArenaInit(size_t bytes);
+
+// Panics if the arena is full
+void *ArenaPush(size_t bytes);
+void ArenaPop(void *ptr);
+
+// If the range is inside the arena, fill in its physical extents and return the count,
+// otherwise return -1 (the caller must lock and translate it the slow way)
+int ArenaPhysical(const void *addr, uint32_t count, uint32_t *phys, uint32_t *sizes, int max);
@@ -8,15 +8,25 @@ but the rest of the world requires a textual path. Bridge this gap.
 This database is accessed intensively but can also grow arbitrarily large,
 so we devote some complexity to spilling from RAM to disk when needed.
 
+Spilled entries go to a single hash table file, .classicvirtio.nosync.noindex/catalog.db,
+which survives reboots. Each hash bucket is one 8 KB block of 128-byte records.
+A bucket is append-only, and the last record for a CNID wins, so a spill costs one
+Twrite and a lookup one Tread. Full buckets are compacted, then chained to overflow
+blocks at the end of the file.
+
 There is a tiny bit of trickiness about files that get their name-cases changed!
 */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
 #include <Errors.h>
+#include <LowMem.h>
+#include <Memory.h>
 
 #include "9p.h"
+#include "arena.h"
 #include "fids.h"
 #include "panic.h"
 #include "printf.h"
@@ -25,71 +35,154 @@ There is a tiny bit of trickiness about files that get their name-cases changed!
 #include "catalog.h"
 
 enum {
-	CATALOGFID = FIRSTFID_CATALOG,
-	TMPFID,
+	CATALOGFID = FIRSTFID_CATALOG, // catalog.db, open read-write
+	WALKFID, // for callers that pass NOFID
 
 	// tunable:
-	BUCKETS = 32,
-	BUCKETSLOTS = 32,
-	BUCKETBYTES = 300,
+	MINBUCKETS = 32, // power of two
+	MAXBUCKETS = 2048, // power of two, but really limited by the system heap
+	BUCKETSLOTS = 32, // power of two
+	BUCKETBYTES = 1024,
+	MAXDEPTH = 1024, // directories between a CNID and the root
+	WALKELS = 256, // components in a Pascal path, with room to spare
+	WALKBYTES = 1024, // and the UTF-8 bytes they expand to
+	DENTRIES = 128, // power of two
+	DENTRYTTL = 120, // ticks that a lookup, or a failed one, stays trustworthy without asking the server
+	DBBUCKETS = 1024, // power of two
+	DBBLOCK = 8192,
+	DBREC = 128,
+	DBSLOTS = DBBLOCK / DBREC, // slot 0 of each block is its header
+	DBMAGIC = 'CDB1',
+	DBUNKNOWN = 0xff, // fill of a bucket not yet read this session
 };
 
-struct slot {
+// Block 0 of catalog.db, followed by the buckets, followed by overflow blocks
+struct dbheader {
+	uint32_t magic;
+	uint32_t buckets;
+	uint32_t blocks; // the file's length in blocks
+};
+
+// Slot 0 of each block
+struct dbblockheader {
+	uint32_t next; // overflow block number, 0 if none
+};
+
+// Slots 1 onward of each block, cnid 0 if empty
+struct dbrec {
 	int32_t cnid;
 	int32_t parent;
+	char name[DBREC - 8];
+};
+
+struct slot {
+	int32_t cnid; // zero if the slot is empty
+	int32_t parent;
+	uint32_t used; // bucket clock when last touched, for LRU eviction
+	uint16_t offset; // of the packed name
 	bool dirty; // can't discard without saving to disk
-	uint16_t offset;
 };
 
+// Slots are open-addressed by CNID, with linear probing.
+// Names are packed in the order they were added, each as reuse[1] suffix[s] NUL[1],
+// where the first "reuse" bytes are borrowed from the name before (like sortdir.c pack).
 struct bucket {
 	struct slot slots[BUCKETSLOTS];
 	uint16_t usedSlots, usedBytes;
+	uint32_t clock;
 	char names[BUCKETBYTES];
 };
 
+// A walk of one name, so the same lookup can be answered without 9P traffic
+struct dentry {
+	int32_t parent; // zero if the entry is empty
+	int32_t cnid; // fnfErr if the name does not exist
+	uint32_t when; // ticks
+	uint32_t version; // negative entries only: the parent's qid version, zero if unknown
+	char name[MAXNAME];
+};
+
 static bool isAbsolute(int32_t cnid, const unsigned char *path);
-static int bubbleUp(int bucket, int slot);
-static int spill(int bucket);
+static int32_t dirFid(int32_t cnid, uint32_t *retfid, bool *retowned, bool *retcached);
+static void releaseDir(uint32_t fid, bool owned);
+static void spill(int bucket);
 static int unspill(int bucket, int32_t cnid);
+static bool dbGet(int32_t cnid, struct dbrec *ret);
+static void dbPut(int32_t cnid, int32_t parent, const char *name);
+static void dbCompact(int bucket, char *block);
 static int whichBucket(int32_t cnid);
-static int whichSlot(int bucket, uint32_t cnid);
-static char *slotName(int bucket, int slot);
-static void deleteSlotName(int bucket, int slot);
+static int homeSlot(int32_t cnid);
+static int whichSlot(int bucket, int32_t cnid);
+static int newSlot(int bucket, int32_t cnid);
+static void removeSlot(int bucket, int slot);
+static void unpackName(struct bucket *b, int offset, char *before, char *at);
+static int nameLen(struct bucket *b, int offset);
+static int appendName(struct bucket *b, const char *name);
+static void deleteName(struct bucket *b, int offset);
+static int commonPrefix(const char *a, const char *b);
 static bool ciEqual(const char *a, const char *b);
-
-static struct bucket cache[BUCKETS];
+static int32_t fastWalk(int32_t cnid, const unsigned char *paspath, int32_t *retparent, char *retname);
+static struct dentry *whichDentry(int32_t parent, const char *name);
+static int32_t dentryGet(int32_t parent, const char *name);
+static void dentrySet(int32_t parent, const char *name, int32_t cnid);
+static void dentrySetNegative(int32_t parent, const char *name, uint32_t version);
+static void dentrySeen(int32_t cnid, uint32_t version);
+
+static struct bucket *cache;
+static int buckets;
+static struct dentry dentries[DENTRIES];
 static struct Qid9 rootQID;
-static char *lastSetName;
+static char lastSetName[MAXNAME];
+static struct dbheader dbhdr;
+static uint8_t dbFill[DBBUCKETS]; // next free slot in the bucket's last block
+static uint32_t dbTail[DBBUCKETS]; // the bucket's last block
 
 void CatalogInit(struct Qid9 root) {
-	int err = Mkdir9(DOTDIRFID, 0777, 0, "catalog", NULL);
-	if (err && err!=EEXIST)
-		panic("failed create /catalog");
+	uint32_t got = 0;
+	if (!WalkPath9(DOTDIRFID, CATALOGFID, "catalog.db") &&
+		!Lopen9(CATALOGFID, O_RDWR, NULL, NULL)) {
+		Read9(CATALOGFID, &dbhdr, 0, sizeof dbhdr, &got);
+	}
+
+	// Missing or unrecognisable, so start afresh
+	if (got != sizeof dbhdr || dbhdr.magic != DBMAGIC || dbhdr.buckets != DBBUCKETS) {
+		WalkPath9(DOTDIRFID, CATALOGFID, "");
+		if (Lcreate9(CATALOGFID, O_RDWR|O_TRUNC|O_CREAT, 0666, 0, "catalog.db", NULL, NULL))
+			panic("failed create catalog.db");
+		dbhdr = (struct dbheader){.magic=DBMAGIC, .buckets=DBBUCKETS, .blocks=1+DBBUCKETS};
+		if (Write9(CATALOGFID, &dbhdr, 0, sizeof dbhdr, NULL))
+			panic("failed write catalog.db");
+	}
 
-	if (WalkPath9(DOTDIRFID, CATALOGFID, "catalog"))
-		panic("failed walk /catalog");
+	memset(dbFill, DBUNKNOWN, sizeof dbFill);
+
+	// As many buckets as the system heap can comfortably spare
+	long budget = MaxBlockSys() / 4;
+	buckets = MAXBUCKETS;
+	while (buckets > MINBUCKETS && buckets * sizeof (struct bucket) > budget) {
+		buckets /= 2;
+	}
+	while ((cache = (struct bucket *)NewPtrSysClear(buckets * sizeof (struct bucket))) == NULL) {
+		if (buckets == MINBUCKETS) panic("failed catalog allocation");
+		buckets /= 2;
+	}
+	printf("Catalog cache: %d buckets of %d\n", buckets, BUCKETSLOTS);
 
 	rootQID = root;
 }
 
 // Only dumps the RAM part of the catalog
 void CatalogDump(void) {
-	for (int bucket=0; bucket<BUCKETS; bucket++) {
-		printf("% 3d: ", bucket);
-		for (int i=0; i<cache[bucket].usedBytes; i++) {
-			if (cache[bucket].names[i] == 0) {
-				printf(".");
-			} else {
-				printf("%c", cache[bucket].names[i]);
-			}
-		}
-		printf("\n");
-		for (int slot=0; slot<cache[bucket].usedSlots; slot++) {
+	for (int bucket=0; bucket<buckets; bucket++) {
+		struct bucket *b = &cache[bucket];
+		if (b->usedSlots == 0) continue;
+		printf("% 4d: %d slots, %d bytes\n", bucket, b->usedSlots, b->usedBytes);
+		for (int slot=0; slot<BUCKETSLOTS; slot++) {
+			if (b->slots[slot].cnid == 0) continue;
+			char name[MAXNAME];
+			unpackName(b, b->slots[slot].offset, NULL, name);
 			printf("    %08x: (p=%08x, n=\"%s\", dirty=%d)\n",
-				cache[bucket].slots[slot].cnid,
-				cache[bucket].slots[slot].parent,
-				cache[bucket].names + cache[bucket].slots[slot].offset,
-				cache[bucket].slots[slot].dirty);
+				b->slots[slot].cnid, b->slots[slot].parent, name, b->slots[slot].dirty);
 		}
 	}
 }
@@ -98,57 +191,62 @@ void CatalogDump(void) {
 // On success return a CNID. On failure, returns bdNamErr/dirNFErr/fnfErr.
 // These can be distinguished using IsErr().
 int32_t CatalogWalk(uint32_t fid, int32_t cnid, const unsigned char *paspath, int32_t *retparent, char *retname) {
- 	if (paspath == NULL) paspath = (const unsigned char *)""; // happens all the time
-	const char *p = (const char *)paspath + 1;
-	const char *pend = (const char *)paspath + 1 + paspath[0];
+	if (paspath == NULL) paspath = (const unsigned char *)""; // happens all the time
 
 	printf("       CatalogWalk(%08x, \"%.*s\")\n", cnid, *paspath, paspath+1);
 	if (retname != NULL) retname[0] = 0; // assume failure
 	if (retparent != NULL) *retparent = 0; // assume failure
 
-	char scratch[512]; // enough bytes in the path?
-	char *el[32]; // surely that's deep enough
-	int nbyte = 0, nel = 0;
+	// Callers that don't need a fid might not need the server at all,
+	// and neither do lookups that are known to fail
+	int32_t fast = (fid == NOFID) ?
+		fastWalk(cnid, paspath, retparent, retname) :
+		fastWalk(cnid, paspath, NULL, NULL);
+	if (fast != 0 && (fid == NOFID || IsErr(fast))) {
+		printf("        cnid = %08x (cached)\n", fast);
+		return fast;
+	}
+	if (fid == NOFID) fid = WALKFID;
+
+	const char *p = (const char *)paspath + 1;
+	const char *pend = (const char *)paspath + 1 + paspath[0];
+
+	// Walk from the root, or from a fid for the directory given by ID
+	uint32_t startfid = ROOTFID;
+	bool startowned = false, startcached = false;
+	int32_t startcnid = 2;
 
 	if (isAbsolute(cnid, paspath)) { // absolute path, strip disk name (it's ours)
 		if (p<pend && *p==':') p++; // one leading colon can be ignored
 		if (p==pend || *p==':') return fnfErr; // then text is absolutely mandatory
 		while (p<pend && *p!=':') p++;
-	} else { // relative path, convert the supplied CNID to a path using the database
+	} else { // relative path, use the database to get to the supplied CNID
 		if (!IsDir(cnid)) {
 			return fnfErr;
 		}
-		for (int32_t trail=cnid; trail!=2/*special "root" CNID*/;) {
-			if (nbyte+MAXNAME > sizeof scratch || nel == sizeof el/sizeof *el) {
-				return bdNamErr; // path too long
-			}
-			memmove(el+1, el, nel*sizeof *el); // yes this is O(n^2)
-			el[0] = scratch + nbyte;
-			nel++;
-			trail = CatalogGet(trail, scratch + nbyte);
-			if (IsErr(trail)) {
-				return fnfErr;
-			}
-			nbyte += strlen(scratch + nbyte) + 1;
+		int32_t err = dirFid(cnid, &startfid, &startowned, &startcached);
+		if (err) {
+			return err;
 		}
+		startcnid = cnid;
 	}
-	int nelByID = nel; // portion of path components found by ID
+
+	// A Pascal string can't overflow these
+	char *scratch = ArenaPush(WALKBYTES);
+	const char **el = ArenaPush(WALKELS * sizeof *el);
+	struct Qid9 *qids = ArenaPush(WALKELS * sizeof *qids);
+	int32_t *dirs = ArenaPush((WALKELS+1) * sizeof *dirs);
+	int nbyte = 0, nel = 0;
 
 	if (p<pend && *p==':') p++; // remove up to 1 leading colon
 
 	while (p<pend) {
 		if (*p != ':') { // process 1 textual component
-			if (nel == sizeof el/sizeof *el) {
-				return bdNamErr; // too many components
-			}
 			el[nel++] = scratch + nbyte;
 			while (p<pend && *p!=':') {
 				long uc = utf8char(*p++);
 				if (uc == '/') uc = ':';
 				do {
-					if (nbyte == sizeof scratch) {
-						return bdNamErr; // path too long
-					}
 					scratch[nbyte++] = uc & 0xff;
 					uc >>= 8;
 				} while (uc != 0);
@@ -161,89 +259,347 @@ int32_t CatalogWalk(uint32_t fid, int32_t cnid, const unsigned char *paspath, in
 		}
 
 		while (p<pend && *p==':') { // but more means dot-dot
-			if (nel == sizeof el/sizeof *el) {
-				return bdNamErr; // too many components
-			}
 			el[nel++] = "..";
 			p++;
 		}
 	}
 
-	struct Qid9 qids[sizeof el/sizeof *el];
 	uint16_t got = 0;
-	Walk9(ROOTFID, fid, nel, (const char *const *)el, &got, qids);
+	Walk9(startfid, fid, nel, el, &got, qids);
+
+	// The host might have removed or replaced the directory behind a cached fid,
+	// so forget it and try once more by way of the catalog, before believing the failure
+	if (got < nel && startcached) {
+		DirFidForget(startcnid);
+		releaseDir(startfid, startowned);
+		startfid = ROOTFID;
+		startowned = false;
+		int32_t err = dirFid(startcnid, &startfid, &startowned, &startcached);
+		if (err) {
+			cnid = err;
+			goto release;
+		}
+		got = 0;
+		Walk9(startfid, fid, nel, el, &got, qids);
+	}
 
 	for (int i=0; i<got-1; i++) { // Not allowed to ".." from a file
 		if ((qids[i].type&0x80) == 0) {
-			return dirNFErr;
+			cnid = dirNFErr;
+			goto release;
 		}
 	}
 
+	// A directory that changed might now contain names we thought were missing
+	for (int i=0; i<got; i++) {
+		if (qids[i].type & 0x80) dentrySeen(QID2CNID(qids[i]), qids[i].version);
+	}
+
 	if (got == nel-1) {
-		return fnfErr;
+		// Remember the missing name, unless dot-dots make the parent hard to pin down
+		// (the start directory is not among the qids, so its version is unknown)
+		bool dotdot = false;
+		for (int i=0; i<nel; i++) {
+			if (!strcmp(el[i], "..")) dotdot = true;
+		}
+		if (!dotdot) {
+			if (nel >= 2) {
+				dentrySetNegative(QID2CNID(qids[nel-2]), el[nel-1], qids[nel-2].version);
+			} else {
+				dentrySetNegative(startcnid, el[nel-1], 0);
+			}
+		}
+
+		cnid = fnfErr;
+		goto release;
 	} else if (got < nel) {
-		return dirNFErr;
-	} else if (nelByID>0 && cnid!=QID2CNID(qids[nelByID-1])) {
-		return fnfErr; // a new file has been moved into place, DB out of date!
-	}
-
-	// Fold dot-dots in the element list to ensure the DB
-	// connects the return CNID to the root, or it will be useless.
-	// (If there are dot-dots then the element list will be shortened.)
-	lastSetName = NULL;
-	int nelTotal = nel;
-	nel = nelByID; // rewind
-	for (int i=nelByID; i<nelTotal; i++) {
+		cnid = dirNFErr;
+		goto release;
+	}
+
+	// Fold dot-dots with a stack of directories, so that the DB
+	// connects every named CNID to its real parent.
+	// A dot-dot above the start is fine: the server tells us where it landed.
+	lastSetName[0] = 0;
+	bool named = false; // is the top of the stack a name from this path?
+	int depth = 0;
+	dirs[0] = startcnid;
+	for (int i=0; i<nel; i++) {
 		if (!strcmp(el[i], "..")) {
-			nel--;
+			if (depth > 0) depth--;
+			else dirs[0] = QID2CNID(qids[i]);
+			named = false;
 		} else {
-			qids[nel] = qids[i];
-			el[nel] = el[i];
-			nel++;
-
-			CatalogSet(QID2CNID(qids[nel-1]), nel>=2 ? QID2CNID(qids[nel-2]) : 2, el[nel-1], false);
+			CatalogSet(QID2CNID(qids[i]), dirs[depth], el[i], false);
+			dentrySet(dirs[depth], el[i], QID2CNID(qids[i]));
+			dirs[++depth] = QID2CNID(qids[i]);
+			named = true;
 		}
 	}
+	cnid = dirs[depth];
 
 	// retname/retparent are optimisations to reduce subsequent costly CatalogGet calls.
-	if (retname != NULL) {
-		if (lastSetName != NULL) {
+	int32_t parent = 0;
+	if (named) {
+		if (retname != NULL) {
 			strcpy(retname, lastSetName); // lastSetName = the definitive-case name from CatalogSet
-		} else if (nel > 0) {
-			strcpy(retname, el[nel-1]);
-		} else {
-			CatalogGet(2, retname); // name of disk
 		}
+		parent = dirs[depth-1];
+	} else if (retname != NULL || retparent != NULL) {
+		parent = CatalogGet(cnid, retname); // name of a directory reached by ID or dot-dot (or the disk)
+		if (cnid == 2) parent = 1; // "parent of root"
+	}
+
+	if (retname != NULL) {
 		printf("        name = %s\n", retname);
 	}
 
 	if (retparent != NULL) {
-		if (nel == 0) {
-			*retparent = 1; // "parent of root"
-		} else if (nel == 1) {
-			*retparent = 2; // "root"
+		*retparent = parent;
+		printf("        parent = %08x\n", *retparent);
+	}
+
+	printf("        cnid = %08x\n", cnid);
+
+release:
+	ArenaPop(scratch);
+	releaseDir(startfid, startowned);
+	return cnid;
+}
+
+// Get a fid for a directory by CNID, walking down from the nearest ancestor with a cached fid,
+// and caching fids on the way so that next time it is a single lookup.
+// Release the fid with releaseDir. A fid straight from the cache (retcached) might be stale.
+static int32_t dirFid(int32_t cnid, uint32_t *retfid, bool *retowned, bool *retcached) {
+	*retfid = ROOTFID;
+	*retowned = false;
+	*retcached = false;
+	if (cnid == 2) return 0;
+
+	uint32_t fid = DirFidGet(cnid);
+	if (fid != NOFID) {
+		*retfid = fid;
+		*retcached = true;
+		return 0;
+	}
+
+	// Climb by CNID alone, to the root or to an ancestor with a cached fid
+	int32_t *up = ArenaPush(MAXDEPTH * sizeof *up);
+	char (*names)[MAXNAME] = ArenaPush(16 * MAXNAME);
+	int32_t err = 0;
+	bool fromroot = false; // after a cached ancestor fid proved stale
+	int n;
+	int32_t trail;
+	bool owned;
+retry:
+	n = 0;
+	trail = cnid;
+	owned = false;
+	fid = ROOTFID;
+	for (;;) {
+		if (n == MAXDEPTH) {
+			err = bdNamErr; // or a loop in the database
+			goto done;
+		}
+		up[n++] = trail;
+		trail = CatalogGet(trail, NULL);
+		if (IsErr(trail)) {
+			err = fnfErr;
+			goto done;
+		}
+		if (trail == 2) break;
+		if (!fromroot && (fid = DirFidGet(trail)) != NOFID) break;
+		fid = ROOTFID;
+	}
+	int32_t from = (fid == ROOTFID) ? 0 : trail; // the cached fid that the first step starts from
+
+	// Walk down 16 levels at a time (the most that Twalk carries)
+	// and cache a fid at the bottom of each step
+	while (n > 0) {
+		int step = (n < 16) ? n : 16;
+		const char *el[16];
+		struct Qid9 qids[16];
+		for (int i=0; i<step; i++) {
+			CatalogGet(up[n-1-i], names[i]); // all in RAM since the climb
+			el[i] = names[i];
+		}
+
+		uint32_t newfid = FidAlloc();
+		if (newfid == NOFID) panic("out of dynamic fids");
+
+		uint16_t got = 0;
+		int walkerr = Walk9(fid, newfid, step, el, &got, qids);
+		releaseDir(fid, owned);
+
+		bool wrong = !walkerr && QID2CNID(qids[step-1]) != up[n-step];
+		if (walkerr) {
+			FidFree(newfid); // the fid never came into being
+		} else if (wrong) {
+			Clunk9(newfid); // a new file has been moved into place, DB out of date!
+			FidFree(newfid);
+		}
+		if (walkerr || wrong) {
+			// The host might have moved or removed the ancestor behind a cached fid
+			if (from != 0) {
+				DirFidForget(from);
+				fromroot = true;
+				goto retry;
+			}
+			err = fnfErr;
+			goto done;
+		}
+		from = 0;
+
+		for (int i=0; i<step; i++) {
+			dentrySet(i>=1 ? up[n-i] : trail, el[i], up[n-1-i]);
+		}
+		trail = up[n-step];
+		n -= step;
+
+		if (DirFidAdd(trail, newfid)) {
+			fid = DirFidGet(trail);
+			owned = false;
 		} else {
-			*retparent = QID2CNID(qids[nel-2]);
+			fid = newfid;
+			owned = true;
 		}
-		printf("        parent = %08x\n", *retparent);
 	}
 
-	if (got > 0) {
-		cnid = QID2CNID(qids[got-1]);
+	*retfid = fid;
+	*retowned = owned;
+
+done:
+	ArenaPop(up);
+	return err;
+}
+
+static void releaseDir(uint32_t fid, bool owned) {
+	if (owned) {
+		Clunk9(fid);
+		FidFree(fid);
+	} else if (fid != ROOTFID) {
+		DirFidRelease(fid);
+	}
+}
+
+// Resolve a path using only recent lookups, returning 0 if any step is missing or stale.
+// The path syntax is the same as CatalogWalk.
+static int32_t fastWalk(int32_t cnid, const unsigned char *paspath, int32_t *retparent, char *retname) {
+	const char *p = (const char *)paspath + 1;
+	const char *pend = (const char *)paspath + 1 + paspath[0];
+
+	if (isAbsolute(cnid, paspath)) {
+		if (p<pend && *p==':') p++;
+		if (p==pend || *p==':') return fnfErr;
+		while (p<pend && *p!=':') p++;
+		cnid = 2;
 	} else {
-		cnid = 2; // root
+		if (!IsDir(cnid)) return fnfErr;
+
+		// The starting directory must itself have been seen recently
+		if (cnid != 2) {
+			char name[MAXNAME];
+			int32_t parent = CatalogGet(cnid, name);
+			if (IsErr(parent) || dentryGet(parent, name) != cnid) return 0;
+		}
 	}
-		printf("        cnid = %08x\n", cnid);
 
-	printf("        path = ");
-	for (int i=0; i<nel; i++) {
-		printf("/%s", el[i]);
+	if (p<pend && *p==':') p++;
+
+	while (p<pend) {
+		if (*p != ':') {
+			if (!IsDir(cnid)) return 0; // let the server produce the error
+
+			char name[MAXNAME];
+			int len = 0;
+			while (p<pend && *p!=':') {
+				long uc = utf8char(*p++);
+				if (uc == '/') uc = ':';
+				do {
+					if (len == MAXNAME-1) return 0;
+					name[len++] = uc & 0xff;
+					uc >>= 8;
+				} while (uc != 0);
+			}
+			name[len] = 0;
+
+			int32_t parent = cnid;
+			cnid = dentryGet(parent, name);
+			if (cnid == 0) return 0;
+
+			// Known to be missing, so fail the same way as CatalogWalk
+			// (dentrySeen drops the entry once a walk shows the directory changed)
+			if (cnid == fnfErr) {
+				if (p<pend && *p==':') p++;
+				return (p == pend) ? fnfErr : dirNFErr;
+			}
+		}
+
+		if (p<pend && *p==':') p++;
+
+		// Dot-dot relies on the catalog, which might be stale, so ask the server
+		if (p<pend && *p==':') return 0;
 	}
-	printf("\n");
 
+	// Same optimisation as CatalogWalk, with the definitive-case name
+	if (retparent != NULL || retname != NULL) {
+		int32_t parent = CatalogGet(cnid, retname);
+		if (cnid == 2) parent = 1; // "parent of root"
+		if (retparent != NULL) *retparent = parent;
+	}
 	return cnid;
 }
 
+// Direct mapped, so a collision just replaces the older entry
+static struct dentry *whichDentry(int32_t parent, const char *name) {
+	uint32_t hash = parent;
+	for (const char *c=name; *c!=0; c++) {
+		hash = hash * 31 + (unsigned char)*c;
+	}
+	return &dentries[hash & (DENTRIES - 1)];
+}
+
+static int32_t dentryGet(int32_t parent, const char *name) {
+	struct dentry *d = whichDentry(parent, name);
+	if (d->parent != parent || strcmp(d->name, name)) return 0;
+	if (LMGetTicks() - d->when > DENTRYTTL) return 0;
+	return d->cnid;
+}
+
+static void dentrySet(int32_t parent, const char *name, int32_t cnid) {
+	if (strlen(name) >= MAXNAME) return;
+
+	struct dentry *d = whichDentry(parent, name);
+	d->parent = parent;
+	d->cnid = cnid;
+	d->when = LMGetTicks();
+	d->version = 0;
+	strcpy(d->name, name);
+}
+
+static void dentrySetNegative(int32_t parent, const char *name, uint32_t version) {
+	if (strlen(name) >= MAXNAME) return;
+
+	dentrySet(parent, name, fnfErr);
+	whichDentry(parent, name)->version = version;
+}
+
+// Drop negative entries in a directory whose version has changed (or was never known),
+// using only the qids that walks return anyway
+static void dentrySeen(int32_t cnid, uint32_t version) {
+	for (int i=0; i<DENTRIES; i++) {
+		struct dentry *d = &dentries[i];
+		if (d->parent == cnid && d->cnid == fnfErr && d->version != version) {
+			d->parent = 0;
+		}
+	}
+}
+
+// Call after changing the namespace (the TTL takes care of changes by the host)
+void CatalogForgetNames(void) {
+	memset(dentries, 0, sizeof dentries);
+}
+
 // Hash a 31-bit CNID from a 64-bit 9P QID (approximately an inode number).
 // Negative CNIDs are reserved for MacOS error numbers,
 // and the 0x40000000 bit means "not a dir".
@@ -286,57 +642,54 @@ static bool isAbsolute(int32_t cnid, const unsigned char *path) {
 // "definitive" means "I am sure about the case"
 void CatalogSet(int32_t cnid, int32_t pcnid, const char *name, bool nameDefinitive) {
 	int bucket = whichBucket(cnid);
+	struct bucket *b = &cache[bucket];
 	int slot = whichSlot(bucket, cnid);
-	int namelen = strlen(name) + 1;
+	int room = strlen(name) + 2; // packed without reusing any prefix
 
 	if (slot < 0) {
 		// New slot (evict as many as we need to)
-		if (cache[bucket].usedSlots == BUCKETSLOTS) {
+		if (b->usedSlots == BUCKETSLOTS) {
 			spill(bucket);
 		}
-		while (cache[bucket].usedBytes + namelen > BUCKETBYTES) {
+		while (b->usedBytes + room > BUCKETBYTES) {
 			spill(bucket);
 		}
 
-		slot = cache[bucket].usedSlots++;
-		cache[bucket].slots[slot] = (struct slot){
+		slot = newSlot(bucket, cnid);
+		b->slots[slot] = (struct slot){
 			.cnid = cnid,
 			.parent = pcnid,
+			.used = ++b->clock,
 			.dirty = true,
-			.offset = cache[bucket].usedBytes,
+			.offset = appendName(b, name),
 		};
-		memcpy(slotName(bucket, slot), name, namelen);
-		cache[bucket].usedBytes += namelen;
-	} else {
-		// correct an existing entry (happens a lot because GetCatInfo is a pain)
-		if (cache[bucket].slots[slot].parent != pcnid) {
-			cache[bucket].slots[slot].parent = pcnid;
-			cache[bucket].slots[slot].dirty = true;
-		}
-
-		int oldnamelen = strlen(slotName(bucket, slot)) + 1;
-		if (namelen == oldnamelen) {
-			// Name length hasn't changed, so overwrite in place
-			// (unless the change is only to capitalisation)
-			if (nameDefinitive || !ciEqual(slotName(bucket, slot), name)) {
-				memcpy(slotName(bucket, slot), name, namelen);
-			}
-		} else {
-			// Name length has changed -- delete slots until we can fit the new name
-			deleteSlotName(bucket, slot);
-			while (cache[bucket].usedBytes + namelen > BUCKETBYTES) {
-				// trick... don't spill the one we're trying to expand!
-				if (slot == cache[bucket].usedSlots - 1) {
-					slot = bubbleUp(bucket, slot);
-				}
-				spill(bucket);
-			}
-			cache[bucket].slots[slot].offset = cache[bucket].usedBytes;
-			memcpy(slotName(bucket, slot), name, namelen);
-			cache[bucket].usedBytes += namelen;
-		}
+		strcpy(lastSetName, name);
+		return;
 	}
-	lastSetName = slotName(bucket, slot); // hack to reduce CatalogGet calls
+
+	// correct an existing entry (happens a lot because GetCatInfo is a pain)
+	struct slot *s = &b->slots[slot];
+	s->used = ++b->clock; // so that it is the last to be spilled
+	if (s->parent != pcnid) {
+		s->parent = pcnid;
+		s->dirty = true;
+	}
+
+	// Keep the old name if only the case differs, unless sure about the new case
+	unpackName(b, s->offset, NULL, lastSetName);
+	if (!strcmp(lastSetName, name) || (!nameDefinitive && ciEqual(lastSetName, name))) {
+		return;
+	}
+
+	// Renamed: repack the name at the end
+	s->dirty = true;
+	deleteName(b, s->offset);
+	while (b->usedBytes + room > BUCKETBYTES) {
+		spill(bucket);
+	}
+	slot = whichSlot(bucket, cnid); // spilling can move slots
+	b->slots[slot].offset = appendName(b, name);
+	strcpy(lastSetName, name);
 }
 
 int32_t CatalogGet(int32_t cnid, char *retname) {
@@ -354,121 +707,288 @@ int32_t CatalogGet(int32_t cnid, char *retname) {
 		return fnfErr;
 	}
 
-	slot = bubbleUp(bucket, slot);
+	struct slot *s = &cache[bucket].slots[slot];
+	s->used = ++cache[bucket].clock;
 	if (retname != NULL) {
-		strcpy(retname, slotName(bucket, slot));
+		unpackName(&cache[bucket], s->offset, NULL, retname);
 	}
-	return cache[bucket].slots[slot].parent;
+	return s->parent;
 }
 
-static int bubbleUp(int bucket, int slot) {
-	if (slot == 0) {
-		return 0;
+// Evict the least recently used slot, saving it to disk if necessary
+static void spill(int bucket) {
+	struct bucket *b = &cache[bucket];
+	int victim = -1;
+	uint32_t oldest = 0;
+	for (int i=0; i<BUCKETSLOTS; i++) {
+		if (b->slots[i].cnid == 0) continue;
+		uint32_t age = b->clock - b->slots[i].used;
+		if (victim < 0 || age > oldest) {
+			victim = i;
+			oldest = age;
+		}
 	}
+	if (victim < 0) panic("spill from empty catalog bucket");
 
-	struct slot tmp = cache[bucket].slots[slot];
-	cache[bucket].slots[slot] = cache[bucket].slots[slot-1];
-	cache[bucket].slots[slot-1] = tmp;
-
-	return slot - 1;
-}
-
-// Return the slot number that has been freed
-static int spill(int bucket) {
-	int killSlot = cache[bucket].usedSlots - 1;
-	char *name = slotName(bucket, killSlot);
-	int len = strlen(name) + 1;
-
-	// ephemeral file, "quick and dirty" format
-	if (cache[bucket].slots[killSlot].dirty) {
-		char spillFile[9];
-		sprintf(spillFile, "%08x", cache[bucket].slots[killSlot].cnid);
-		WalkPath9(CATALOGFID, TMPFID, "");
-		if (Lcreate9(TMPFID, O_WRONLY|O_TRUNC, 0666, 0, spillFile, NULL, NULL))
-			panic("failed create catalog ent");
-		if (Write9(TMPFID, &cache[bucket].slots[killSlot].parent, 0, 4, NULL))
-			panic("failed write catalog ent parent");
-		if (Write9(TMPFID, name, 4, len, NULL))
-			panic("failed write catalog ent name");
-		Clunk9(TMPFID);
+	struct slot *s = &b->slots[victim];
+	if (s->dirty) {
+		char name[MAXNAME];
+		unpackName(b, s->offset, NULL, name);
+		dbPut(s->cnid, s->parent, name);
 	}
 
-	deleteSlotName(bucket, killSlot);
-	cache[bucket].usedSlots--;
-	return killSlot;
+	deleteName(b, s->offset);
+	removeSlot(bucket, victim);
 }
 
 // Return the slot number it has been retrieved to
 static int unspill(int bucket, int32_t cnid) {
-	struct fileFormat {
-		int32_t parent;
-		char name[128];
-	};
-	struct fileFormat tmp;
-	char spillFile[9];
-	sprintf(spillFile, "%08x", cnid);
-
-	WalkPath9(CATALOGFID, TMPFID, spillFile);
-	if (Lopen9(TMPFID, O_RDONLY, NULL, NULL))
+	struct dbrec tmp;
+	if (!dbGet(cnid, &tmp))
 		return -1; // invalid CNIDs don't necessitate panic
-	uint32_t got = 0;
-	Read9(TMPFID, &tmp, 0, sizeof tmp, &got);
-	if (got == 0)
-		panic("failed read catalog ent hex");
-	Clunk9(TMPFID);
-
-	int namelen = got - 4;
 
 	// Evict enough other files to fit this one
-	if (cache[bucket].usedSlots == BUCKETSLOTS) {
+	struct bucket *b = &cache[bucket];
+	int room = strlen(tmp.name) + 2;
+	if (b->usedSlots == BUCKETSLOTS) {
 		spill(bucket);
 	}
-	while (cache[bucket].usedBytes + namelen > BUCKETBYTES) {
+	while (b->usedBytes + room > BUCKETBYTES) {
 		spill(bucket);
 	}
 
-	cache[bucket].slots[cache[bucket].usedSlots++] = (struct slot){
+	int slot = newSlot(bucket, cnid);
+	b->slots[slot] = (struct slot){
 		.cnid = cnid,
 		.parent = tmp.parent,
+		.used = ++b->clock,
 		.dirty = false,
-		.offset = cache[bucket].usedBytes,
+		.offset = appendName(b, tmp.name),
 	};
-	memcpy(cache[bucket].names + cache[bucket].usedBytes, tmp.name, namelen);
-	cache[bucket].usedBytes += namelen;
-	return cache[bucket].usedSlots - 1;
+	return slot;
 }
 
-static int whichBucket(int32_t cnid) {
-	return cnid & (BUCKETS - 1);
+// Read the bucket's chain of blocks for the latest record of this CNID,
+// learning where the next record for the bucket will go
+static bool dbGet(int32_t cnid, struct dbrec *ret) {
+	int bucket = cnid & (DBBUCKETS - 1);
+	char *block = ArenaPush(DBBLOCK);
+	bool found = false;
+
+	uint32_t blk = 1 + bucket;
+	for (;;) {
+		uint32_t got = 0;
+		Read9(CATALOGFID, block, (uint64_t)blk * DBBLOCK, DBBLOCK, &got);
+		memset(block + got, 0, DBBLOCK - got); // beyond the end of the file
+
+		int slot = 1;
+		for (; slot<DBSLOTS; slot++) {
+			struct dbrec *rec = (struct dbrec *)(block + slot*DBREC);
+			if (rec->cnid == 0) break;
+			if (rec->cnid == cnid) {
+				*ret = *rec;
+				found = true;
+			}
+		}
+
+		uint32_t next = ((struct dbblockheader *)block)->next;
+		if (next == 0) {
+			dbTail[bucket] = blk;
+			dbFill[bucket] = slot;
+			break;
+		}
+		blk = next;
+	}
+
+	ArenaPop(block);
+	return found;
 }
 
-static int whichSlot(int bucket, uint32_t cnid) {
-	for (int i=0; i<cache[bucket].usedSlots; i++) {
-		if (cache[bucket].slots[i].cnid == cnid) {
-			return i;
+// Append a record to the bucket, superseding any earlier one for the CNID
+static void dbPut(int32_t cnid, int32_t parent, const char *name) {
+	int bucket = cnid & (DBBUCKETS - 1);
+	struct dbrec rec = {.cnid=cnid, .parent=parent};
+	if (strlen(name) >= sizeof rec.name)
+		panic("catalog name too long");
+	strcpy(rec.name, name);
+
+	if (dbFill[bucket] == DBUNKNOWN) {
+		struct dbrec junk;
+		dbGet(cnid, &junk);
+	}
+
+	if (dbFill[bucket] == DBSLOTS) {
+		char *block = ArenaPush(DBBLOCK);
+		dbCompact(bucket, block);
+		ArenaPop(block);
+	}
+
+	// Still full of live records, so chain a new block to the end of the file
+	if (dbFill[bucket] == DBSLOTS) {
+		uint32_t blk = dbhdr.blocks++;
+		struct dbblockheader bh = {.next=blk};
+		if (Write9(CATALOGFID, &bh, (uint64_t)dbTail[bucket] * DBBLOCK, sizeof bh, NULL))
+			panic("failed write catalog.db");
+		Write9(CATALOGFID, &dbhdr, 0, sizeof dbhdr, NULL);
+		dbTail[bucket] = blk;
+		dbFill[bucket] = 1;
+	}
+
+	uint64_t at = (uint64_t)dbTail[bucket] * DBBLOCK + dbFill[bucket] * DBREC;
+	if (Write9(CATALOGFID, &rec, at, sizeof rec, NULL))
+		panic("failed write catalog.db");
+	dbFill[bucket]++;
+}
+
+// Keep only the latest record for each CNID in the bucket's last block
+static void dbCompact(int bucket, char *block) {
+	uint64_t at = (uint64_t)dbTail[bucket] * DBBLOCK;
+	uint32_t got = 0;
+	Read9(CATALOGFID, block, at, DBBLOCK, &got);
+	memset(block + got, 0, DBBLOCK - got);
+
+	int keep = 1;
+	for (int slot=1; slot<DBSLOTS; slot++) {
+		struct dbrec *rec = (struct dbrec *)(block + slot*DBREC);
+		bool superseded = false;
+		for (int later=slot+1; later<DBSLOTS; later++) {
+			if (((struct dbrec *)(block + later*DBREC))->cnid == rec->cnid) {
+				superseded = true;
+				break;
+			}
 		}
+		if (!superseded) {
+			memmove(block + keep*DBREC, rec, DBREC);
+			keep++;
+		}
+	}
+	if (keep == DBSLOTS) return;
+
+	memset(block + keep*DBREC, 0, (DBSLOTS-keep) * DBREC);
+	if (Write9(CATALOGFID, block, at, DBBLOCK, NULL))
+		panic("failed write catalog.db");
+	dbFill[bucket] = keep;
+}
+
+// Neighbouring CNIDs (often siblings, created together) share a bucket,
+// so that their names share prefixes
+static int whichBucket(int32_t cnid) {
+	return ((uint32_t)cnid >> 2) & (buckets - 1);
+}
+
+static int homeSlot(int32_t cnid) {
+	return ((uint32_t)cnid * 2654435761UL) >> 27 & (BUCKETSLOTS - 1);
+}
+
+static int whichSlot(int bucket, int32_t cnid) {
+	struct slot *slots = cache[bucket].slots;
+	for (int n=0, i=homeSlot(cnid); n<BUCKETSLOTS; n++, i=(i+1)&(BUCKETSLOTS-1)) {
+		if (slots[i].cnid == cnid) return i;
+		if (slots[i].cnid == 0) return -1;
 	}
 	return -1;
 }
 
-static char *slotName(int bucket, int slot) {
-	return cache[bucket].names + cache[bucket].slots[slot].offset;
+// The caller must have made room
+static int newSlot(int bucket, int32_t cnid) {
+	struct slot *slots = cache[bucket].slots;
+	int i = homeSlot(cnid);
+	while (slots[i].cnid != 0) {
+		i = (i+1) & (BUCKETSLOTS-1);
+	}
+	cache[bucket].usedSlots++;
+	return i;
 }
 
-// compact all the fellow slot names on the left
-// needs to be immediately followed by a repopulation of the slot name, or there will be corruption
-static void deleteSlotName(int bucket, int slot) {
-	char *names = cache[bucket].names;
-	int deleteAt = cache[bucket].slots[slot].offset;
-	int deleteLen = strlen(names + deleteAt) + 1;
-	memmove(names+deleteAt, names+deleteAt+deleteLen, cache[bucket].usedBytes-deleteAt-deleteLen);
-	for (int i=0; i<cache[bucket].usedSlots; i++) {
-		if (cache[bucket].slots[i].offset > deleteAt) {
-			cache[bucket].slots[i].offset -= deleteLen;
+// Close the gap by shifting back any later slot that may move, so probing still works
+static void removeSlot(int bucket, int slot) {
+	struct slot *slots = cache[bucket].slots;
+	int hole = slot;
+	for (int n=1; n<BUCKETSLOTS; n++) {
+		int i = (slot+n) & (BUCKETSLOTS-1);
+		if (slots[i].cnid == 0) break;
+		int home = homeSlot(slots[i].cnid);
+		if (((i-home) & (BUCKETSLOTS-1)) >= ((i-hole) & (BUCKETSLOTS-1))) {
+			slots[hole] = slots[i];
+			hole = i;
 		}
 	}
-	cache[bucket].slots[slot].offset = 0;
-	cache[bucket].usedBytes -= deleteLen;
+	slots[hole] = (struct slot){};
+	cache[bucket].usedSlots--;
+}
+
+// Unpack the names in order as far as this offset,
+// returning the name there and/or the name just before it
+static void unpackName(struct bucket *b, int offset, char *before, char *at) {
+	char name[MAXNAME] = "";
+	int pos = 0;
+	for (;;) {
+		if (pos == offset && before != NULL) strcpy(before, name);
+		if (pos >= b->usedBytes) {
+			if (at != NULL) at[0] = 0;
+			return;
+		}
+		strcpy(name + (uint8_t)b->names[pos], b->names + pos + 1);
+		if (pos == offset) {
+			if (at != NULL) strcpy(at, name);
+			return;
+		}
+		pos += nameLen(b, pos);
+	}
+}
+
+static int nameLen(struct bucket *b, int offset) {
+	return strlen(b->names + offset + 1) + 2;
+}
+
+// The caller must have made room, return the offset
+static int appendName(struct bucket *b, const char *name) {
+	char last[MAXNAME] = "";
+	if (b->usedBytes > 0) {
+		unpackName(b, b->usedBytes, last, NULL);
+	}
+
+	int offset = b->usedBytes;
+	int reuse = commonPrefix(last, name);
+	b->names[offset] = reuse;
+	strcpy(b->names + offset + 1, name + reuse);
+	b->usedBytes += nameLen(b, offset);
+	return offset;
+}
+
+// Remove a packed name, repacking the one after it, which might have borrowed from it
+static void deleteName(struct bucket *b, int offset) {
+	int deadlen = nameLen(b, offset);
+	int next = offset + deadlen;
+	int shrink = deadlen;
+
+	if (next < b->usedBytes) {
+		char before[MAXNAME], after[MAXNAME];
+		unpackName(b, offset, before, NULL);
+		unpackName(b, next, NULL, after);
+
+		int nextlen = nameLen(b, next);
+		int reuse = commonPrefix(before, after);
+		int newlen = strlen(after + reuse) + 2; // never longer than the two names it replaces
+		memmove(b->names + offset + newlen, b->names + next + nextlen, b->usedBytes - next - nextlen);
+		b->names[offset] = reuse;
+		memcpy(b->names + offset + 1, after + reuse, newlen - 1);
+		shrink = deadlen + nextlen - newlen;
+	}
+
+	for (int i=0; i<BUCKETSLOTS; i++) {
+		struct slot *s = &b->slots[i];
+		if (s->cnid == 0) continue;
+		if (s->offset == next) s->offset = offset;
+		else if (s->offset > next) s->offset -= shrink;
+	}
+	b->usedBytes -= shrink;
+}
+
+static int commonPrefix(const char *a, const char *b) {
+	int n = 0;
+	while (a[n] != 0 && a[n] == b[n] && n < 0x7f) n++;
+	return n;
 }
 
 // ASCII case-insens compare, happens to work for the Roman-ish letters in decomposed UTF-8
@@ -19,12 +19,16 @@
 #include <Start.h>
 #include <Traps.h>
 
+#include "arena.h"
 #include "callin68k.h"
+#include "callout68k.h"
 #include "catalog.h"
 #include "cleanup.h"
 #include "device.h"
 #include "extralowmem.h"
 #include "fids.h"
+#include "filecache.h"
+#include "interruptmask.h"
 #include "log.h"
 #include "multifork.h"
 #include "printf.h"
@@ -56,10 +60,10 @@ enum {
 	FID3,
 	FIDPERSIST,
 	FIDPROFILE,
-	FIDCOUNT,
 	WDLO = -32767,
 	WDHI = -4096,
 	STACKSIZE = 256 * 1024, // large stack bc memory is so hard to allocate
+	ASYNCSTACK = 64 * 1024, // for asyncPump and the completion routines it calls
 };
 
 struct longdqe {
@@ -74,18 +78,28 @@ struct longdqe {
 static void installDrive(void);
 static void removeDrive(void);
 static void installExtFS(void);
+static void installAsync(void);
+static long asyncQueue(struct IOParam *pb, long trap);
+static void asyncPump(void);
+static void asyncDeferred(void);
+static void asyncKick(void);
+static bool asyncStep(bool wait, bool block);
+static OSErr asyncStart(struct IOParam *pb, bool block);
+static bool asyncDirect(struct IOParam *pb, struct MyFCB *fcb);
+static bool asyncQuick(struct IOParam *pb, struct MyFCB *fcb);
+static void asyncSubmit(struct IOParam *pb, struct MyFCB *fcb);
+static OSErr asyncContinue(struct IOParam *pb);
+static int32_t startPos(struct IOParam *pb, struct MyFCB *fcb);
 static void getBootBlocks(void);
 static void useMountTag(const void *conf, char *retname, char *retformat);
 static void setDirPBInfo(struct DirInfo *pb, int32_t cnid, int32_t pcnid, const char *name, uint32_t fid);
 static void setFilePBInfo(struct HFileInfo *pb, int32_t cnid, int32_t pcnid, const char *name, uint32_t fid);
-static int16_t countDir(int fid, bool dirOK);
 static void updateKnownLength(struct MyFCB *fcb, int32_t length);
 static int32_t pbDirID(void *_pb);
 static struct WDCBRec *findWD(short refnum);
 static struct DrvQEl *findDrive(short num);
 static struct VCB *findVol(short num);
 static void pathSplitLeaf(const unsigned char *path, unsigned char *dir, unsigned char *name);
-static bool visName(const char *name);
 static int32_t mactime(int64_t unixtime);
 static long fsCall(void *pb, long selector);
 static OSErr fsDispatch(void *pb, unsigned short selector);
@@ -117,6 +131,47 @@ static struct VCB vcb = {
 	.vcbDirCnt = 1,
 	.vcbCtlBuf = CALLIN68K_C_ARG44_GLOBDEF(fsCall), // overload field with proc pointer
 };
+
+// Async reads and writes on our volume skip the File Manager queue,
+// so that a big transfer can be left in flight while the app carries on.
+// The queue is worked by asyncPump, on its own stack, when a call arrives
+// and in a deferred task once DNotified sees the reply. Either may be at interrupt time,
+// so they never lock memory or wait for the host: a call is only taken if its buffer is
+// already translated and the cache has nothing in flight on the fork, and if that changes
+// before it can start, accRun or the next File Manager call starts it instead.
+enum {
+	INFLIGHT = 1, // asyncStart and asyncContinue, like ioResult
+	LATER = 2, // asyncStart cannot start the call without blocking
+};
+static QHdr asyncq;
+static struct {
+	int tag; // the piece in flight, or -1
+	int held; // the translation of the caller buffer
+	int32_t start, pos, end;
+	uint32_t want, got;
+	bool write;
+} aio = {.tag = -1};
+static volatile bool stepping; // the head of the queue is being started or finished
+static volatile char pumping, kick; // for the asyncPump glue
+static int depth; // File Manager calls and accRun in progress
+static void *pump; // 68k glue that calls asyncPump on its own stack
+static volatile bool dtqueued;
+static DeferredTask dt = {
+	.qType = dtQType,
+	.dtAddr = CALLIN68K_C_ARG0_GLOBDEF(asyncDeferred),
+};
+
+// Call ioCompletion with the parameter block in A0 and the result in D0
+static const unsigned short completion[] = {
+	0x48e7, 0x3f3e, // movem.l d2-d7/a2-a6,-(sp)
+	0x206f, 0x0030, // move.l  48(sp),a0
+	0x202f, 0x0034, // move.l  52(sp),d0
+	0x2268, 0x000c, // move.l  ioCompletion(a0),a1
+	0x4e91,         // jsr     (a1)
+	0x4cdf, 0x7cfc, // movem.l (sp)+,d2-d7/a2-a6
+	0x4e75,         // rts
+};
+
 static struct GetVolParmsInfoBuffer vparms = {
 	.vMVersion = 1, // goes up to version 4
 	.vMAttrib = 0
@@ -161,6 +216,11 @@ int DriverWrite(IOParam *pb) {
 }
 
 void DNotified(uint16_t q, volatile uint32_t *retlen) {
+	// Finish an async call once the interrupt handlers are done
+	if (aio.tag >= 0 && Done9(aio.tag) && !dtqueued) {
+		dtqueued = true;
+		DTInstall(&dt);
+	}
 }
 
 void DConfigChange(void) {
@@ -204,6 +264,15 @@ int DriverStart(short refNum) {
 		goto openErr;
 	}
 
+	// Indirect descriptors allow a few megabytes per message
+	viobufs = QIndirect(0, 1024);
+
+	// Pinned memory for 9P headers (20k), the biggest internal buffer (the 100k readdir in sortdir.c)
+	// and the file data cache
+	if (!ArenaInit(138*1024 + FILECACHEBYTES)) {
+		printf("Arena allocation failure\n");
+		goto openErr;
+	}
 
 	// Start the 9P layer
 	int err9;
@@ -211,6 +280,7 @@ int DriverStart(short refNum) {
 		printf("9P layer failure\n");
 		goto openErr;
 	}
+	FileCacheInit();
 
 	struct Qid9 rootQID;
 	if ((err9 = Attach9(ROOTFID, (uint32_t)~0 /*auth=NOFID*/, "", "", 0, &rootQID)) != 0) {
@@ -384,6 +454,66 @@ static void installExtFS(void) {
 	}
 }
 
+// Patch _Read and _Write so that async calls on our volume come to asyncQueue
+// (each instance patches on top of the last, and passes on what is not its own)
+static void installAsync(void) {
+	char *stack = NewPtrSysClear(ASYNCSTACK);
+	if (stack == NULL) panic("failed async stack allocation");
+
+	printf("asyncPump glue: ");
+	pump = Patch68k(
+		0, // glue only, no vector
+		"PUMP: "
+		"4af9 %l "        // tas.b   pumping
+		"66 %BUSY "       // bne.s   BUSY
+		"2f38 0110 "      // move.l  StkLowPt,-(sp)
+		"42b8 0110 "      // clr.l   StkLowPt
+		"200f "           // move.l  sp,d0
+		"4ff9 %l "        // lea.l   stack,sp
+		"2f00 "           // move.l  d0,-(sp)
+		"4eb9 %l "        // jsr     asyncPump
+		"2e57 "           // move.l  (sp),sp
+		"21df 0110 "      // move.l  (sp)+,StkLowPt
+		"4239 %l "        // clr.b   pumping
+		"4a39 %l "        // tst.b   kick
+		"66 %PUMP "       // bne.s   PUMP
+		"BUSY: "
+		"4e75",           // rts
+
+		&pumping,
+		stack + ASYNCSTACK - 100,
+		CALLIN68K_C_ARG0_FUNCDEF(asyncPump),
+		&pumping,
+		&kick
+	);
+
+	for (int i=0; i<2; i++) {
+		printf("%s patch: ", i ? "_Write" : "_Read");
+		Patch68k(
+			i ? _Write : _Read,
+			"0801 000a "      // btst    #10,d1 (async trap)
+			"67 %PUNT "       // beq.s   PUNT
+			"4a78 0360 "      // tst.w   FSBusy
+			"66 %PUNT "       // bne.s   PUNT (keep order with queued calls)
+			"2f01 "           // move.l  d1,-(sp)
+			"2f08 "           // move.l  a0,-(sp)
+			"4eb9 %l "        // jsr     asyncQueue
+			"508f "           // addq.l  #8,sp
+			"4a80 "           // tst.l   d0
+			"66 %PUNT "       // bne.s   PUNT (not our volume)
+			"4eb9 %l "        // jsr     pump
+			"7000 "           // moveq   #0,d0
+			"4e75 "           // rts
+
+			"PUNT: "
+			"4ef9 %o ",       // jmp     original
+
+			CALLIN68K_C_ARG44_FUNCDEF(asyncQueue),
+			pump
+		);
+	}
+}
+
 // I want to be able to boot from a folder without MacOS "blessing" it
 // so I need to find the System file, extract boot 1 resource, and close it.
 // At this stage we are a drive, not a volume, so there is only block-level access
@@ -508,13 +638,21 @@ static OSErr fsMountVol(struct IOParam *pb) {
 	// Hack to show this volume in the Startup Disk cdev
 	dqe.dqe.dQFSID = 0;
 
-	// No more diskEvt spam
+	static bool asyncInstalled;
+	if (!asyncInstalled) {
+		installAsync();
+		asyncInstalled = true;
+	}
+
+	// No more diskEvt spam, and from now on accRun is only for writing back file data
 	(*GetDCtlEntry(drvrRefNum))->dCtlFlags &= ~dNeedTimeMask;
+	(*GetDCtlEntry(drvrRefNum))->dCtlDelay = 30; // ticks
 
 	return noErr;
 }
 
 static OSErr fsUnmountVol(struct IOParam *pb) {
+	FileCacheFlushAll();
 	UnivCloseAll();
 
 	// Close any WDs that pointed to me.
@@ -572,7 +710,7 @@ static OSErr fsGetVolInfo(struct XVolumeParam *pb) {
 
 	int err = CatalogWalk(FID1, cnid, NULL, NULL, NULL);
 	if (err < 0) return err;
-	vcb.vcbNmFls = pb->ioVNmFls = countDir(FID1, false);
+	vcb.vcbNmFls = pb->ioVNmFls = CountDirSorted(cnid, false);
 
 	return noErr;
 }
@@ -657,13 +795,19 @@ static void setDirPBInfo(struct DirInfo *pb, int32_t cnid, int32_t pcnid, const
 	pb->ioFlAttrib = ioDirMask;
 	memcpy(&pb->ioDrUsrWds, attr.finfo, sizeof pb->ioDrUsrWds);
 	pb->ioDrDirID = cnid;
-	pb->ioDrNmFls = countDir(fid, true);
+	pb->ioDrNmFls = CountDirSorted(cnid, true);
 	pb->ioDrCrDat = pb->ioDrMdDat = mactime(attr.unixtime);
 	memcpy(&pb->ioDrFndrInfo, attr.fxinfo, sizeof pb->ioDrFndrInfo);
 	pb->ioDrParID = pcnid;
 }
 
 static void setFilePBInfo(struct HFileInfo *pb, int32_t cnid, int32_t pcnid, const char *name, uint32_t fid) {
+	// The sizes come from the host, so write back pending data first
+	for (int rsrc=0; rsrc<2; rsrc++) {
+		struct MyFCB *fcb = UnivFirst(cnid, rsrc);
+		if (fcb != NULL) FileCacheFlush(fcb);
+	}
+
 	struct MFAttr attr;
 	MF.FGetAttr(cnid, fid, name, MF_DSIZE|MF_RSIZE|MF_TIME|MF_FINFO, &attr);
 
@@ -700,33 +844,12 @@ static void setFilePBInfo(struct HFileInfo *pb, int32_t cnid, int32_t pcnid, con
 	pb->ioFlParID = pcnid;
 }
 
-static int16_t countDir(int fid, bool dirOK) {
-	char scratch[40000];
-	uint64_t magic = 0;
-	uint32_t bytes = 0;
-	int16_t n = 0;
-	WalkPath9(fid, FIDCOUNT, "");
-	if (Lopen9(FIDCOUNT, O_RDONLY|O_DIRECTORY, NULL, NULL)) return 0;
-	while (Readdir9(FIDCOUNT, magic, sizeof scratch, &bytes, scratch), bytes>0) {
-		char *ptr = scratch;
-		while (ptr < scratch + bytes) {
-			char type = 0;
-			char childname[MAXNAME] = "";
-			DirRecord9(&ptr, NULL, &magic, &type, childname);
-			if (visName(childname) && (dirOK || type!=4)) n++;
-			if (n == 0x7fff) goto done;
-		}
-	}
-done:
-	Clunk9(FIDCOUNT);
-	return n;
-}
-
 // Set creator and type on files only
 // TODO set timestamps, the attributes byte (comes with AppleDouble etc)
 static OSErr fsSetFileInfo(struct HFileInfo *pb) {
 	char name[MAXNAME];
-	int32_t cnid = CatalogWalk(FID1, pbDirID(pb), pb->ioNamePtr, NULL, name);
+	int32_t parent;
+	int32_t cnid = CatalogWalk(FID1, pbDirID(pb), pb->ioNamePtr, &parent, name);
 	if (IsErr(cnid)) return cnid;
 
 	// TODO: mtime setting
@@ -734,11 +857,13 @@ static OSErr fsSetFileInfo(struct HFileInfo *pb) {
 	memcpy(attr.finfo, &pb->ioFlFndrInfo, sizeof pb->ioFlFndrInfo); // same field as ioDrUsrWds
 	memcpy(attr.fxinfo, &pb->ioFlXFndrInfo, sizeof pb->ioFlXFndrInfo); // same field as ioDrFndrInfo
 
+	SortedIndexHold(parent);
 	if (IsDir(cnid)) {
 		MF.DSetAttr(cnid, FID1, name, MF_FINFO, &attr);
 	} else {
 		MF.FSetAttr(cnid, FID1, name, MF_FINFO, &attr);
 	}
+	SortedIndexTouch(parent); // a new sidecar file changes the directory's mtime
 
 	return noErr;
 }
@@ -747,10 +872,9 @@ static OSErr fsSetVol(struct HFileParam *pb) {
 	if (pb->ioTrap & 0x200) {
 		// HSetVol: any directory is fair game,
 		// so check that the path exists and is really a directory
-		int32_t cnid = CatalogWalk(FID1, pbDirID(pb), pb->ioNamePtr, NULL, NULL);
+		int32_t cnid = CatalogWalk(NOFID, pbDirID(pb), pb->ioNamePtr, NULL, NULL);
 		if (IsErr(cnid)) return cnid;
 		if (!IsDir(cnid)) return dirNFErr;
-		Clunk9(FID1);
 
 		LMSetDefVCBPtr((Ptr)&vcb);
 		XLMSetDefVRefNum(vcb.vcbVRefNum);
@@ -777,7 +901,7 @@ static OSErr fsMakeFSSpec(struct HIOParam *pb) {
 
 	char name[MAXNAME];
 	int32_t cnid, parent;
-	cnid = CatalogWalk(FID1, pbDirID(pb), pb->ioNamePtr, &parent, name);
+	cnid = CatalogWalk(NOFID, pbDirID(pb), pb->ioNamePtr, &parent, name);
 	if (!IsErr(cnid)) {
 		// The target exists
 		if (cnid == 2) {
@@ -797,7 +921,7 @@ static OSErr fsMakeFSSpec(struct HIOParam *pb) {
 		pathSplitLeaf(pb->ioNamePtr, path, leaf);
 		if (leaf[0] == 0) return dirNFErr;
 
-		cnid = CatalogWalk(FID1, pbDirID(pb), path, NULL, NULL);
+		cnid = CatalogWalk(NOFID, pbDirID(pb), path, NULL, NULL);
 		if (IsErr(cnid)) return dirNFErr; // return cnid;
 
 		spec->vRefNum = vcb.vcbVRefNum;
@@ -870,6 +994,8 @@ static OSErr fsOpen(struct HIOParam *pb) {
 	else if (lerr == ENOENT) return fnfErr;
 	else if (lerr) return ioErr;
 
+	FileCacheOpen(fcb);
+	FileCacheFlush(fcb); // the fork might be open already
 	UnivEnlistFile(fcb);
 
 	uint64_t size;
@@ -888,6 +1014,7 @@ static OSErr fsGetEOF(struct IOParam *pb) {
 	}
 
 	uint64_t size;
+	FileCacheFlush(fcb);
 	MF.GetEOF(fcb, &size);
 	if (size > 0xfffffd00) size = 0xfffffd00;
 
@@ -905,10 +1032,17 @@ static OSErr fsSetEOF(struct IOParam *pb) {
 
 	long len = (uint32_t)pb->ioMisc;
 
+	// Might write the .rdump
+	int32_t parent = (fcb->fcbFlags & fcbResourceMask) ? CatalogGet(fcb->fcbFlNm, NULL) : 0;
+	if (parent > 0) SortedIndexHold(parent);
+
+	FileCacheFlush(fcb);
 	int err = MF.SetEOF(fcb, len);
 	if (err) panic("seteof error");
 
+	FileCacheSetEOF(fcb, len);
 	updateKnownLength(fcb, len);
+	if (parent > 0) SortedIndexTouch(parent);
 
 	return noErr;
 }
@@ -918,12 +1052,51 @@ static OSErr fsClose(struct IOParam *pb) {
 	if (fcb == NULL) {
 		return paramErr;
 	}
+	// Might write the .rdump
+	int32_t parent = (fcb->fcbFlags & fcbResourceMask) ? CatalogGet(fcb->fcbFlNm, NULL) : 0;
+	if (parent > 0) SortedIndexHold(parent);
+
+	FileCacheClose(fcb);
 	UnivDelistFile(fcb);
 	MF.Close(fcb);
+	if (parent > 0) SortedIndexTouch(parent);
 	fcb->fcbFlNm = 0;
 	return noErr;
 }
 
+static OSErr fsFlushFile(struct IOParam *pb) {
+	struct MyFCB *fcb = UnivGetFCB(pb->ioRefNum);
+	if (fcb == NULL) {
+		return paramErr;
+	}
+	FileCacheFlush(fcb);
+	return noErr;
+}
+
+static OSErr fsFlushVol(struct IOParam *pb) {
+	FileCacheFlushAll();
+	return noErr;
+}
+
+// Where a read or write begins, by the positioning mode
+static int32_t startPos(struct IOParam *pb, struct MyFCB *fcb) {
+	char seek = pb->ioPosMode & 3;
+	if (seek == fsFromStart) {
+		return pb->ioPosOffset;
+	} else if (seek == fsFromLEOF) {
+		// Check the on-disk EOF for concurrent modification
+		uint64_t cursize;
+		FileCacheFlush(fcb);
+		MF.GetEOF(fcb, &cursize);
+		updateKnownLength(fcb, cursize);
+		return fcb->fcbEOF + pb->ioPosOffset;
+	} else if (seek == fsFromMark) {
+		return fcb->fcbCrPs + pb->ioPosOffset;
+	} else { // fsAtMark
+		return fcb->fcbCrPs;
+	}
+}
+
 static OSErr fsRead(struct IOParam *pb) {
 	// Reads to ROM are get discarded
 	char scratch[512];
@@ -945,21 +1118,7 @@ static OSErr fsRead(struct IOParam *pb) {
 	}
 
 	int32_t start, end, pos;
-
-	char seek = pb->ioPosMode & 3;
-	if (seek == fsAtMark) {
-		pos = start = fcb->fcbCrPs;
-	} else if (seek == fsFromStart) {
-		pos = start = pb->ioPosOffset;
-	} else if (seek == fsFromLEOF) {
-		// Check the on-disk EOF for concurrent modification
-		uint64_t cursize;
-		MF.GetEOF(fcb, &cursize);
-		updateKnownLength(fcb, cursize);
-		pos = start = fcb->fcbEOF + pb->ioPosOffset;
-	} else if (seek == fsFromMark) {
-		pos = start = fcb->fcbCrPs + pb->ioPosOffset;
-	}
+	pos = start = startPos(pb, fcb);
 	end = pos + pb->ioReqCount;
 
 	// Cannot position before start of file (like OS 9, unlike OS 7)
@@ -979,10 +1138,9 @@ static OSErr fsRead(struct IOParam *pb) {
 		}
 	}
 
-	// Request the host
+	// Request the host (the 9P layer splits big requests)
 	while (pos != end) {
 		int32_t want = end - pos;
-		if (want > Max9) want = Max9;
 
 		char *buf = pb->ioBuffer + pos - start;
 
@@ -993,7 +1151,7 @@ static OSErr fsRead(struct IOParam *pb) {
 		}
 
 		uint32_t got = 0;
-		MF.Read(fcb, buf, pos, want, &got);
+		FileCacheRead(fcb, buf, pos, want, &got);
 
 		pos += got;
 		if (got != want) break;
@@ -1004,6 +1162,11 @@ static OSErr fsRead(struct IOParam *pb) {
 		updateKnownLength(fcb, pos);
 	}
 
+	// The caller buffer stays locked until accRun finds it idle
+	if (Pinned9()) {
+		(*GetDCtlEntry(drvrRefNum))->dCtlFlags |= dNeedTimeMask;
+	}
+
 	pb->ioPosOffset = fcb->fcbCrPs = pos;
 	pb->ioActCount = pos - start;
 	if (pos != end) {
@@ -1026,21 +1189,7 @@ static OSErr fsWrite(struct IOParam *pb) {
 	}
 
 	int32_t start, end, pos;
-
-	char seek = pb->ioPosMode & 3;
-	if (seek == fsAtMark) {
-		pos = start = fcb->fcbCrPs;
-	} else if (seek == fsFromStart) {
-		pos = start = pb->ioPosOffset;
-	} else if (seek == fsFromLEOF) {
-		// Check the on-disk EOF for concurrent modification
-		uint64_t cursize;
-		MF.GetEOF(fcb, &cursize);
-		updateKnownLength(fcb, cursize);
-		pos = start = fcb->fcbEOF + pb->ioPosOffset;
-	} else if (seek == fsFromMark) {
-		pos = start = fcb->fcbCrPs + pb->ioPosOffset;
-	}
+	pos = start = startPos(pb, fcb);
 	end = pos + pb->ioReqCount;
 
 	// Cannot position before start of file (like OS 9, unlike OS 7)
@@ -1053,10 +1202,9 @@ static OSErr fsWrite(struct IOParam *pb) {
 		printf("Write at offset %d of %d byte file: OS 9 would write junk data!\n", start, fcb->fcbEOF);
 	}
 
-	// Request the host
+	// Request the host (the 9P layer splits big requests)
 	while (pos != end) {
 		int32_t want = end - pos;
-		if (want > Max9) want = Max9;
 
 		char *buf = pb->ioBuffer + pos - start;
 
@@ -1068,7 +1216,7 @@ static OSErr fsWrite(struct IOParam *pb) {
 		}
 
 		uint32_t got = 0;
-		MF.Write(fcb, buf, pos, want, &got);
+		FileCacheWrite(fcb, buf, pos, want, &got);
 
 		pos += got;
 		if (got != want) panic("write call incomplete");
@@ -1079,11 +1227,196 @@ static OSErr fsWrite(struct IOParam *pb) {
 		updateKnownLength(fcb, pos);
 	}
 
+	// Small writes are held back until accRun, at the latest,
+	// which also unlocks the caller buffer if it stays idle
+	if (FileCacheBusy() || Pinned9()) {
+		(*GetDCtlEntry(drvrRefNum))->dCtlFlags |= dNeedTimeMask;
+	}
+
 	pb->ioPosOffset = fcb->fcbCrPs = pos;
 	pb->ioActCount = pos - start;
 	return noErr;
 }
 
+// Called by the _Read/_Write patch on the caller's stack, maybe at interrupt time:
+// take an async call on our volume, or return nonzero to pass it on
+static long asyncQueue(struct IOParam *pb, long trap) {
+	if (pb->ioRefNum <= 0) return 1; // drivers, without asking the File Manager
+	struct MyFCB *fcb = UnivGetFCB(pb->ioRefNum);
+	if (fcb == NULL || fcb->fcbFlNm == 0 || fcb->fcbVPtr != &vcb) return 1;
+
+	// The File Manager does the rest, and fsCall finishes the queue first
+	pb->ioTrap = trap;
+	if (!asyncQuick(pb, fcb)) return 1;
+
+	pb->ioResult = 1; // in progress
+	kick = 1;
+	Enqueue((QElemPtr)pb, &asyncq);
+
+	// In case nothing else gets round to it
+	(*GetDCtlEntry(drvrRefNum))->dCtlFlags |= dNeedTimeMask;
+	return 0;
+}
+
+// Start and finish queued calls as far as possible without waiting or blocking
+// (only ever called through the pump glue, so never reentered)
+static void asyncPump(void) {
+	kick = 0;
+	if (depth != 0) return; // the call or accRun we interrupted owns the cache
+	while (asyncStep(false, false)) {}
+}
+
+// Queued by DNotified
+static void asyncDeferred(void) {
+	dtqueued = false;
+	CALL0(void, pump);
+}
+
+static void asyncKick(void) {
+	if (asyncq.qHead != NULL && depth == 0) {
+		CALL0(void, pump);
+	}
+}
+
+// Advance the call at the head of the queue, and return true if it completed
+// (only block at task level: it may lock memory and make synchronous 9P calls)
+static bool asyncStep(bool wait, bool block) {
+	short sr = DisableInterrupts();
+	struct IOParam *pb = (struct IOParam *)asyncq.qHead;
+	bool mine = pb != NULL && !stepping;
+	if (mine) stepping = true;
+	ReenableInterrupts(sr);
+	if (!mine) return false; // nothing to do, or reentered mid-step
+
+	OSErr err = INFLIGHT;
+	if (aio.tag < 0) {
+		err = asyncStart(pb, block);
+	}
+	while (err == INFLIGHT && (wait || Done9(aio.tag))) {
+		err = asyncContinue(pb);
+	}
+
+	if (err != INFLIGHT && err != LATER) {
+		Dequeue((QElemPtr)pb, &asyncq);
+	}
+	stepping = false;
+	if (err == INFLIGHT || err == LATER) return false;
+
+	if (LogEnable) {
+		printf("%s", PBPrint(pb, pb->ioTrap|0xa000, err));
+	}
+
+	pb->ioResult = err;
+	if (pb->ioCompletion != NULL) {
+		CALL2(void, completion, struct IOParam *, pb, long, err);
+	}
+	return true;
+}
+
+// The cache finishes most calls at once, but big transfers are left in flight
+static OSErr asyncStart(struct IOParam *pb, bool block) {
+	struct MyFCB *fcb = UnivGetFCB(pb->ioRefNum);
+	bool write = (pb->ioTrap & 0xff) == (_Write & 0xff);
+
+	// Pinning the whole buffer means the pieces never lock or unlock memory
+	int held = -1;
+	if (block ? asyncDirect(pb, fcb) : asyncQuick(pb, fcb)) {
+		held = Hold9(pb->ioBuffer, pb->ioReqCount, block);
+	}
+	if (held < 0 && !block) return LATER;
+
+	if (LogEnable) {
+		printf("FS_%s", PBPrint(pb, pb->ioTrap|0xa000, 1));
+	}
+
+	if (held < 0) {
+		return write ? fsWrite(pb) : fsRead(pb);
+	}
+
+	pb->ioActCount = 0;
+	int32_t start = startPos(pb, fcb); // only blocks for fsFromLEOF
+
+	// Cannot position before start of file (like OS 9, unlike OS 7)
+	if (start < 0) {
+		Unhold9(held);
+		pb->ioPosOffset = fcb->fcbCrPs;
+		return posErr;
+	}
+
+	aio.held = held;
+	aio.start = aio.pos = start;
+	aio.end = start + pb->ioReqCount;
+	aio.write = write;
+	FileCachePrepare(fcb, pb->ioBuffer, start, pb->ioReqCount, write);
+	asyncSubmit(pb, fcb);
+	return INFLIGHT;
+}
+
+// Big enough to leave in flight
+static bool asyncDirect(struct IOParam *pb, struct MyFCB *fcb) {
+	bool write = (pb->ioTrap & 0xff) == (_Write & 0xff);
+	return fcb != NULL && pb->ioReqCount > 0 && pb->ioBuffer < LMGetROMBase() &&
+		FileCacheDirect(pb->ioReqCount, write);
+}
+
+// Can be started without blocking, so safe at interrupt time
+static bool asyncQuick(struct IOParam *pb, struct MyFCB *fcb) {
+	bool write = (pb->ioTrap & 0xff) == (_Write & 0xff);
+	if (!asyncDirect(pb, fcb)) return false;
+	if ((pb->ioPosMode & 3) == fsFromLEOF) return false; // asks the host for the EOF
+	if (write && (fcb->fcbFlags & fcbResourceMask)) return false; // the fork format may do 9P calls
+	if (!FileCacheQuiet(fcb)) return false;
+
+	int held = Hold9(pb->ioBuffer, pb->ioReqCount, false);
+	if (held < 0) return false;
+	Unhold9(held);
+	return true;
+}
+
+// Send the next piece, no bigger than the 9P layer can send in one go
+static void asyncSubmit(struct IOParam *pb, struct MyFCB *fcb) {
+	uint32_t len = aio.end - aio.pos;
+	if (len > Piece9) len = Piece9;
+
+	char *buf = pb->ioBuffer + (aio.pos - aio.start);
+	aio.want = len;
+	aio.got = 0;
+	aio.tag = aio.write ?
+		MF.SubmitWrite(fcb, buf, aio.pos, len, &aio.got) :
+		MF.SubmitRead(fcb, buf, aio.pos, len, &aio.got);
+}
+
+// Collect a piece, then send the next or finish up like fsRead/fsWrite
+// (the pieces lie in the held buffer, so this never blocks)
+static OSErr asyncContinue(struct IOParam *pb) {
+	struct MyFCB *fcb = UnivMustGetFCB(pb->ioRefNum);
+
+	Complete9(aio.tag); // an error leaves got at zero
+	aio.tag = -1;
+	aio.pos += aio.got;
+
+	if (aio.got == aio.want && aio.pos != aio.end) {
+		asyncSubmit(pb, fcb);
+		return INFLIGHT;
+	}
+
+	Unhold9(aio.held);
+	if (aio.write && aio.pos != aio.end) panic("write call incomplete");
+
+	// File proves longer or shorter than expected
+	if (aio.pos > fcb->fcbEOF || aio.pos < aio.end) {
+		updateKnownLength(fcb, aio.pos);
+	}
+
+	pb->ioPosOffset = fcb->fcbCrPs = aio.pos;
+	pb->ioActCount = aio.pos - aio.start;
+	if (aio.pos != aio.end) {
+		return eofErr;
+	} else {
+		return noErr;
+	}
+}
+
 static OSErr fsCreate(struct HFileParam *pb) {
 	unsigned char dir[256], name[256];
 	pathSplitLeaf(pb->ioNamePtr, dir, name);
@@ -1104,9 +1437,11 @@ static OSErr fsCreate(struct HFileParam *pb) {
 	int32_t parent = CatalogWalk(FID1, pbDirID(pb), dir, NULL, NULL);
 	if (IsErr(parent)) return parent;
 	else if (!IsDir(parent)) return dirNFErr;
+	SortedIndexHold(parent);
 
+	struct Qid9 qid;
 	if ((pb->ioTrap & 0xff) == (_Create & 0xff)) {
-		switch (Lcreate9(FID1, O_WRONLY|O_CREAT|O_EXCL, 0666, 0, uniname, NULL, NULL)) {
+		switch (Lcreate9(FID1, O_WRONLY|O_CREAT|O_EXCL, 0666, 0, uniname, &qid, NULL)) {
 		case 0:
 			break;
 		case EEXIST:
@@ -1115,7 +1450,6 @@ static OSErr fsCreate(struct HFileParam *pb) {
 			return ioErr;
 		}
 	} else {
-		struct Qid9 qid;
 		switch (Mkdir9(FID1, 0777, 0, uniname, &qid)) {
 		case 0:
 			break;
@@ -1130,6 +1464,8 @@ static OSErr fsCreate(struct HFileParam *pb) {
 		CatalogSet(cnid, parent, uniname, true/*definitive case*/);
 		pb->ioDirID = cnid;
 	}
+	CatalogForgetNames(); // the name is no longer missing
+	SortedIndexUpdate(parent, NULL, QID2CNID(qid), uniname);
 	return noErr;
 }
 
@@ -1144,10 +1480,18 @@ static OSErr fsDelete(struct HFileParam *pb) {
 		return fBsyErr;
 	}
 
+	SortedIndexHold(parent);
 	int err = MF.Del(FID1, name, IsDir(cnid));
 	if (err == EEXIST || err == ENOTEMPTY) return fBsyErr;
 	else if (err) return ioErr;
 
+	if (IsDir(cnid)) {
+		DirFidForget(cnid);
+		SortedIndexDelete(cnid);
+	}
+	CatalogForgetNames();
+	SortedIndexUpdate(parent, name, cnid, NULL);
+
 	return noErr;
 }
 
@@ -1177,6 +1521,7 @@ static OSErr fsRename(struct IOParam *pb) {
 	}
 
 	// Reserve the new filename atomically
+	SortedIndexHold(parent);
 	if (Lcreate9(FID2, O_WRONLY|O_CREAT|O_EXCL, 0644, 0, newNameU, NULL, NULL)) {
 		return dupFNErr;
 	}
@@ -1187,6 +1532,8 @@ static OSErr fsRename(struct IOParam *pb) {
 
 	// Update the database
 	CatalogSet(cnid, parent, newNameU, true/*definitive case*/);
+	CatalogForgetNames();
+	SortedIndexUpdate(parent, name, cnid, newNameU);
 
 	return noErr;
 }
@@ -1202,7 +1549,8 @@ static OSErr fsRename(struct IOParam *pb) {
 static OSErr fsCatMove(struct CMovePBRec *pb) {
 	// Move the file/directory with cnid1...
 	char name[MAXNAME];
-	int32_t cnid1 = CatalogWalk(FID1, pbDirID(pb), pb->ioNamePtr, NULL, name);
+	int32_t parent1;
+	int32_t cnid1 = CatalogWalk(FID1, pbDirID(pb), pb->ioNamePtr, &parent1, name);
 	if (IsErr(cnid1)) return cnid1;
 	if (cnid1 == 2) return bdNamErr; // can't move root
 
@@ -1214,6 +1562,8 @@ static OSErr fsCatMove(struct CMovePBRec *pb) {
 	if (!IsDir(cnid2)) return bdNamErr;
 
 	// Do it exclusively
+	SortedIndexHold(parent1);
+	SortedIndexHold(cnid2);
 	WalkPath9(FID2, FID3, "");
 	switch (Lcreate9(FID3, O_WRONLY|O_CREAT|O_EXCL, 0666, 0, name, NULL, NULL)) {
 	case 0:
@@ -1229,16 +1579,19 @@ static OSErr fsCatMove(struct CMovePBRec *pb) {
 	WalkPath9(FID1, FID1, "..");
 
 	int lerr = MF.Move(FID1, name, FID2, name);
+	CatalogForgetNames(); // even a failed move might have changed something
 	if (lerr == EINVAL) return badMovErr;
 	else if (lerr) return ioErr;
 
+	SortedIndexUpdate(parent1, name, cnid1, NULL);
+	SortedIndexUpdate(cnid2, NULL, cnid1, name);
 	return noErr;
 }
 
 // "Working directories" are a compatibility shim for apps expecting flat disks:
 // a table of fake volume reference numbers that actually refer to directories.
 static OSErr fsOpenWD(struct WDParam *pb) {
-	int32_t cnid = CatalogWalk(FID1, pbDirID(pb), pb->ioNamePtr, NULL, NULL);
+	int32_t cnid = CatalogWalk(NOFID, pbDirID(pb), pb->ioNamePtr, NULL, NULL);
 	if (IsErr(cnid)) return cnid;
 	if (!IsDir(cnid)) return fnfErr;
 
@@ -1285,7 +1638,7 @@ static OSErr fsCloseWD(struct WDParam *pb) {
 }
 
 static OSErr fsCreateFileIDRef(struct FIDParam *pb) {
-	int32_t cnid = CatalogWalk(FID1, pbDirID(pb), pb->ioNamePtr, NULL, NULL);
+	int32_t cnid = CatalogWalk(NOFID, pbDirID(pb), pb->ioNamePtr, NULL, NULL);
 	if (IsErr(cnid)) {
 		pb->ioFileID = 0;
 		return cnid;
@@ -1390,10 +1743,6 @@ static void pathSplitLeaf(const unsigned char *path, unsigned char *dir, unsigne
 	}
 }
 
-static bool visName(const char *name) {
-	return (name[0] != '.' && !MF.IsSidecar(name));
-}
-
 static int32_t mactime(int64_t unixtime) {
 	struct MachineLocation loc;
 	ReadLocation(&loc);
@@ -1428,7 +1777,12 @@ static long fsCall(void *pb, long selector) {
 		printf("FS_%s", PBPrint(pb, selector, 1));
 	}
 
+	// Calls through the File Manager come after the async calls already taken
+	depth++;
+	while (asyncStep(true, true)) {}
 	OSErr result = fsDispatch(pb, selector);
+	depth--;
+	asyncKick(); // for calls taken while this one was in progress
 
 	if (LogEnable) {
 		printf("%s", PBPrint(pb, selector, result));
@@ -1456,7 +1810,7 @@ static OSErr fsDispatch(void *pb, unsigned short selector) {
 	case kFSMAllocate: return noErr;
 	case kFSMGetEOF: return fsGetEOF(pb);
 	case kFSMSetEOF: return fsSetEOF(pb);
-	case kFSMFlushVol: return noErr;
+	case kFSMFlushVol: return fsFlushVol(pb);
 	case kFSMGetVol: return extFSErr; // FM handles
 	case kFSMSetVol: return fsSetVol(pb);
 	case kFSMEject: return extFSErr;
@@ -1466,7 +1820,7 @@ static OSErr fsDispatch(void *pb, unsigned short selector) {
 	case kFSMRstFilLock: return noErr; // but this appeases ResEdit
 	case kFSMSetFilType: return extFSErr;
 	case kFSMSetFPos: return fsRead(pb);
-	case kFSMFlushFile: return noErr;
+	case kFSMFlushFile: return fsFlushFile(pb);
 	case kFSMOpenWD: return fsOpenWD(pb);
 	case kFSMCloseWD: return fsCloseWD(pb);
 	case kFSMCatMove: return fsCatMove(pb);
@@ -1560,6 +1914,20 @@ static OSErr fsDispatch(void *pb, unsigned short selector) {
 // But these events can be lost for various reasons so TN1189
 // advises repeatedly posting diskEvt at accRun time.
 static OSErr cAccRun(struct CntrlParam *pb) {
+	if (findVol(vcb.vcbVRefNum) == &vcb) {
+		depth++;
+		FileCacheIdle();
+		while (asyncStep(false, true)) {} // the calls that the pump could not start
+		bool pinned = Idle9();
+		depth--;
+
+		asyncKick();
+		if (!FileCacheBusy() && !pinned && asyncq.qHead == NULL) {
+			(*GetDCtlEntry(drvrRefNum))->dCtlFlags &= ~dNeedTimeMask;
+		}
+		return noErr;
+	}
+
 	PostEvent(diskEvt, dqe.dqe.dQDrive);
 	return noErr;
 }
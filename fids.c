@@ -0,0 +1,111 @@
+/* Copyright (c) 2024 Elliot Nunn */
+/* Licensed under the MIT license */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "9p.h"
+
+#include "fids.h"
+
+enum {
+	MAXDYNAMIC = 256,
+	DIRFIDS = 16,
+};
+
+struct dirfid {
+	int32_t cnid; // zero if the entry is empty
+	uint32_t fid;
+	uint16_t refs;
+	bool dead; // forgotten while in use, so clunk on release
+	uint32_t age;
+};
+
+static void drop(struct dirfid *e);
+
+static uint32_t dynamic[MAXDYNAMIC/32]; // bitmap of allocated fids
+static struct dirfid dirfids[DIRFIDS];
+static uint32_t dirclock;
+
+uint32_t FidAlloc(void) {
+	for (int i=0; i<MAXDYNAMIC; i++) {
+		if ((dynamic[i/32] & (1UL<<(i%32))) == 0) {
+			dynamic[i/32] |= 1UL<<(i%32);
+			return FIRSTFID_DYNAMIC + i;
+		}
+	}
+	return NOFID;
+}
+
+void FidFree(uint32_t fid) {
+	int i = fid - FIRSTFID_DYNAMIC;
+	dynamic[i/32] &= ~(1UL<<(i%32));
+}
+
+uint32_t DirFidGet(int32_t cnid) {
+	for (int i=0; i<DIRFIDS; i++) {
+		struct dirfid *e = &dirfids[i];
+		if (e->cnid == cnid && !e->dead) {
+			e->refs++;
+			e->age = ++dirclock;
+			return e->fid;
+		}
+	}
+	return NOFID;
+}
+
+void DirFidRelease(uint32_t fid) {
+	for (int i=0; i<DIRFIDS; i++) {
+		struct dirfid *e = &dirfids[i];
+		if (e->cnid != 0 && e->fid == fid) {
+			e->refs--;
+			if (e->refs == 0 && e->dead) drop(e);
+			return;
+		}
+	}
+}
+
+bool DirFidAdd(int32_t cnid, uint32_t fid) {
+	DirFidForget(cnid); // no duplicates
+
+	// Prefer an empty entry, otherwise the least recently used
+	struct dirfid *victim = NULL;
+	for (int i=0; i<DIRFIDS; i++) {
+		struct dirfid *e = &dirfids[i];
+		if (e->cnid == 0) {
+			victim = e;
+			break;
+		}
+		if (e->refs == 0 && (victim == NULL || e->age < victim->age)) {
+			victim = e;
+		}
+	}
+
+	// Every entry is in use, so don't cache this one
+	if (victim == NULL) {
+		return false;
+	}
+
+	if (victim->cnid != 0) drop(victim);
+	*victim = (struct dirfid){.cnid=cnid, .fid=fid, .age=++dirclock};
+	return true;
+}
+
+void DirFidForget(int32_t cnid) {
+	for (int i=0; i<DIRFIDS; i++) {
+		struct dirfid *e = &dirfids[i];
+		if (e->cnid == cnid && !e->dead) {
+			if (e->refs == 0) {
+				drop(e);
+			} else {
+				e->dead = true;
+			}
+		}
+	}
+}
+
+static void drop(struct dirfid *e) {
+	Clunk9(e->fid);
+	FidFree(e->fid);
+	*e = (struct dirfid){};
+}
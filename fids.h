@@ -1,5 +1,10 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// Fixed fids, partitioned by hand between modules
+// (open files use 32+refNum, and dynamic fids start at FIRSTFID_DYNAMIC)
 enum {
 	ROOTFID = 0,
 	DOTDIRFID = 1,
@@ -7,4 +12,19 @@ enum {
 	FIRSTFID_MULTIFORK = 8,
 	FIRSTFID_CATALOG = 16,
 	FIRSTFID_SORTDIR = 24,
+	FIRSTFID_DYNAMIC = 0x10000,
 };
+
+// Dynamic fids, returns NOFID when they run out
+// (FidFree does not clunk)
+uint32_t FidAlloc(void);
+void FidFree(uint32_t fid);
+
+// Recently walked directory fids, keyed by CNID and evicted least-recently-used.
+// DirFidGet returns NOFID or a fid that stays valid until DirFidRelease.
+// DirFidAdd takes over a freshly walked dynamic fid, or returns false if every entry is busy.
+// DirFidForget must be called when a directory is deleted.
+uint32_t DirFidGet(int32_t cnid);
+void DirFidRelease(uint32_t fid);
+bool DirFidAdd(int32_t cnid, uint32_t fid);
+void DirFidForget(int32_t cnid);
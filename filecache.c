@@ -0,0 +1,569 @@
+/* Copyright (c) 2024 Elliot Nunn */
+/* Licensed under the MIT license */
+
+// Apps read in small pieces, and every Tread is a virtio round trip,
+// so keep whole pages of recently read forks and read ahead of sequential streams.
+// Pages live in the arena, so they never need to be locked or translated.
+// They are recycled in ring order, which keeps a run of new pages contiguous
+// so that the run can be filled by a single read.
+// Small writes are likewise merged into one pending range per fork, which is written back
+// before anything that asks the host about that part of the fork, or when it goes stale.
+// Read-ahead and write-back are left in flight while the app carries on,
+// and only waited for when something depends on them.
+
+#include <string.h>
+#include <LowMem.h>
+
+#include "9p.h"
+#include "arena.h"
+#include "multifork.h"
+#include "panic.h"
+#include "universalfcb.h"
+
+#include "filecache.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum {
+	WBUF = 16*1024,
+	NWBUFS = 4,
+	WBSTALE = 30, // ticks before idle time writes back a range
+	PAGE = 4096,
+	NPAGES = (FILECACHEBYTES - NWBUFS*WBUF) / PAGE,
+	MAXRUN = NPAGES / 4, // the most pages to read in one go, including read-ahead
+	BYPASS = 32*1024, // reads this big go straight to the caller's buffer
+	NSTREAMS = 8,
+};
+
+struct page {
+	uint32_t cnid; // zero if the page is empty
+	uint32_t index; // offset / PAGE
+	uint16_t valid; // bytes, only short of PAGE at the EOF
+	bool rsrc;
+	bool loading; // part of the read-ahead in flight
+};
+
+// Writes to one fork, either pending (only ever one per fork) or in flight
+struct wbuf {
+	uint32_t cnid; // zero if the entry is clean
+	uint32_t start, len;
+	uint32_t when; // ticks at the first write
+	uint32_t age;
+	short refNum; // an open path to write through
+	bool rsrc;
+	bool inflight;
+	int tag; // 9P tag of the write in flight
+	uint32_t got;
+};
+
+// Per open path, to notice sequential reading
+struct stream {
+	short refNum; // zero if the entry is empty
+	uint32_t next; // where the last read ended
+	uint32_t ahead; // bytes to read past the next miss
+	uint32_t age;
+};
+
+// The read-ahead in flight, only one at a time
+struct prefetch {
+	int tag; // -1 if there is none
+	uint32_t cnid;
+	bool rsrc;
+	int slot, n; // pages
+	uint32_t got;
+};
+
+static void sequential(struct stream *s, uint32_t offset);
+static int fill(struct MyFCB *fcb, uint32_t first, int n);
+static void readAhead(struct MyFCB *fcb, uint32_t pos, uint32_t window);
+static void patch(struct MyFCB *fcb, const void *buf, uint32_t offset, uint32_t count);
+static struct wbuf *pending(uint32_t cnid, bool rsrc);
+static void flushFrom(struct MyFCB *fcb, uint32_t offset);
+static void flush(struct wbuf *w);
+static void settle(struct wbuf *w);
+static void settleFork(uint32_t cnid, bool rsrc);
+static void settlePrefetch(void);
+static void reap(void);
+static struct page *find(uint32_t cnid, bool rsrc, uint32_t index);
+static struct stream *stream(short refNum);
+static bool isRsrc(struct MyFCB *fcb);
+
+static char *data;
+static struct page pages[NPAGES];
+static int hand; // the next page to recycle
+static struct stream streams[NSTREAMS];
+static uint32_t streamclock;
+static struct prefetch pf = {.tag = -1};
+static char *wdata;
+static struct wbuf wbufs[NWBUFS];
+static uint32_t wclock;
+
+void FileCacheInit(void) {
+	data = ArenaPush(NPAGES * PAGE);
+	wdata = ArenaPush(NWBUFS * WBUF);
+}
+
+// The first open of a fork drops what we knew, because the host might have changed it
+void FileCacheOpen(struct MyFCB *fcb) {
+	bool rsrc = isRsrc(fcb);
+	if (UnivFirst(fcb->fcbFlNm, rsrc) == NULL) {
+		for (int i=0; i<NPAGES; i++) {
+			if (pages[i].cnid == fcb->fcbFlNm && pages[i].rsrc == rsrc) {
+				pages[i] = (struct page){};
+			}
+		}
+	}
+
+	struct stream *s = stream(fcb->refNum);
+	s->next = 0; // reading from the start is probably sequential
+	s->ahead = 0;
+}
+
+// Nothing may be left in flight through a closing path
+void FileCacheClose(struct MyFCB *fcb) {
+	FileCacheFlush(fcb);
+
+	for (int i=0; i<NSTREAMS; i++) {
+		if (streams[i].refNum == fcb->refNum) {
+			streams[i] = (struct stream){};
+		}
+	}
+}
+
+int FileCacheRead(struct MyFCB *fcb, void *buf, uint32_t offset, uint32_t count, uint32_t *actual) {
+	*actual = 0;
+	reap();
+
+	struct stream *s = stream(fcb->refNum);
+	sequential(s, offset);
+
+	// Big reads are already efficient
+	if (FileCacheDirect(count, false)) {
+		flushFrom(fcb, offset);
+		int err = MF.Read(fcb, buf, offset, count, actual);
+		s->next = offset + *actual;
+		return err;
+	}
+
+	bool rsrc = isRsrc(fcb);
+	uint32_t pos = offset, end = offset + count;
+	int err = 0;
+	while (pos < end) {
+		uint32_t index = pos / PAGE;
+		struct page *pg = find(fcb->fcbFlNm, rsrc, index);
+		if (pg != NULL && pg->loading) {
+			settlePrefetch();
+			pg = find(fcb->fcbFlNm, rsrc, index);
+		}
+		if (pg == NULL) {
+			int n = (end - 1) / PAGE - index + 1 + s->ahead / PAGE;
+			err = fill(fcb, index, n);
+			pg = find(fcb->fcbFlNm, rsrc, index);
+			if (pg == NULL) break; // nothing more to read
+		}
+
+		uint32_t in = pos - index * PAGE;
+		if (in >= pg->valid) break; // EOF
+
+		uint32_t n = pg->valid - in;
+		if (n > end - pos) n = end - pos;
+		memcpy((char *)buf + (pos - offset), data + (pg - pages) * PAGE + in, n);
+		pos += n;
+
+		if (pg->valid < PAGE && in + n == pg->valid) break; // EOF
+	}
+
+	*actual = pos - offset;
+	s->next = pos;
+
+	if (pos == end && s->ahead != 0) {
+		readAhead(fcb, pos, s->ahead);
+	}
+	return err;
+}
+
+int FileCacheWrite(struct MyFCB *fcb, const void *buf, uint32_t offset, uint32_t count, uint32_t *actual) {
+	bool rsrc = isRsrc(fcb);
+	*actual = 0;
+	reap();
+
+	// Read-ahead could land on top of the pages we are about to patch
+	if (pf.tag >= 0 && pf.cnid == fcb->fcbFlNm && pf.rsrc == rsrc) {
+		settlePrefetch();
+	}
+
+	// Extend or overwrite the pending range, if it stays contiguous and fits
+	struct wbuf *w = pending(fcb->fcbFlNm, rsrc);
+	if (w != NULL) {
+		if (offset >= w->start && offset <= w->start + w->len && offset + count - w->start <= WBUF) {
+			memcpy(wdata + (w - wbufs) * WBUF + (offset - w->start), buf, count);
+			if (offset + count > w->start + w->len) w->len = offset + count - w->start;
+			w->age = ++wclock;
+			goto done;
+		}
+		flush(w);
+	}
+
+	// Big writes are already efficient, but must follow the ones in flight
+	if (FileCacheDirect(count, true)) {
+		settleFork(fcb->fcbFlNm, rsrc);
+		int err = MF.Write(fcb, buf, offset, count, actual);
+		patch(fcb, buf, offset, *actual);
+		return err;
+	}
+
+	// Take a clean buffer, or free up the least recently used
+	w = NULL;
+	for (int i=0; i<NWBUFS; i++) {
+		if (wbufs[i].cnid == 0) {
+			w = &wbufs[i];
+			break;
+		}
+		if (w == NULL || wbufs[i].age < w->age) w = &wbufs[i];
+	}
+	if (w->cnid != 0) {
+		if (!w->inflight) flush(w);
+		settle(w);
+	}
+
+	*w = (struct wbuf){
+		.cnid = fcb->fcbFlNm,
+		.start = offset,
+		.len = count,
+		.when = LMGetTicks(),
+		.age = ++wclock,
+		.refNum = fcb->refNum,
+		.rsrc = rsrc,
+	};
+	memcpy(wdata + (w - wbufs) * WBUF, buf, count);
+
+done:
+	patch(fcb, buf, offset, count);
+	*actual = count;
+	return 0;
+}
+
+// Reads and writes this big skip the cache and go straight to the caller's buffer
+bool FileCacheDirect(uint32_t count, bool write) {
+	return write ? (count > WBUF / 2) : (count >= BYPASS);
+}
+
+// Before a direct transfer that the caller sends in pieces, without the cache:
+// order it after anything it depends on, and update the pages it overwrites
+void FileCachePrepare(struct MyFCB *fcb, const void *buf, uint32_t offset, uint32_t count, bool write) {
+	reap();
+
+	if (write) {
+		struct wbuf *w = pending(fcb->fcbFlNm, isRsrc(fcb));
+		if (w != NULL) flush(w);
+		settleFork(fcb->fcbFlNm, isRsrc(fcb));
+		patch(fcb, buf, offset, count);
+	} else {
+		struct stream *s = stream(fcb->refNum);
+		sequential(s, offset);
+		s->next = offset + count;
+		flushFrom(fcb, offset);
+	}
+}
+
+// Nothing pending or in flight on the fork, so FileCachePrepare will not wait
+// (and only touches memory, so it is safe at deferred task time)
+bool FileCacheQuiet(struct MyFCB *fcb) {
+	bool rsrc = isRsrc(fcb);
+	for (int i=0; i<NWBUFS; i++) {
+		if (wbufs[i].cnid == fcb->fcbFlNm && wbufs[i].rsrc == rsrc) return false;
+	}
+	return !(pf.tag >= 0 && pf.cnid == fcb->fcbFlNm && pf.rsrc == rsrc);
+}
+
+// Before asking the host anything about the fork
+void FileCacheFlush(struct MyFCB *fcb) {
+	struct wbuf *w = pending(fcb->fcbFlNm, isRsrc(fcb));
+	if (w != NULL) flush(w);
+	settleFork(fcb->fcbFlNm, isRsrc(fcb));
+}
+
+void FileCacheFlushAll(void) {
+	for (int i=0; i<NWBUFS; i++) {
+		if (wbufs[i].cnid != 0 && !wbufs[i].inflight) flush(&wbufs[i]);
+	}
+	for (int i=0; i<NWBUFS; i++) {
+		settle(&wbufs[i]);
+	}
+	settlePrefetch();
+}
+
+// At accRun time, finish whatever has arrived and start writing back stale ranges
+void FileCacheIdle(void) {
+	reap();
+	for (int i=0; i<NWBUFS; i++) {
+		struct wbuf *w = &wbufs[i];
+		if (w->cnid != 0 && !w->inflight && LMGetTicks() - w->when >= WBSTALE) flush(w);
+	}
+}
+
+// Pending writes, or anything in flight, need accRun to finish them
+bool FileCacheBusy(void) {
+	for (int i=0; i<NWBUFS; i++) {
+		if (wbufs[i].cnid != 0) return true;
+	}
+	return pf.tag >= 0;
+}
+
+void FileCacheSetEOF(struct MyFCB *fcb, uint32_t len) {
+	bool rsrc = isRsrc(fcb);
+
+	for (int i=0; i<NPAGES; i++) {
+		struct page *pg = &pages[i];
+		if (pg->cnid != fcb->fcbFlNm || pg->rsrc != rsrc) continue;
+
+		uint32_t pstart = pg->index * PAGE;
+		if (len <= pstart) {
+			*pg = (struct page){};
+		} else if (len - pstart < pg->valid) {
+			pg->valid = len - pstart;
+		} else if (pg->valid < PAGE) {
+			*pg = (struct page){}; // extended with zeros that we don't have
+		}
+	}
+}
+
+// Double the read-ahead while the reads are sequential
+static void sequential(struct stream *s, uint32_t offset) {
+	if (offset == s->next) {
+		s->ahead = (s->ahead == 0) ? PAGE : s->ahead * 2;
+		if (s->ahead > MAXRUN * PAGE) s->ahead = MAXRUN * PAGE;
+	} else {
+		s->ahead = 0;
+	}
+}
+
+// Update the pages that a write touched
+static void patch(struct MyFCB *fcb, const void *buf, uint32_t offset, uint32_t count) {
+	bool rsrc = isRsrc(fcb);
+	uint32_t end = offset + count;
+
+	for (int i=0; i<NPAGES; i++) {
+		struct page *pg = &pages[i];
+		if (pg->cnid != fcb->fcbFlNm || pg->rsrc != rsrc) continue;
+
+		uint32_t pstart = pg->index * PAGE, pend = pstart + PAGE;
+		if (end <= pstart) continue; // write is entirely before
+
+		if (offset >= pend) {
+			// A page that ended at the EOF is now followed by more data
+			if (pg->valid < PAGE) *pg = (struct page){};
+			continue;
+		}
+
+		uint32_t lo = (offset > pstart) ? offset : pstart;
+		uint32_t hi = (end < pend) ? end : pend;
+		if (lo - pstart > pg->valid) {
+			*pg = (struct page){}; // the gap before the write is not cached
+			continue;
+		}
+
+		memcpy(data + i * PAGE + (lo - pstart), (const char *)buf + (lo - offset), hi - lo);
+		if (hi - pstart > pg->valid) pg->valid = hi - pstart;
+	}
+}
+
+// Read a run of pages into consecutive slots with one call
+static int fill(struct MyFCB *fcb, uint32_t first, int n) {
+	bool rsrc = isRsrc(fcb);
+
+	// The ring is about to move, and might recycle the pages in flight
+	settlePrefetch();
+
+	if (n > MAXRUN) n = MAXRUN;
+	if (n * PAGE > Max9) n = Max9 / PAGE;
+
+	// Read ahead only as far as the known EOF, but the first page might exist anyway
+	uint32_t eofpages = (fcb->fcbEOF + PAGE - 1) / PAGE;
+	if (first + n > eofpages) n = (eofpages > first) ? eofpages - first : 1;
+
+	// Stop short of a page we already have
+	for (int i=1; i<n; i++) {
+		if (find(fcb->fcbFlNm, rsrc, first + i) != NULL) {
+			n = i;
+			break;
+		}
+	}
+
+	flushFrom(fcb, first * PAGE);
+
+	if (hand + n > NPAGES) hand = 0;
+	for (int i=0; i<n; i++) {
+		pages[hand+i] = (struct page){};
+	}
+
+	uint32_t got = 0;
+	int err = MF.Read(fcb, data + hand * PAGE, (uint64_t)first * PAGE, n * PAGE, &got);
+
+	for (int i=0; i<n && i*PAGE<got; i++) {
+		uint32_t valid = got - i*PAGE;
+		pages[hand+i] = (struct page){
+			.cnid = fcb->fcbFlNm,
+			.index = first + i,
+			.valid = (valid < PAGE) ? valid : PAGE,
+			.rsrc = rsrc,
+		};
+	}
+
+	hand = (hand + n) % NPAGES;
+	return err;
+}
+
+// Keep the next window of a sequential stream arriving in the background,
+// topping it up once less than half of it is cached
+static void readAhead(struct MyFCB *fcb, uint32_t pos, uint32_t window) {
+	if (pf.tag >= 0) return;
+
+	bool rsrc = isRsrc(fcb);
+	uint32_t first = pos / PAGE;
+	uint32_t last = (pos + window + PAGE - 1) / PAGE;
+	uint32_t eofpages = (fcb->fcbEOF + PAGE - 1) / PAGE;
+	if (last > eofpages) last = eofpages;
+
+	uint32_t i = first;
+	while (i < last && find(fcb->fcbFlNm, rsrc, i) != NULL) i++;
+	if (i >= last || (i - first) * PAGE >= window / 2) return;
+
+	int n = last - i;
+	if (n > MAXRUN) n = MAXRUN;
+	if (n * PAGE > Max9) n = Max9 / PAGE;
+	for (int j=1; j<n; j++) {
+		if (find(fcb->fcbFlNm, rsrc, i + j) != NULL) {
+			n = j;
+			break;
+		}
+	}
+
+	flushFrom(fcb, i * PAGE);
+
+	if (hand + n > NPAGES) hand = 0;
+	for (int j=0; j<n; j++) {
+		pages[hand+j] = (struct page){
+			.cnid = fcb->fcbFlNm,
+			.index = i + j,
+			.rsrc = rsrc,
+			.loading = true,
+		};
+	}
+
+	pf = (struct prefetch){.cnid = fcb->fcbFlNm, .rsrc = rsrc, .slot = hand, .n = n};
+	pf.tag = MF.SubmitRead(fcb, data + hand * PAGE, (uint64_t)i * PAGE, n * PAGE, &pf.got);
+
+	hand = (hand + n) % NPAGES;
+}
+
+static struct wbuf *pending(uint32_t cnid, bool rsrc) {
+	for (int i=0; i<NWBUFS; i++) {
+		if (wbufs[i].cnid == cnid && wbufs[i].rsrc == rsrc && !wbufs[i].inflight) {
+			return &wbufs[i];
+		}
+	}
+	return NULL;
+}
+
+// Writes at or after this offset would change what a host read returns,
+// even if they don't overlap, because the read would see the old EOF
+static void flushFrom(struct MyFCB *fcb, uint32_t offset) {
+	bool rsrc = isRsrc(fcb);
+	bool wait = false;
+	for (int i=0; i<NWBUFS; i++) {
+		struct wbuf *w = &wbufs[i];
+		if (w->cnid == fcb->fcbFlNm && w->rsrc == rsrc && w->start + w->len > offset) {
+			if (!w->inflight) flush(w);
+			wait = true;
+		}
+	}
+	if (wait) settleFork(fcb->fcbFlNm, rsrc);
+}
+
+// Start writing back a pending range, after any earlier write to the fork
+// (the server may run requests in any order)
+static void flush(struct wbuf *w) {
+	for (int i=0; i<NWBUFS; i++) {
+		if (wbufs[i].inflight && wbufs[i].cnid == w->cnid && wbufs[i].rsrc == w->rsrc) {
+			settle(&wbufs[i]);
+		}
+	}
+
+	struct MyFCB *fcb = UnivMustGetFCB(w->refNum);
+	w->inflight = true;
+	w->got = 0;
+	w->tag = MF.SubmitWrite(fcb, wdata + (w - wbufs) * WBUF, w->start, w->len, &w->got);
+}
+
+static void settle(struct wbuf *w) {
+	if (!w->inflight) return;
+	Complete9(w->tag);
+	if (w->got != w->len) panic("write-back incomplete");
+	*w = (struct wbuf){};
+}
+
+// Wait for everything in flight on the fork
+static void settleFork(uint32_t cnid, bool rsrc) {
+	for (int i=0; i<NWBUFS; i++) {
+		if (wbufs[i].cnid == cnid && wbufs[i].rsrc == rsrc) settle(&wbufs[i]);
+	}
+	if (pf.tag >= 0 && pf.cnid == cnid && pf.rsrc == rsrc) settlePrefetch();
+}
+
+static void settlePrefetch(void) {
+	if (pf.tag < 0) return;
+	Complete9(pf.tag); // an error leaves got at zero
+
+	for (int i=0; i<pf.n; i++) {
+		struct page *pg = &pages[pf.slot+i];
+		if (i*PAGE < pf.got) {
+			uint32_t valid = pf.got - i*PAGE;
+			pg->valid = (valid < PAGE) ? valid : PAGE;
+			pg->loading = false;
+		} else {
+			*pg = (struct page){};
+		}
+	}
+	pf.tag = -1;
+}
+
+// Finish whatever has already arrived, without waiting
+static void reap(void) {
+	for (int i=0; i<NWBUFS; i++) {
+		if (wbufs[i].inflight && Done9(wbufs[i].tag)) settle(&wbufs[i]);
+	}
+	if (pf.tag >= 0 && Done9(pf.tag)) settlePrefetch();
+}
+
+static struct page *find(uint32_t cnid, bool rsrc, uint32_t index) {
+	for (int i=0; i<NPAGES; i++) {
+		if (pages[i].cnid == cnid && pages[i].index == index && pages[i].rsrc == rsrc) {
+			return &pages[i];
+		}
+	}
+	return NULL;
+}
+
+// Find or recycle the entry for an open path
+static struct stream *stream(short refNum) {
+	struct stream *victim = &streams[0];
+	for (int i=0; i<NSTREAMS; i++) {
+		if (streams[i].refNum == refNum) {
+			victim = &streams[i];
+			goto found;
+		}
+		if (streams[i].age < victim->age) {
+			victim = &streams[i];
+		}
+	}
+	*victim = (struct stream){.refNum = refNum};
+found:
+	victim->age = ++streamclock;
+	return victim;
+}
+
+static bool isRsrc(struct MyFCB *fcb) {
+	return (fcb->fcbFlags & fcbResourceMask) != 0;
+}
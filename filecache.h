@@ -0,0 +1,32 @@
+/* Copyright (c) 2024 Elliot Nunn */
+/* Licensed under the MIT license */
+
+// Recently read file data, in pages keyed by fork, with read-ahead for sequential streams,
+// and small writes held back and merged.
+// The File Manager calls must tell the cache about every open, write, EOF change and close,
+// and must flush a fork before asking the host about its size.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "universalfcb.h"
+
+enum {
+	FILECACHEBYTES = 320*1024, // pages and write buffers, carved from the arena by FileCacheInit
+};
+
+void FileCacheInit(void);
+void FileCacheOpen(struct MyFCB *fcb);
+void FileCacheClose(struct MyFCB *fcb);
+int FileCacheRead(struct MyFCB *fcb, void *buf, uint32_t offset, uint32_t count, uint32_t *actual);
+int FileCacheWrite(struct MyFCB *fcb, const void *buf, uint32_t offset, uint32_t count, uint32_t *actual);
+bool FileCacheDirect(uint32_t count, bool write);
+void FileCachePrepare(struct MyFCB *fcb, const void *buf, uint32_t offset, uint32_t count, bool write);
+bool FileCacheQuiet(struct MyFCB *fcb);
+void FileCacheSetEOF(struct MyFCB *fcb, uint32_t len);
+void FileCacheFlush(struct MyFCB *fcb);
+void FileCacheFlushAll(void);
+void FileCacheIdle(void);
+bool FileCacheBusy(void);
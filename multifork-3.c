@@ -10,14 +10,21 @@ FILE.rdump = resource fork in Rez format
 FILE.idump = first 8 bytes of Finder info (i.e. type/creator)
 
 Directory metadata is discarded
+
+Resource forks are compiled from Rez format into .classicvirtio.nosync.noindex/rezcache,
+which survives reboots. Each CNID has a fork file and a -rezstat record of the .rdump it
+was made from (inode, size, mtime). The record is deleted while the fork is dirty,
+and records unused for a month are swept away along with their forks.
 */
 
 #include <string.h>
+#include <LowMem.h>
 #include <OSUtils.h>
 
 #include "9buf.h"
 #include "9p.h"
 #include "FSM.h"
+#include "arena.h"
 #include "catalog.h"
 #include "derez.h"
 #include "fids.h"
@@ -43,39 +50,79 @@ enum {
 	DIRTYFLAG = 1,
 };
 
+enum {
+	RSMAGIC = 'RST1',
+	RSTOUCH = 24*60*60, // seconds before a record in use gets a fresh timestamp
+	RSKEEP = 30*24*60*60, // seconds before an unused record and fork are swept
+	SWEEPEVERY = 24*60*60,
+	SWEEPBUF = 8192, // readdir buffer
+};
+
+// Which .rdump a cached fork was compiled from, as a raw struct in the -rezstat file
+struct rezstat {
+	uint32_t magic;
+	uint32_t used; // Mac clock, for the sweep
+	uint32_t nosidecar; // the fork is empty because there is no .rdump
+	uint32_t pad;
+	uint64_t path; // .rdump qid path, i.e. inode number
+	uint64_t size;
+	uint64_t mtime_sec, mtime_nsec;
+};
+
+// Attributes of recently seen files, so that repeated GetCatInfo calls
+// (Finder refreshes, StandardFile) skip reading the sidecar files,
+// and only walk them alongside the data fork stat to see if they changed
+enum {
+	NATTR = 64, // direct-mapped by CNID
+	ATTRFRESH = 60, // ticks to answer without asking the server at all
+};
+
+struct attr {
+	int32_t cnid; // 0 = empty slot
+	unsigned fields; // MF_ bits known to be valid
+	unsigned long checked; // ticks of the last data fork stat
+	uint64_t qidpath; // detects a file replaced under the same name
+	struct Qid9 iqid, rqid; // the .idump and .rdump as last read, zero if absent
+	uint64_t dsize, rsize;
+	int64_t dtime, rtime;
+	char finfo[16], fxinfo[16];
+};
+
+static struct attr attrs[NATTR];
+
 static void statResourceFork(int32_t cnid, uint32_t parentfid, const char *name, struct Stat9 *stat);
 static void pullResourceFork(int32_t cnid, uint32_t parentfid, const char *name, struct Stat9 *stat);
 static void pushResourceFork(int32_t cnid, uint32_t parentfid, const char *name);
+static bool readRezstat(const char *rsname, struct rezstat *rec);
+static void writeRezstat(const char *rsname, struct rezstat rec);
+static void markDirty(struct MyFCB *fcb);
+static void sweep(void);
+static void removeTree(uint32_t parentfid, const char *name, int depth);
 static int flagsToText(char *buf, const char finfo[16], const char fxinfo[16]);
 static void textToFlags(char finfo[16], char fxinfo[16], const char * text, int len);
 static uint32_t fidof(struct MyFCB *fcb);
+static struct attr *attrFind(int32_t cnid);
+static struct attr *attrSlot(int32_t cnid);
+static void attrGrow(int32_t cnid, bool rsrc, uint64_t size, bool exact);
+static void attrRecheck(void);
+static bool sameQid(struct Qid9 a, struct Qid9 b);
 // no need to prototype init3, open3 etc... they are used once at bottom of file
 
 static int init3(void) {
 	int err;
 
 	for (;;) { // essentially mkdir -p
-		err = WalkPath9(DOTDIRFID, DIRFID, "resforks");
+		err = WalkPath9(DOTDIRFID, DIRFID, "rezcache");
 		if (!err) break;
 		if (err != ENOENT) panic("unexpected mkdir-walk err");
-		err = Mkdir9(1, 0777, 0, "resforks", NULL);
+		err = Mkdir9(1, 0777, 0, "rezcache", NULL);
 		if (err && err != EEXIST)  panic("unexpected mkdir err");
 	}
 
-	// Linear-search for a free directory name; TODO: delete stale directories
-	for (uint32_t i=0;; i++) {
-		char name[MAXNAME];
-		sprintf(name, "%ld", i);
-		err = Mkdir9(DIRFID, 0777, 0, name, NULL);
-		if (!err) {
-			if (WalkPath9(DIRFID, DIRFID, name)) {
-				panic("unexpected mkdir-walk err");
-			}
-			break;
-		}
-	}
+	// Older versions made a new numbered directory on every boot
+	removeTree(DOTDIRFID, "resforks", 1);
 
-	// yay, now everything is discardable!
+	sweep();
 
 	return 0;
 }
@@ -128,13 +175,22 @@ static int read3(struct MyFCB *fcb, void *buf, uint64_t offset, uint32_t count,
 	return Read9(fidof(fcb), buf, offset, count, actual_count);
 }
 
+static int submitread3(struct MyFCB *fcb, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count) {
+	return SubmitRead9(fidof(fcb), buf, offset, count, actual_count);
+}
+
+// The attribute cache learns the new size straight away, expecting the write to succeed
+static int submitwrite3(struct MyFCB *fcb, const void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count) {
+	if (fcb->fcbFlags & fcbResourceMask) markDirty(fcb);
+	if (count) attrGrow(fcb->fcbFlNm, fcb->fcbFlags&fcbResourceMask, offset+count, false);
+	return SubmitWrite9(fidof(fcb), buf, offset, count, actual_count);
+}
+
 static int write3(struct MyFCB *fcb, const void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count) {
-	if ((fcb->fcbFlags & fcbResourceMask) && !(fcb->mfFlags & DIRTYFLAG)) {
-		for (struct MyFCB *i=UnivFirst(fcb->fcbFlNm, true); i!=NULL; i=UnivNext(fcb)) {
-			i->mfFlags |= DIRTYFLAG; // set it
-		}
-	}
-	return Write9(fidof(fcb), buf, offset, count, actual_count);
+	uint32_t got = 0;
+	int err = Complete9(submitwrite3(fcb, buf, offset, count, &got));
+	if (actual_count) *actual_count = got;
+	return err;
 }
 
 static int geteof3(struct MyFCB *fcb, uint64_t *len) {
@@ -147,12 +203,16 @@ static int geteof3(struct MyFCB *fcb, uint64_t *len) {
 }
 
 static int seteof3(struct MyFCB *fcb, uint64_t len) {
+	bool wasdirty = fcb->mfFlags&DIRTYFLAG;
+	if (fcb->fcbFlags & fcbResourceMask) markDirty(fcb);
+
 	int err = Setattr9(fidof(fcb), SET_SIZE, (struct Stat9){.size=len});
 	if (err) return err;
+	attrGrow(fcb->fcbFlNm, fcb->fcbFlags&fcbResourceMask, len, true);
 
 	// Take this as a promise that a resource file is consistent,
 	// and an opportunity to write it out
-	if ((fcb->fcbFlags&fcbResourceMask) && ((fcb->mfFlags&DIRTYFLAG) || len==0)) {
+	if ((fcb->fcbFlags&fcbResourceMask) && (wasdirty || len==0)) {
 		for (struct MyFCB *i=UnivFirst(fcb->fcbFlNm, true); i!=NULL; i=UnivNext(fcb)) {
 			i->mfFlags &= ~DIRTYFLAG; // clear it
 		}
@@ -173,50 +233,118 @@ int fgetattr3(int32_t cnid, uint32_t fid, const char *name, unsigned fields, str
 	// To be really clear, all these fields are zero until proven otherwise
 	memset(attr, 0, sizeof *attr);
 
-	// Costly: stat the data fork
-	// The data fork is essential, so this is the only operation that can make the function fail
-	if ((fields & MF_DSIZE) || (fields & MF_TIME)) {
-		struct Stat9 dstat = {};
-		int err = Getattr9(fid,
-			((fields & MF_DSIZE) ? STAT_SIZE : 0) |
-			((fields & MF_TIME) ? STAT_MTIME : 0),
-			&dstat);
-		if (err) return err;
+	struct attr *a = attrSlot(cnid);
+	unsigned long now = LMGetTicks();
+
+	// Very recently checked, so answer from RAM
+	if ((fields & ~a->fields) == 0 && now - a->checked < ATTRFRESH) goto answer;
+
+again:;
+	unsigned need = fields & ~a->fields;
+
+	unsigned have = need | a->fields;
+
+	// These requests are independent, so put them in flight together
+	int stattag = -1, parenttag = -1, finfotag = -1, rdumptag = -1;
+
+	// Cheap: stat the data fork, which also revalidates the rest of the entry
+	struct Stat9 dstat = {};
+	stattag = SubmitGetattr9(fid, STAT_SIZE|STAT_MTIME, &dstat);
 
-		attr->dsize = dstat.size;
-		attr->unixtime = dstat.mtime_sec;
+	if (need & (MF_RSIZE|MF_TIME|MF_FINFO)) {
+		parenttag = SubmitWalkPath9(fid, PARENTFID, "..");
 	}
 
-	if ((fields & MF_RSIZE) || (fields & MF_TIME) || (fields & MF_FINFO)) {
-		WalkPath9(fid, PARENTFID, "..");
+	// The sidecar qids change with their contents, so walking them is enough
+	// to tell whether what we read from them still applies
+	char iname[MAXNAME+8], rname[MAXNAME+8];
+	sprintf(iname, "%s.idump", name);
+	sprintf(rname, "%s.rdump", name);
+	const char *ipath[2] = {"..", iname}, *rpath[2] = {"..", rname};
+	struct Qid9 iqids[2] = {}, rqids[2] = {};
+
+	if (have & MF_FINFO) {
+		finfotag = SubmitWalk9(fid, FINFOFID, 2, ipath, NULL, iqids);
+	}
+
+	if (have & (MF_RSIZE|MF_TIME)) {
+		rdumptag = SubmitWalk9(fid, REZFID, 2, rpath, NULL, rqids);
 	}
 
+	// The data fork is essential, so this is the only operation that can make the function fail
+	int err = 0;
+	if (stattag >= 0) err = Complete9(stattag);
+	if (parenttag >= 0) Complete9(parenttag);
+	bool finfowalked = finfotag >= 0 && !Complete9(finfotag);
+	bool rdumpwalked = rdumptag >= 0 && !Complete9(rdumptag);
+	struct Qid9 iqid = finfowalked ? iqids[1] : (struct Qid9){};
+	struct Qid9 rqid = rdumpwalked ? rqids[1] : (struct Qid9){};
+	if (err) {
+		if (finfowalked) Clunk9(FINFOFID);
+		a->cnid = 0;
+		return err;
+	}
+
+	// A different file now has this name, so none of the cached sidecar info applies
+	if (a->fields != 0 && a->qidpath != dstat.qid.path) {
+		if (finfowalked) Clunk9(FINFOFID);
+		a->fields = 0;
+		goto again;
+	}
+
+	// The host has changed a sidecar since we read it
+	unsigned stale = 0;
+	if ((a->fields & MF_FINFO) && !sameQid(a->iqid, iqid)) stale |= MF_FINFO;
+	if ((a->fields & (MF_RSIZE|MF_TIME)) && !sameQid(a->rqid, rqid)) stale |= MF_RSIZE|MF_TIME;
+	if (stale) {
+		if (finfowalked) Clunk9(FINFOFID);
+		a->fields &= ~stale;
+		goto again;
+	}
+
+	a->checked = now;
+	a->qidpath = dstat.qid.path;
+	a->dsize = dstat.size;
+	a->dtime = dstat.mtime_sec;
+	a->fields |= MF_DSIZE;
+
 	// Very costly: ensure the resource fork has been Rezzed into the cache
-	if ((fields & MF_RSIZE) || (fields & MF_TIME)) {
+	if (need & (MF_RSIZE|MF_TIME)) {
 		struct Stat9 rstat = {};
 		statResourceFork(cnid, PARENTFID, name, &rstat);
 
-		attr->rsize = rstat.size;
-		if (attr->unixtime < rstat.mtime_sec) attr->unixtime = rstat.mtime_sec;
+		a->rsize = rstat.size;
+		a->rtime = rstat.mtime_sec;
+		a->rqid = rqid;
+		a->fields |= MF_RSIZE|MF_TIME;
 	}
 
 	// Costly: read the Finder info
-	if (fields & MF_FINFO) {
-		char ipath[MAXNAME+12];
-		sprintf(ipath, "../%s.idump", name);
-
-		if (!WalkPath9(fid, FINFOFID, ipath)
-				&&
-				!Lopen9(FINFOFID, O_RDONLY, NULL, NULL)) {
+	if (need & MF_FINFO) {
+		memset(a->finfo, 0, sizeof a->finfo);
+		memset(a->fxinfo, 0, sizeof a->fxinfo);
+		if (finfowalked && !Lopen9(FINFOFID, O_RDONLY, NULL, NULL)) {
 			uint32_t len = 0;
 			char buffer[512];
 			Read9(FINFOFID, buffer, 0, sizeof buffer-1, &len);
 			Clunk9(FINFOFID);
 			buffer[len] = 0;
-			textToFlags(attr->finfo, attr->fxinfo, buffer, len);
+			textToFlags(a->finfo, a->fxinfo, buffer, len);
 		}
+		a->iqid = iqid;
+		a->fields |= MF_FINFO;
+	} else if (finfowalked) {
+		Clunk9(FINFOFID);
 	}
 
+answer:
+	if (fields & MF_DSIZE) attr->dsize = a->dsize;
+	if (fields & MF_RSIZE) attr->rsize = a->rsize;
+	if (fields & MF_TIME) attr->unixtime = a->dtime > a->rtime ? a->dtime : a->rtime;
+	if (fields & MF_FINFO) {
+		memcpy(attr->finfo, a->finfo, sizeof attr->finfo);
+		memcpy(attr->fxinfo, a->fxinfo, sizeof attr->fxinfo);
+	}
 	return 0;
 }
 
@@ -243,6 +371,14 @@ int fsetattr3(int32_t cnid, uint32_t fid, const char *name, unsigned fields, con
 		err = Write9(FINFOFID, blob, 0, len, NULL);
 		if (err) return err;
 
+		// Our own change, so keep the cached copy in step rather than re-reading it
+		struct attr *a = attrFind(cnid);
+		struct Stat9 st = {};
+		if (a && (a->fields & MF_FINFO) && !Getattr9(FINFOFID, STAT_MTIME, &st)) {
+			textToFlags(a->finfo, a->fxinfo, blob, len);
+			a->iqid = st.qid;
+		}
+
 		Clunk9(FINFOFID);
 	}
 
@@ -261,6 +397,7 @@ int dsetattr3(int32_t cnid, uint32_t fid, const char *name, unsigned fields, con
 }
 
 static int move3(uint32_t fid1, const char *name1, uint32_t fid2, const char *name2) {
+	attrRecheck();
 	int err = Renameat9(fid1, name1, fid2, name2);
 	if (err) return err;
 
@@ -279,6 +416,7 @@ static int move3(uint32_t fid1, const char *name1, uint32_t fid2, const char *na
 }
 
 static int del3(uint32_t fid, const char *name, bool isdir) {
+	attrRecheck();
 	WalkPath9(fid, TMPFID, "..");
 
 	if (isdir) {
@@ -314,6 +452,8 @@ struct MFImpl MF3 = {
 	.Close = &close3,
 	.Read = &read3,
 	.Write = &write3,
+	.SubmitRead = &submitread3,
+	.SubmitWrite = &submitwrite3,
 	.GetEOF = &geteof3,
 	.SetEOF = &seteof3,
 	.FGetAttr = &fgetattr3,
@@ -342,26 +482,24 @@ static void statResourceFork(int32_t cnid, uint32_t parentfid, const char *name,
 	sprintf(rsname, "%08lx-rezstat", cnid);
 	sprintf(sidecarname, "%s.rdump", name);
 
-	if (WalkPath9(DIRFID, CLEANRECFID, rsname)) {
+	struct rezstat expect = {};
+	if (!readRezstat(rsname, &expect)) {
 		printf("(because no -rezstat file) ");
 		pullResourceFork(cnid, parentfid, name, stat);
 		return;
 	}
 
-	struct Stat9 expect = {};
-	if (Lopen9(CLEANRECFID, O_RDONLY, NULL, NULL)) {
-		panic("could not open existing -rezstat");
+	// Keep the record from being swept while it is still useful
+	if ((uint32_t)LMGetTime() - expect.used > RSTOUCH) {
+		writeRezstat(rsname, expect);
 	}
-	uint32_t statfilesize = 0;
-	Read9(CLEANRECFID, &expect, 0, sizeof expect, &statfilesize);
-	Clunk9(CLEANRECFID);
 
 	bool nosidecar = WalkPath9(parentfid, REZFID, sidecarname) != 0;
-	if (statfilesize==0 && nosidecar) {
+	if (expect.nosidecar && nosidecar) {
 		printf("resource fork cache agreed empty\n");
 		memset(stat, 0, sizeof *stat); // agree, empty resource fork
 		return;
-	} else if (statfilesize==0) {
+	} else if (expect.nosidecar) {
 		printf("(because rdump newly created) ");
 		pullResourceFork(cnid, parentfid, name, stat);
 		return;
@@ -373,7 +511,8 @@ static void statResourceFork(int32_t cnid, uint32_t parentfid, const char *name,
 
 	struct Stat9 scstat = {};
 	Getattr9(REZFID, STAT_SIZE|STAT_MTIME, &scstat);
-	if (scstat.size!=expect.size || scstat.mtime_sec!=expect.mtime_sec || scstat.mtime_nsec!=expect.mtime_nsec) {
+	if (scstat.qid.path!=expect.path || scstat.size!=expect.size ||
+		scstat.mtime_sec!=expect.mtime_sec || scstat.mtime_nsec!=expect.mtime_nsec) {
 		printf("(because of stat mismatch) ");
 		pullResourceFork(cnid, parentfid, name, stat);
 		return;
@@ -402,12 +541,7 @@ static void pullResourceFork(int32_t cnid, uint32_t parentfid, const char *name,
 		Lcreate9(RESFORKFID, O_WRONLY|O_TRUNC, 0666, 0, forkname, NULL, NULL);
 		Clunk9(RESFORKFID);
 
-		// empty cleanrecfid
-		WalkPath9(DIRFID, CLEANRECFID, "");
-		if (Lcreate9(CLEANRECFID, O_WRONLY|O_TRUNC, 0666, 0, rsname, NULL, NULL)) {
-			panic("failed create empty rezstat file");
-		}
-		Clunk9(CLEANRECFID);
+		writeRezstat(rsname, (struct rezstat){.nosidecar=1});
 
 		memset(stat, 0, sizeof *stat);
 	} else {
@@ -425,15 +559,11 @@ static void pullResourceFork(int32_t cnid, uint32_t parentfid, const char *name,
 		uint32_t size = Rez(REZFID, RESFORKFID);
 		Setattr9(RESFORKFID, SET_MTIME|SET_MTIME_SET, scstat);
 
-		WalkPath9(DIRFID, CLEANRECFID, "");
-		if (Lcreate9(CLEANRECFID, O_WRONLY|O_TRUNC, 0666, 0, rsname, NULL, NULL)) {
-			panic("failed create rezstat file");
-		}
-		Write9(CLEANRECFID, &scstat, 0, sizeof scstat, NULL);
-
 		Clunk9(REZFID);
 		Clunk9(RESFORKFID);
-		Clunk9(CLEANRECFID);
+
+		writeRezstat(rsname, (struct rezstat){.path=scstat.qid.path, .size=scstat.size,
+			.mtime_sec=scstat.mtime_sec, .mtime_nsec=scstat.mtime_nsec});
 
 		stat->size = size;
 		stat->mtime_sec = scstat.mtime_sec;
@@ -443,6 +573,8 @@ static void pullResourceFork(int32_t cnid, uint32_t parentfid, const char *name,
 
 static void pushResourceFork(int32_t cnid, uint32_t parentfid, const char *name) {
 	printf("pushResourceFork %s", name);
+	struct attr *a = attrFind(cnid);
+	if (a) a->fields &= ~MF_TIME; // the sidecar gets a new mtime
 	char forkname[MAXNAME], rsname[MAXNAME], sidecarname[MAXNAME+12], sidecartmpname[MAXNAME+12];
 	sprintf(forkname, "%08lx", cnid);
 	sprintf(rsname, "%08lx-rezstat", cnid);
@@ -457,13 +589,8 @@ static void pushResourceFork(int32_t cnid, uint32_t parentfid, const char *name)
 
 	if (forkstat.size == 0) {
 		printf(" = empty fork\n");
-		// empty "clean" record
-		WalkPath9(DIRFID, CLEANRECFID, "");
-		if (Lcreate9(CLEANRECFID, O_WRONLY|O_TRUNC, 0666, 0, rsname, NULL, NULL)) {
-			panic("failed create rezstat file");
-		}
-		Clunk9(CLEANRECFID);
 		Unlinkat9(parentfid, sidecarname, 0); // no "rdump" file
+		writeRezstat(rsname, (struct rezstat){.nosidecar=1});
 	} else {
 		printf(" = full fork\n");
 		WalkPath9(parentfid, REZFID, "");
@@ -483,12 +610,144 @@ static void pushResourceFork(int32_t cnid, uint32_t parentfid, const char *name)
 		sprintf(n2, "%s.rdump", name);
 		Renameat9(parentfid, n1, parentfid, n2);
 
-		WalkPath9(DIRFID, CLEANRECFID, "");
-		if (Lcreate9(CLEANRECFID, O_WRONLY|O_TRUNC, 0666, 0, rsname, NULL, NULL)) {
-			panic("failed create rezstat file");
+		// The rename keeps the inode, so this stat describes the new .rdump
+		writeRezstat(rsname, (struct rezstat){.path=scstat.qid.path, .size=scstat.size,
+			.mtime_sec=scstat.mtime_sec, .mtime_nsec=scstat.mtime_nsec});
+	}
+}
+
+// False if the record is missing or unrecognisable
+static bool readRezstat(const char *rsname, struct rezstat *rec) {
+	uint32_t got = 0;
+	if (WalkPath9(DIRFID, CLEANRECFID, rsname)) return false;
+	if (!Lopen9(CLEANRECFID, O_RDONLY, NULL, NULL)) {
+		Read9(CLEANRECFID, rec, 0, sizeof *rec, &got);
+	}
+	Clunk9(CLEANRECFID);
+	return got == sizeof *rec && rec->magic == RSMAGIC;
+}
+
+// Say that the cached fork matches this .rdump, as of now
+static void writeRezstat(const char *rsname, struct rezstat rec) {
+	rec.magic = RSMAGIC;
+	rec.used = LMGetTime();
+
+	WalkPath9(DIRFID, CLEANRECFID, "");
+	if (Lcreate9(CLEANRECFID, O_WRONLY|O_TRUNC, 0666, 0, rsname, NULL, NULL)) {
+		panic("failed create rezstat file");
+	}
+	Write9(CLEANRECFID, &rec, 0, sizeof rec, NULL);
+	Clunk9(CLEANRECFID);
+}
+
+// The cached fork is about to differ from the .rdump, so drop the record first:
+// if we never get to push it, the next boot must compile the .rdump again
+static void markDirty(struct MyFCB *fcb) {
+	if (fcb->mfFlags & DIRTYFLAG) return;
+
+	for (struct MyFCB *i=UnivFirst(fcb->fcbFlNm, true); i!=NULL; i=UnivNext(fcb)) {
+		i->mfFlags |= DIRTYFLAG; // set it
+	}
+
+	char rsname[MAXNAME];
+	sprintf(rsname, "%08lx-rezstat", fcb->fcbFlNm);
+	Unlinkat9(DIRFID, rsname, 0);
+}
+
+// Once a day, delete records that have not been used for a long time,
+// and forks that have no record (nothing is open yet, so none are dirty)
+static void sweep(void) {
+	uint32_t now = LMGetTime();
+	uint32_t last = 0, got = 0;
+	if (!WalkPath9(DIRFID, CLEANRECFID, "swept") && !Lopen9(CLEANRECFID, O_RDONLY, NULL, NULL)) {
+		Read9(CLEANRECFID, &last, 0, sizeof last, &got);
+	}
+	Clunk9(CLEANRECFID);
+	if (got == sizeof last && now - last < SWEEPEVERY) return;
+
+	uint32_t list = FidAlloc();
+	if (list == NOFID) return;
+
+	int swept = 0;
+	if (!WalkPath9(DIRFID, list, "") && !Lopen9(list, O_RDONLY|O_DIRECTORY, NULL, NULL)) {
+		char *buf = ArenaPush(SWEEPBUF);
+		uint64_t magic = 0;
+		uint32_t count = 0;
+		while (Readdir9(list, magic, SWEEPBUF, &count, buf), count>0) {
+			for (char *ptr=buf; ptr<buf+count;) {
+				char name[MAXNAME] = "";
+				DirRecord9(&ptr, NULL, &magic, NULL, name);
+
+				char forkname[MAXNAME], rsname[MAXNAME];
+				int len = strlen(name);
+				if (len == 8) {
+					strcpy(forkname, name);
+					sprintf(rsname, "%s-rezstat", name);
+					if (WalkPath9(DIRFID, TMPFID, rsname) != ENOENT) continue;
+				} else if (len == 16 && !strcmp(name+8, "-rezstat")) {
+					struct rezstat rec;
+					// A record from the future means the clock was set back, so keep it
+					if (readRezstat(name, &rec) && (int32_t)(now - rec.used) < RSKEEP) continue;
+					strcpy(rsname, name);
+					sprintf(forkname, "%.8s", name);
+				} else {
+					continue;
+				}
+
+				Unlinkat9(DIRFID, rsname, 0);
+				Unlinkat9(DIRFID, forkname, 0);
+				swept++;
+			}
 		}
-		Write9(CLEANRECFID, &scstat, 0, sizeof scstat, NULL);
-		Clunk9(CLEANRECFID);
+		ArenaPop(buf);
+	}
+	Clunk9(list);
+	FidFree(list);
+	printf("Resource fork cache: swept %d\n", swept);
+
+	WalkPath9(DIRFID, CLEANRECFID, "");
+	if (!Lcreate9(CLEANRECFID, O_WRONLY|O_TRUNC, 0666, 0, "swept", NULL, NULL)) {
+		Write9(CLEANRECFID, &now, 0, sizeof now, NULL);
+	}
+	Clunk9(CLEANRECFID);
+}
+
+// Best-effort rm -r, descending at most depth levels of subdirectories
+static void removeTree(uint32_t parentfid, const char *name, int depth) {
+	uint32_t dir = FidAlloc(), list = FidAlloc();
+	if (dir == NOFID || list == NOFID) goto done;
+	if (WalkPath9(parentfid, dir, name)) goto done;
+
+	if (!WalkPath9(dir, list, "") && !Lopen9(list, O_RDONLY|O_DIRECTORY, NULL, NULL)) {
+		char *buf = ArenaPush(SWEEPBUF);
+		uint64_t magic = 0;
+		uint32_t count = 0;
+		while (Readdir9(list, magic, SWEEPBUF, &count, buf), count>0) {
+			for (char *ptr=buf; ptr<buf+count;) {
+				char type = 0;
+				char entry[MAXNAME] = "";
+				DirRecord9(&ptr, NULL, &magic, &type, entry);
+
+				if (!strcmp(entry, ".") || !strcmp(entry, "..")) continue;
+				if (type == 4 /*DT_DIR*/) {
+					if (depth > 0) removeTree(dir, entry, depth-1);
+				} else {
+					Unlinkat9(dir, entry, 0);
+				}
+			}
+		}
+		ArenaPop(buf);
+	}
+	Unlinkat9(parentfid, name, 0x200 /*AT_REMOVEDIR*/);
+
+done:
+	if (dir != NOFID) {
+		Clunk9(dir);
+		FidFree(dir);
+	}
+	if (list != NOFID) {
+		Clunk9(list);
+		FidFree(list);
 	}
 }
 
@@ -606,6 +865,46 @@ static void textToFlags(char finfo[16], char fxinfo[16], const char *text, int l
 	finfo[9] = flags;
 }
 
+// Return the cache entry for this CNID, or NULL
+static struct attr *attrFind(int32_t cnid) {
+	struct attr *a = &attrs[(uint32_t)cnid % NATTR];
+	if (a->cnid != cnid) return NULL;
+	return a;
+}
+
+// Return the cache entry for this CNID, evicting whatever was there
+static struct attr *attrSlot(int32_t cnid) {
+	struct attr *a = &attrs[(uint32_t)cnid % NATTR];
+	if (a->cnid != cnid) {
+		memset(a, 0, sizeof *a);
+		a->cnid = cnid;
+	}
+	return a;
+}
+
+// Our own write or SetEOF changed a fork size, so update the entry in place
+// (the mtime changed too, so the next call must stat the data fork again)
+static void attrGrow(int32_t cnid, bool rsrc, uint64_t size, bool exact) {
+	struct attr *a = attrFind(cnid);
+	if (a == NULL) return;
+
+	uint64_t *field = rsrc ? &a->rsize : &a->dsize;
+	if (exact || *field < size) *field = size;
+	a->checked = LMGetTicks() - ATTRFRESH;
+	if (rsrc) a->fields &= ~MF_TIME;
+}
+
+// A name might now refer to a different file, so stat before trusting any entry
+static void attrRecheck(void) {
+	for (int i=0; i<NATTR; i++) {
+		attrs[i].checked = LMGetTicks() - ATTRFRESH;
+	}
+}
+
+static bool sameQid(struct Qid9 a, struct Qid9 b) {
+	return a.path == b.path && a.version == b.version;
+}
+
 static uint32_t fidof(struct MyFCB *fcb) {
 	return 32UL + fcb->refNum;
 }
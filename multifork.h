@@ -43,6 +43,9 @@ struct MFImpl {
 	int (*Close)(struct MyFCB *fcb);
 	int (*Read)(struct MyFCB *fcb, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
 	int (*Write)(struct MyFCB *fcb, const void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
+	// The same, but return a 9P tag to pass to Complete9 later
+	int (*SubmitRead)(struct MyFCB *fcb, void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
+	int (*SubmitWrite)(struct MyFCB *fcb, const void *buf, uint64_t offset, uint32_t count, uint32_t *actual_count);
 	int (*GetEOF)(struct MyFCB *fcb, uint64_t *len);
 	int (*SetEOF)(struct MyFCB *fcb, uint64_t len);
 	int (*FGetAttr)(int32_t cnid, uint32_t fid, const char *name, unsigned fields, struct MFAttr *attr);
@@ -44,7 +44,7 @@ static void *getvec(long vec) {
 static void setvec(long vec, void *addr) {
 	if (vec == 0) {
 		// no nothing
-	} if (vec & 0xffff0000) {
+	} else if (vec & 0xffff0000) {
 		SelectorFunctionUPP old;
 		if (NewGestalt(vec, addr) != noErr)
 			ReplaceGestalt(vec, addr, &old);
@@ -6,6 +6,7 @@
 
 #include "9buf.h"
 #include "9p.h"
+#include "arena.h"
 #include "panic.h"
 #include "printf.h"
 
@@ -104,9 +105,9 @@ uint32_t Rez(uint32_t textfid, uint32_t forkfid) {
 	// sizes for pointer calculations
 	size_t contentsize=0, namesize=0;
 
-	// Hefty stack IO buffer, rededicate to reading after writes done
+	// Hefty IO buffer in the arena, rededicate to reading after writes done
 	enum {WB = 8*1024, RB = 32*1024};
-	char buf[WB+RB];
+	char *buf = ArenaPush(WB+RB);
 	SetRead(textfid, buf+WB, RB);
 	SetWrite(forkfid, buf, WB);
 
@@ -242,6 +243,7 @@ uint32_t Rez(uint32_t textfid, uint32_t forkfid) {
 		panic("failed to write name list");
 	}
 
+	ArenaPop(buf);
 	return 256+contentsize+28+2+8*ntype+12*nres+namesize;
 }
 
@@ -26,18 +26,36 @@
 //    of the most recently listed file, so that all files alphabetically earlier than
 //    this one are skipped.
 // 5. Repeat this until populate() signals that the directory has been fully listed.
-// 6. Start again at (1) when a different directory is accessed.
+// 6. Keep the state of (1)-(5) for several directories at once, evicting the least recently used.
+
+// The result of (1) is a "snapshot" of one version of one directory (judged by its mtime).
+// Because populate() sees every entry, it also counts them for CountDirSorted().
+// A directory that is only counted (the Finder counts every subfolder while listing the parent)
+// gets a plain readdir pass instead, with no sorting, and its snapshot keeps no names.
+
+// To go backwards, or to return to a directory after listing another, we drop "marks"
+// every so often: a mark records the index reached, which populate() call produced the
+// packed names at that point, and how far into them we had unpacked. A mark is revisited
+// by calling populate() again with the same starting name, and unpacking up to the same spot.
 
 // In practice this seems to be O(n log n), although for very large directories could be O(n^2).
+// So a directory found to be large is instead sorted once into an index file on the host,
+// under .classicvirtio.nosync.noindex/sorted, and later listings read the index in order.
+// The index is keyed on the directory's mtime. Our own changes to the directory go in a short
+// journal next to the index, which is merged in as the index is read and folded into it when
+// full, and the journal carries the directory's new mtime (see SortedIndexUpdate).
+// Which directories have an index is kept in RAM, so other directories pay nothing.
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <Errors.h>
 #include <StringCompare.h>
 
 #include "9p.h"
+#include "arena.h"
 #include "catalog.h"
 #include "fids.h"
 #include "multifork.h"
@@ -50,6 +68,10 @@
 enum {
 	DIRFID = FIRSTFID_SORTDIR,
 	LISTFID,
+	INDEXDIRFID, // .classicvirtio.nosync.noindex/sorted
+	INDEXFID, // an index open for reading (see indexcnid), or being written
+	RUNSFID, // scratch file while building or compacting an index
+	JOURNALFID, // changes to the open index, open read-write (see indexcnid)
 };
 
 // Insert "new" just to the left of "right" in the skiplist
@@ -77,71 +99,350 @@ enum {
 	} \
 } while (0)
 
-static void populate(const char *ignore, bool dirOK, bool *isComplete);
+struct runhead;
+struct jent;
+static int32_t use(int32_t pcnid, bool check, bool count);
+static void seek(int16_t index);
+static void mark(void);
+static void fill(const char *after, uint32_t offset);
+static void populate(const char *ignore, bool *isComplete);
+static void tally(void);
+static bool visible(const char *name, unsigned char key[32]);
+static void collationKey(unsigned char key[32], const unsigned char name31[32]);
+static int keycmp(const unsigned char *a, const unsigned char *b);
+static void calibrate(void);
+static int sign(int x);
+static bool indexDir(void);
+static void indexSweep(void);
+static bool isIndexed(int32_t cnid);
+static void setIndexed(int32_t cnid, bool yes);
+static bool indexSelect(int32_t cnid);
+static void indexClose(void);
+static bool indexOpen(void);
+static bool dirStamp(int32_t pcnid);
+static bool unhold(int32_t pcnid);
+static void journalApply(char op, int32_t cnid, const char *name);
+static void journalAppend(char op, int32_t cnid, const char *name);
+static void journalStamp(void);
+static int entrycmp(const unsigned char *akey, const char *aname, const unsigned char *bkey, const char *bname);
+static const struct jent *nextAdd(const unsigned char *afterkey, const char *after,
+	const unsigned char *beforekey, const char *before);
+static bool journalRemoved(const char *name);
+static void indexCompact(void);
+static void indexLoad(const char *after, uint32_t offset);
+static bool indexBuild(void);
+static uint32_t writeRun(unsigned char **recs, int n, uint32_t at, char *out);
+static int cmpKey(const void *a, const void *b);
+static bool runNext(struct runhead *h);
+static void siftDown(struct runhead *heads, int *heap, int n, int i);
 static struct Qid9 fixQID(struct Qid9 qid, char linuxType);
 static void startPacking(void);
 static bool pack(int32_t cnid, const char *name); // returns false when no more room
 static void startUnpacking(void);
 static bool unpack(int32_t *cnid, char *name); // returns false when done
 
-int32_t ReadDirSorted(uint32_t navfid, int32_t pcnid, int16_t index, bool dirOK, char retname[MAXNAME]) {
-	static int32_t lastCNID;
-	static int16_t lastIndex;
-	static bool lastDirOK;
-	static bool isComplete;
-	static char lastName[MAXNAME];
+enum {
+	NSNAP = 4, // directories listed at once, plus one slot for counting
+	NCHUNK = 8, // populate() calls remembered per directory
+	NMARK = 32, // positions remembered per directory
+	MARKEVERY = 16, // initial spacing of marks, which widens as they fill up
+	LARGEDIR = 500, // visible entries before a directory is worth an index file
+	INDEXMAGIC = 'SIX1',
+	RECMAX = 5 + MAXNAME, // largest index record: cnid[4] len[1] name[len]
+	LOADBUF = 4096, // index bytes read per fill()
+	OUTBUF = 4096, // index bytes written at once
+	RDBUF2 = 16384, // readdir buffer while building an index
+	RUNBUF = 49152, // sort this much in memory at once
+	MAXRUN = 1024, // records sorted in memory at once
+	MAXRUNS = 64, // sorted runs merged at once, beyond which we give up on the index
+	MERGEBUF = 1024, // read buffer per run while merging
+	JOURNALMAGIC = 'SJL1',
+	NJOURNAL = 32, // journal records before it is folded into the index
+	JOURNALBUF = 32 + NJOURNAL * (6 + MAXNAME), // the whole journal file
+	NINDEXED = 64, // directories with an index file
+};
+
+// Index file header, followed by records sorted by RelString: cnid[4] len[1] name[len]
+struct indexhdr {
+	uint32_t magic;
+	int32_t nall, nfiles;
+	uint32_t pad;
+	uint64_t mtime_sec, mtime_nsec; // of the directory when the index was last correct
+};
+
+// A journalled change, as its net effect: a name hidden from the index file, or one added to it
+struct jent {
+	int32_t cnid;
+	bool add;
+	char name[MAXNAME];
+	unsigned char key[32];
+};
+
+// One sorted run being merged
+struct runhead {
+	uint32_t at, end; // remaining part of the run in the scratch file
+	char *buf;
+	int have, pos; // bytes in buf, and the current record
+	unsigned char key[32]; // collation key of the current record
+};
+
+struct mark {
+	int16_t index; // lastIndex at this point
+	int16_t chunk; // which populate() call
+	uint16_t ptr; // packedPtr at this point
+};
+
+// A listing of one directory, for either kind of caller (dirOK or not)
+static struct snapshot {
+	int32_t cnid; // 0 = empty slot
+	bool dirOK; // whether lastIndex and the marks count directories
+	uint32_t used; // for LRU eviction
+	uint64_t mtime_sec, mtime_nsec;
+	bool counted; // populate() has been through the whole directory
+	int16_t nfiles, nall; // valid if counted
+	bool isComplete; // the packed list ends at the last entry
+	bool indexed; // names come from an index file rather than from populate()
+	bool indextried; // don't keep trying to build an index that won't fit
+	int16_t lastIndex; // of lastName, which was most recently unpacked
+	char lastName[MAXNAME];
+
+	// Names sorted and packed by the most recent populate() call (or index read)
+	int16_t chunk; // counts populate() calls from the start of the directory, -1 = none yet
+	uint32_t nextOffset; // index only: where the next chunk starts
+	char packed[2048];
+	int packedSize, packedPtr;
+	char packedLastName[MAXNAME];
+	int32_t packedLastID;
+
+	// Where each populate() call started (first name is always "")
+	int nchunks;
+	char chunks[NCHUNK][MAXNAME];
+	uint32_t offsets[NCHUNK]; // index only
+
+	// Positions to seek back to, in increasing order of index
+	int nmarks, markEvery;
+	struct mark marks[NMARK];
+} snaps[NSNAP+1]; // the last is only for CountDirSorted, until a listing adopts it
+
+static struct snapshot *cur; // what populate(), pack() and unpack() work on
+static uint32_t snapclock;
+static int32_t dirfidcnid; // what DIRFID points to
+static int32_t indexcnid; // whose index INDEXFID has open
+
+// The journal of indexcnid's index, and the header that is current with it
+static struct indexhdr jhdr;
+static struct jent jents[NJOURNAL + 2]; // room for one more update before compacting
+static int njents, nrecs; // net changes, and records in the file
+static uint32_t jend; // where the next record goes
+static bool journalOpen;
 
+// Every directory with an index, so that changes elsewhere cost nothing
+static int32_t indexed[NINDEXED];
+static int nindexed;
+
+// Directories whose index was current just before our change to them (a move touches two)
+static int32_t held[2];
+static unsigned heldnext;
+
+int32_t ReadDirSorted(uint32_t navfid, int32_t pcnid, int16_t index, bool dirOK, char retname[MAXNAME]) {
 	if (index <= 0) panic("invalid child index");
 
-	// have we changed directory? in that case, invalidate everything
-	if (pcnid != lastCNID || dirOK != lastDirOK) {
-		lastCNID = 0;
-		lastIndex = 0x7fff;
-		lastName[0] = 0;
-		startPacking();
-		startUnpacking(); // ensures the next unpack() will fail
+	int32_t err = use(pcnid, false, false);
+	if (err) return err;
 
-		// and navigate to the new target directory
-		pcnid = CatalogWalk(DIRFID, pcnid, NULL, NULL, NULL);
-		if (pcnid == fnfErr) return dirNFErr;
-		if (IsErr(pcnid)) return pcnid;
-		lastCNID = pcnid;
-		lastDirOK = dirOK;
+	// The names and counts serve both kinds of caller, but the position only one of them
+	if (cur->dirOK != dirOK) {
+		cur->dirOK = dirOK;
+		cur->nmarks = 0;
+		cur->markEvery = MARKEVERY;
+		if (cur->chunk >= 0) seek(0);
 	}
 
-	if (index <= lastIndex) { // backwards enumeration of a directory not supported
-		startPacking(); // clear out the cache and relist from beginning
-		startUnpacking();
-		lastIndex = 0;
-		lastName[0] = 0;
-		isComplete = false;
+	// Backwards enumeration: check that the snapshot is still current, then go to the nearest mark
+	if (index <= cur->lastIndex) {
+		err = use(pcnid, true, false);
+		if (err) return err;
+		if (index <= cur->lastIndex) seek(index);
 	}
 
 	int32_t childCNID = -1;
-	while (lastIndex != index) {
-		bool ok = unpack(&childCNID, lastName);
+	while (cur->lastIndex != index) {
+		bool ok = unpack(&childCNID, cur->lastName);
 		if (!ok) {
-			if (isComplete) {
+			if (cur->isComplete) {
 				return fnfErr;
 			}
-			populate(lastName, dirOK, &isComplete); // make costly FS call when unpack fails
-			ok = unpack(&childCNID, lastName);
+			uint32_t offset = cur->nextOffset;
+			fill(cur->lastName, offset); // make costly FS call when unpack fails
+			cur->chunk++;
+			if (cur->chunk == cur->nchunks && cur->chunk < NCHUNK) {
+				strcpy(cur->chunks[cur->nchunks], cur->lastName);
+				cur->offsets[cur->nchunks] = offset;
+				cur->nchunks++;
+			}
+			mark();
+			ok = unpack(&childCNID, cur->lastName);
 			if (!ok) {
 				return fnfErr; // have fully iterated the directory
 			}
 		}
 
+		if (!dirOK && IsDir(childCNID)) continue; // been asked not to return directories
+
 		// if this listed name was stale then just skip it
-		if (WalkPath9(DIRFID, navfid, lastName) == 0) lastIndex++;
+		if (WalkPath9(DIRFID, navfid, cur->lastName) == 0) {
+			cur->lastIndex++;
+			mark();
+		}
 	}
 	if (childCNID == -1) panic("impossible");
 
-	if (retname != NULL) strcpy(retname, lastName);
+	if (retname != NULL) strcpy(retname, cur->lastName);
 	return childCNID;
 }
 
-static void populate(const char *ignore, bool dirOK, bool *isComplete) {
+// The Finder counts every subfolder while listing their parent,
+// so counting must not evict the listings in progress
+int16_t CountDirSorted(int32_t pcnid, bool dirOK) {
+	if (use(pcnid, true, true)) return 0;
+
+	if (!cur->counted) {
+		tally(); // the names can wait until a listing asks for them
+	}
+
+	return dirOK ? cur->nall : cur->nfiles;
+}
+
+// Make cur the snapshot of this directory, and point DIRFID at the directory.
+// If the directory has changed since (always checked when "check" is set), start afresh.
+// A new snapshot for counting goes in the counting slot, and moves to a listing slot when listed.
+static int32_t use(int32_t pcnid, bool check, bool count) {
+	struct snapshot *s = NULL, *lru = &snaps[0];
+	for (int i=0; i<=NSNAP; i++) {
+		if (snaps[i].cnid == pcnid) s = &snaps[i];
+		if (i < NSNAP && snaps[i].used < lru->used) lru = &snaps[i];
+	}
+
+	if (s == NULL) {
+		s = count ? &snaps[NSNAP] : lru;
+		s->cnid = 0; // evict
+	} else if (s == &snaps[NSNAP] && !count) {
+		*lru = *s;
+		s->cnid = 0;
+		s = lru;
+	}
+	s->used = ++snapclock;
+	cur = s;
+
+	if (cur->cnid != 0 && dirfidcnid == pcnid && !check) return 0;
+
+	struct Stat9 stat = {};
+	if (dirfidcnid != pcnid || Getattr9(DIRFID, STAT_MTIME, &stat)) {
+		dirfidcnid = 0;
+		int32_t cnid = CatalogWalk(DIRFID, pcnid, NULL, NULL, NULL);
+		if (!IsErr(cnid) && Getattr9(DIRFID, STAT_MTIME, &stat)) cnid = fnfErr;
+		if (IsErr(cnid)) {
+			cur->cnid = 0;
+			return cnid == fnfErr ? dirNFErr : cnid;
+		}
+		dirfidcnid = pcnid;
+	}
+
+	if (cur->cnid == pcnid && stat.mtime_sec == cur->mtime_sec && stat.mtime_nsec == cur->mtime_nsec) {
+		return 0;
+	}
+
+	// New or changed directory, so invalidate everything
+	cur->cnid = pcnid;
+	cur->mtime_sec = stat.mtime_sec;
+	cur->mtime_nsec = stat.mtime_nsec;
+	cur->counted = false;
+	cur->isComplete = false;
+	cur->lastIndex = 0;
+	cur->lastName[0] = 0;
+	cur->chunk = -1;
+	startPacking();
+	startUnpacking(); // ensures the next unpack() will fail
+	cur->nextOffset = sizeof (struct indexhdr);
+	cur->nchunks = 1;
+	cur->chunks[0][0] = 0;
+	cur->offsets[0] = sizeof (struct indexhdr);
+	cur->nmarks = 0;
+	cur->markEvery = MARKEVERY;
+
+	// Probably we changed it ourselves and journalled the change
+	cur->indexed = cur->indextried = isIndexed(pcnid) && indexOpen();
+	return 0;
+}
+
+// Go to the latest remembered position before this index, relisting only if necessary
+static void seek(int16_t index) {
+	struct mark m = {0, 0, 0}; // the start of the directory is always reachable
+	for (int i=0; i<cur->nmarks && cur->marks[i].index < index; i++) {
+		if (cur->marks[i].chunk == cur->chunk || cur->marks[i].chunk < cur->nchunks) {
+			m = cur->marks[i];
+		}
+	}
+
+	if (m.chunk != cur->chunk) {
+		fill(cur->chunks[m.chunk], cur->offsets[m.chunk]);
+		cur->chunk = m.chunk;
+	}
+
+	// The packed names are prefix-compressed, so unpack from the start of them
+	startUnpacking();
+	if (m.ptr == 0) {
+		strcpy(cur->lastName, cur->chunks[m.chunk]);
+	} else {
+		while (cur->packedPtr < m.ptr && unpack(NULL, cur->lastName)) {}
+	}
+	cur->lastIndex = m.index;
+}
+
+// Remember the current position if it is time to
+static void mark(void) {
+	int n = cur->nmarks;
+	if (n > 0 && cur->marks[n-1].index >= cur->lastIndex) return; // already have this far
+	if (cur->lastIndex % cur->markEvery != 0 && cur->packedPtr != 0) return; // not due
+	if (cur->packedPtr == 0 && cur->chunk >= cur->nchunks) return; // could not find our way back
+
+	// Full, so keep every second mark and space them wider
+	if (n == NMARK) {
+		for (int i=0; i<NMARK/2; i++) {
+			cur->marks[i] = cur->marks[2*i+1];
+		}
+		cur->nmarks = NMARK/2;
+		cur->markEvery *= 2;
+	}
+
+	cur->marks[cur->nmarks++] = (struct mark){cur->lastIndex, cur->chunk, cur->packedPtr};
+}
+
+// Replace the packed names with the next ones after this name (or index offset)
+static void fill(const char *after, uint32_t offset) {
+	if (cur->indexed) {
+		indexLoad(after, offset);
+		return;
+	}
+
+	populate(after, &cur->isComplete);
+
+	// A large directory takes many populate() calls to list, so sort it once into an index file
+	if (after[0] == 0 && !cur->isComplete && cur->nall > LARGEDIR && !cur->indextried) {
+		cur->indextried = true;
+		if (indexOpen() || (indexBuild() && indexOpen())) {
+			cur->indexed = true;
+			cur->nchunks = 1;
+			cur->nmarks = 0;
+			cur->markEvery = MARKEVERY;
+			indexLoad("", sizeof (struct indexhdr));
+		}
+	}
+}
+
+static void populate(const char *ignore, bool *isComplete) {
 	*isComplete = true;
+	int16_t nfiles = 0, nall = 0;
 
 	// "Leaderboard" of the lexically-lowest children in this directory,
 	// kept on the stack as a many-kilobyte skiplist
@@ -149,6 +450,7 @@ static void populate(const char *ignore, bool dirOK, bool *isComplete) {
 	struct leader {
 		struct {struct leader *l, *r;} link[POWER];
 		int32_t cnid;
+		unsigned char key[32];
 		char name[MAXNAME];
 	} ldboard[1<<POWER] = {};
 	int nlead = 0;
@@ -156,6 +458,7 @@ static void populate(const char *ignore, bool dirOK, bool *isComplete) {
 	// Special limiting elements
 	struct leader leftmost = {}, rightmost = {};
 	strcpy(leftmost.name, ignore);
+	visible(ignore, leftmost.key);
 	for (int d=0; d<POWER; d++) {
 		leftmost.link[d].r = &rightmost;
 		rightmost.link[d].l = &leftmost;
@@ -165,34 +468,33 @@ static void populate(const char *ignore, bool dirOK, bool *isComplete) {
 	if (Lopen9(LISTFID, O_RDONLY|O_DIRECTORY, NULL, NULL)) panic("failed simple open for readdir");
 
 	// Exhaustively list the host directory
-	char rdbuf[100000]; // we have a huge stack, might as well use it
+	enum {RDBUF = 100000};
+	char *rdbuf = ArenaPush(RDBUF); // no need to lock or translate
 	uint64_t magic = 0;
 	uint32_t count = 0;
-	while (Readdir9(LISTFID, magic, sizeof rdbuf, &count, rdbuf), count>0) {
+	while (Readdir9(LISTFID, magic, RDBUF, &count, rdbuf), count>0) {
 		// Iterate over these packed records: "qid[13] offset[8] type[1] name[s]"
 		char *ptr = rdbuf;
 		while (ptr < rdbuf + count) {
 			struct Qid9 qid = {};
 			char type = 0;
 			char name[MAXNAME] = "";
-			unsigned char name31[32] = "";
+			unsigned char key[32] = "";
 
 			DirRecord9(&ptr, &qid, &magic, &type, name);
 			int32_t cnid = QID2CNID(fixQID(qid, type));
-			mr31name(name31, name);
 
-			if (!dirOK && type == 4) goto skipFile; // been asked not to return directories
-			if (name31[0] == 0) goto skipFile; // unrepresentable name
-			if (name[0] == '.' || MF.IsSidecar(name)) goto skipFile; // . or .. or some other hidden metadata file
+			if (!visible(name, key)) goto skipFile;
+
+			if (nall < 0x7fff) nall++;
+			if (nfiles < 0x7fff && type != 4) nfiles++;
 
 			// search the skiplist for where to insert
 			struct leader *right = &rightmost;
 			for (int d=POWER-1; d>=0; d--) {
 				for (;;) {
 					struct leader *stepleft = right->link[d].l;
-					unsigned char try31[32] = "";
-					mr31name(try31, stepleft->name);
-					if (RelString(name31, try31, true, true) > 0) break;
+					if (keycmp(key, stepleft->key) > 0) break;
 					right = stepleft;
 					if (right == &leftmost) goto skipFile;
 				}
@@ -201,6 +503,7 @@ static void populate(const char *ignore, bool dirOK, bool *isComplete) {
 			if (nlead < sizeof ldboard/sizeof *ldboard) { // empty slots available, use one
 				struct leader *el = &ldboard[nlead++];
 				el->cnid = cnid;
+				memcpy(el->key, key, sizeof el->key);
 				strcpy(el->name, name);
 				SKIPLIST_INSERT(right, el, el->cnid);
 				goto skipFile;
@@ -213,6 +516,7 @@ static void populate(const char *ignore, bool dirOK, bool *isComplete) {
 
 			struct leader *el = rightmost.link[0].l; // steal the slot of the lexically latest item
 			el->cnid = cnid;
+			memcpy(el->key, key, sizeof el->key);
 			strcpy(el->name, name);
 			if (el == right) { // straight replacement (quite rare case)
 				goto skipFile;
@@ -223,8 +527,13 @@ static void populate(const char *ignore, bool dirOK, bool *isComplete) {
 		skipFile:;
 		}
 	}
+	ArenaPop(rdbuf);
 	Clunk9(LISTFID);
 
+	cur->counted = true;
+	cur->nfiles = nfiles;
+	cur->nall = nall;
+
 	if (0) {
 		printf("dumping leaderboard skiplist:\n");
 		for (struct leader *el=leftmost.link[0].r; el!=&rightmost; el=el->link[0].r) {
@@ -243,6 +552,121 @@ static void populate(const char *ignore, bool dirOK, bool *isComplete) {
 	startUnpacking();
 }
 
+// Count the entries that populate() would list, without sorting or keeping any of them
+static void tally(void) {
+	int16_t nfiles = 0, nall = 0;
+
+	WalkPath9(DIRFID, LISTFID, "");
+	if (Lopen9(LISTFID, O_RDONLY|O_DIRECTORY, NULL, NULL)) panic("failed simple open for readdir");
+
+	enum {RDBUF = 100000};
+	char *rdbuf = ArenaPush(RDBUF); // no need to lock or translate
+	uint64_t magic = 0;
+	uint32_t count = 0;
+	while (Readdir9(LISTFID, magic, RDBUF, &count, rdbuf), count>0) {
+		char *ptr = rdbuf;
+		while (ptr < rdbuf + count) {
+			struct Qid9 qid = {};
+			char type = 0;
+			char name[MAXNAME] = "";
+
+			DirRecord9(&ptr, &qid, &magic, &type, name);
+			if (!visible(name, NULL)) continue;
+
+			if (nall < 0x7fff) nall++;
+			if (nfiles < 0x7fff && type != 4) nfiles++;
+		}
+	}
+	ArenaPop(rdbuf);
+	Clunk9(LISTFID);
+
+	cur->counted = true;
+	cur->nfiles = nfiles;
+	cur->nall = nall;
+}
+
+// Whether a host name should be listed, also making its collation key (unless key is NULL)
+static bool visible(const char *name, unsigned char key[32]) {
+	unsigned char name31[32];
+	mr31name(name31, name);
+	if (key != NULL) collationKey(key, name31);
+	if (name31[0] == 0) return false; // unrepresentable name
+	if (name[0] == '.' || MF.IsSidecar(name)) return false; // . or .. or some other hidden metadata file
+	return true;
+}
+
+// RelString is a trap call, and sorting a big directory needs a great many comparisons.
+// So every Mac Roman character is ranked once by RelString itself (see calibrate),
+// and a name's key is its string of ranks, which compares with memcmp.
+static unsigned char rank[256];
+static int collate; // 0 = not calibrated yet, 1 = use ranks, -1 = keys are plain names for RelString
+
+static void collationKey(unsigned char key[32], const unsigned char name31[32]) {
+	if (collate == 0) calibrate();
+
+	key[0] = name31[0];
+	for (int i=1; i<=name31[0]; i++) {
+		key[i] = collate > 0 ? rank[name31[i]] : name31[i];
+	}
+}
+
+static int keycmp(const unsigned char *a, const unsigned char *b) {
+	if (collate < 0) return RelString(a, b, true, true);
+
+	int n = a[0] < b[0] ? a[0] : b[0];
+	int diff = memcmp(a+1, b+1, n);
+	if (diff) return diff;
+	return a[0] - b[0]; // a prefix sorts first
+}
+
+static int sign(int x) {
+	return (x > 0) - (x < 0);
+}
+
+static void calibrate(void) {
+	// Insertion-sort all 256 characters as one-character strings
+	unsigned char order[256];
+	for (int i=0; i<256; i++) {
+		unsigned char c[2] = {1, i};
+		int j = i;
+		while (j > 0) {
+			unsigned char d[2] = {1, order[j-1]};
+			if (RelString(d, c, true, true) <= 0) break;
+			order[j] = order[j-1];
+			j--;
+		}
+		order[j] = i;
+	}
+
+	// Characters that RelString holds equal share a rank
+	int r = 0;
+	for (int i=0; i<256; i++) {
+		if (i > 0) {
+			unsigned char c[2] = {1, order[i-1]}, d[2] = {1, order[i]};
+			if (RelString(c, d, true, true) != 0) r++;
+		}
+		rank[order[i]] = r;
+	}
+	collate = 1;
+
+	// RelString ought to be a plain character-by-character comparison, but check a sample
+	for (int i=0; i<256; i+=3) {
+		for (int j=0; j<256; j+=17) {
+			unsigned char ij[3] = {2, i, j}, ji[3] = {2, j, i}, ii[2] = {1, i};
+			unsigned char kij[3], kji[3], kii[2];
+			collationKey(kij, ij);
+			collationKey(kji, ji);
+			collationKey(kii, ii);
+			if (sign(keycmp(kij, kji)) != sign(RelString(ij, ji, true, true)) ||
+				sign(keycmp(kii, kij)) != sign(RelString(ii, ij, true, true))) {
+				printf("RelString collation is not character-by-character, using the trap\n");
+				collate = -1;
+				return;
+			}
+		}
+	}
+}
+
 static struct Qid9 fixQID(struct Qid9 qid, char linuxType) {
 	if (linuxType == 4) {
 		qid.type = 0x80;
@@ -252,59 +676,741 @@ static struct Qid9 fixQID(struct Qid9 qid, char linuxType) {
 	return qid;
 }
 
-static char packed[2048];
-static int packedSize, packedPtr;
-static char packedLastName[MAXNAME];
-static int32_t packedLastID;
+// Before our own change to a directory: remember whether its index is current,
+// because only then may the change be journalled and the index re-stamped
+void SortedIndexHold(int32_t pcnid) {
+	unhold(pcnid); // from a call that failed before it could update
+	if (!indexSelect(pcnid)) return;
+
+	struct indexhdr was = jhdr;
+	bool current = dirStamp(pcnid) &&
+		jhdr.mtime_sec == was.mtime_sec && jhdr.mtime_nsec == was.mtime_nsec;
+	jhdr = was;
+	if (current) held[heldnext++ % 2] = pcnid;
+}
+
+// True (once) if SortedIndexHold found the index current
+static bool unhold(int32_t pcnid) {
+	for (int i=0; i<2; i++) {
+		if (held[i] == pcnid) {
+			held[i] = 0;
+			return true;
+		}
+	}
+	return false;
+}
+
+// After our own change to a held directory: journal it, and stamp the journal with the
+// directory's new mtime so that the index stays current
+void SortedIndexUpdate(int32_t pcnid, const char *oldname, int32_t cnid, const char *newname) {
+	unsigned char key[32];
+	if (oldname && !visible(oldname, key)) oldname = NULL;
+	if (newname && !visible(newname, key)) newname = NULL;
+	if (!oldname && !newname) {
+		SortedIndexTouch(pcnid);
+		return;
+	}
+
+	if (!unhold(pcnid) || !indexSelect(pcnid) || !dirStamp(pcnid)) return;
+
+	if (oldname) {
+		jhdr.nall--;
+		if (!IsDir(cnid)) jhdr.nfiles--;
+		journalApply('-', cnid, oldname);
+	}
+	if (newname) {
+		jhdr.nall++;
+		if (!IsDir(cnid)) jhdr.nfiles++;
+		journalApply('+', cnid, newname);
+	}
+
+	if (nrecs + 2 > NJOURNAL) {
+		indexCompact();
+	} else {
+		if (oldname) journalAppend('-', cnid, oldname);
+		if (newname) journalAppend('+', cnid, newname);
+		journalStamp();
+	}
+}
+
+// After our own change to a held directory that leaves the listing alone (such as a new sidecar file)
+void SortedIndexTouch(int32_t pcnid) {
+	if (!unhold(pcnid) || !indexSelect(pcnid)) return;
+
+	struct indexhdr was = jhdr;
+	if (!dirStamp(pcnid)) return;
+	if (jhdr.mtime_sec != was.mtime_sec || jhdr.mtime_nsec != was.mtime_nsec) journalStamp();
+}
+
+// The directory is gone, so its index is garbage
+void SortedIndexDelete(int32_t cnid) {
+	if (!isIndexed(cnid)) return;
+	if (indexcnid == cnid) indexClose();
+
+	char name[16];
+	sprintf(name, "%08lx", cnid);
+	Unlinkat9(INDEXDIRFID, name, 0);
+	sprintf(name, "%08lx.log", cnid);
+	Unlinkat9(INDEXDIRFID, name, 0);
+	setIndexed(cnid, false);
+}
+
+// Find or create the directory of index files, and learn which directories have an index
+static bool indexDir(void) {
+	static int ready; // 0 = not tried yet, 1 = ready, -1 = unavailable
+	if (ready == 0) {
+		int err = Mkdir9(DOTDIRFID, 0777, 0, "sorted", NULL);
+		if ((err == 0 || err == EEXIST) && !WalkPath9(DOTDIRFID, INDEXDIRFID, "sorted")) {
+			ready = 1;
+			indexSweep();
+		} else {
+			ready = -1;
+		}
+	}
+	return ready > 0;
+}
+
+// Read the names in the index directory into the RAM set, deleting the indexes of
+// directories that no longer exist and anything left over from an interrupted build
+static void indexSweep(void) {
+	char *buf = ArenaPush(LOADBUF);
+
+	for (int pass=0; pass<2; pass++) {
+		WalkPath9(INDEXDIRFID, LISTFID, "");
+		if (Lopen9(LISTFID, O_RDONLY|O_DIRECTORY, NULL, NULL)) break;
+
+		uint64_t magic = 0;
+		uint32_t count = 0;
+		while (Readdir9(LISTFID, magic, LOADBUF, &count, buf), count>0) {
+			for (char *ptr=buf; ptr<buf+count;) {
+				char name[MAXNAME] = "";
+				DirRecord9(&ptr, NULL, &magic, NULL, name);
+				if (name[0] == '.') continue;
+
+				// Names are "%08lx" or "%08lx.log", anything else is junk
+				int32_t cnid = 0;
+				int i = 0;
+				for (; i<8 && name[i]; i++) {
+					char c = name[i];
+					int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+					if (digit < 0) break;
+					cnid = cnid << 4 | digit;
+				}
+				bool isindex = i == 8 && name[8] == 0;
+				bool islog = i == 8 && !strcmp(name + 8, ".log");
+
+				if (pass == 0 && isindex) {
+					// The catalog connects the CNID to a path, if the directory still exists
+					if (IsDir(cnid) && !IsErr(CatalogWalk(RUNSFID, cnid, NULL, NULL, NULL))) {
+						setIndexed(cnid, true);
+						continue;
+					}
+				} else if (pass == 0 || ((isindex || islog) && isIndexed(cnid))) {
+					continue;
+				}
+				Unlinkat9(INDEXDIRFID, name, 0);
+			}
+		}
+		Clunk9(LISTFID);
+	}
+
+	ArenaPop(buf);
+	printf("sorted indexes: %d\n", nindexed);
+}
+
+static bool isIndexed(int32_t cnid) {
+	if (!indexDir()) return false;
+	for (int i=0; i<nindexed; i++) {
+		if (indexed[i] == cnid) return true;
+	}
+	return false;
+}
+
+static void setIndexed(int32_t cnid, bool yes) {
+	for (int i=0; i<nindexed; i++) {
+		if (indexed[i] == cnid) {
+			if (!yes) indexed[i] = indexed[--nindexed];
+			return;
+		}
+	}
+	if (yes && nindexed < NINDEXED) indexed[nindexed++] = cnid;
+}
+
+// Open the index and journal of a directory, and read the journal into RAM
+static bool indexSelect(int32_t cnid) {
+	if (!isIndexed(cnid)) return false;
+	if (indexcnid == cnid) return true;
+	indexClose();
+
+	char name[16];
+	sprintf(name, "%08lx", cnid);
+	if (WalkPath9(INDEXDIRFID, INDEXFID, name)) return false;
+	uint32_t got = 0;
+	if (!Lopen9(INDEXFID, O_RDONLY, NULL, NULL)) {
+		Read9(INDEXFID, &jhdr, 0, sizeof jhdr, &got);
+	}
+	if (got != sizeof jhdr || jhdr.magic != INDEXMAGIC) {
+		Clunk9(INDEXFID);
+		return false;
+	}
+	indexcnid = cnid;
+
+	// The journal header supersedes the index header
+	sprintf(name, "%08lx.log", cnid);
+	if (WalkPath9(INDEXDIRFID, JOURNALFID, name)) return true;
+	char *buf = ArenaPush(JOURNALBUF);
+	struct indexhdr h = {};
+	got = 0;
+	if (!Lopen9(JOURNALFID, O_RDWR, NULL, NULL)) {
+		Read9(JOURNALFID, buf, 0, JOURNALBUF, &got);
+	}
+	if (got >= sizeof h) memcpy(&h, buf, sizeof h);
+
+	if (h.magic == JOURNALMAGIC) {
+		journalOpen = true;
+		jhdr = h;
+		jhdr.magic = INDEXMAGIC;
+		jend = sizeof h;
+		while (jend + 6 <= got && jend + 6 + (uint8_t)buf[jend+5] <= got) {
+			int32_t reccnid;
+			char recname[MAXNAME];
+			int len = (uint8_t)buf[jend+5];
+			memcpy(&reccnid, buf + jend + 1, 4);
+			memcpy(recname, buf + jend + 6, len);
+			recname[len] = 0;
+			journalApply(buf[jend], reccnid, recname);
+			jend += 6 + len;
+			nrecs++;
+		}
+	} else {
+		Clunk9(JOURNALFID);
+	}
+	ArenaPop(buf);
+	return true;
+}
+
+static void indexClose(void) {
+	if (indexcnid == 0) return;
+	Clunk9(INDEXFID);
+	if (journalOpen) Clunk9(JOURNALFID);
+	indexcnid = 0;
+	journalOpen = false;
+	njents = nrecs = 0;
+}
+
+// Open the index of cur's directory, if there is one and it is up to date
+static bool indexOpen(void) {
+	if (!indexSelect(cur->cnid)) return false;
+	if (jhdr.mtime_sec != cur->mtime_sec || jhdr.mtime_nsec != cur->mtime_nsec) return false;
+
+	cur->counted = true;
+	cur->nall = jhdr.nall > 0x7fff ? 0x7fff : jhdr.nall;
+	cur->nfiles = jhdr.nfiles > 0x7fff ? 0x7fff : jhdr.nfiles;
+	return true;
+}
+
+// Record the directory's current mtime in jhdr
+static bool dirStamp(int32_t pcnid) {
+	struct Stat9 stat = {};
+	if (IsErr(CatalogWalk(LISTFID, pcnid, NULL, NULL, NULL)) || Getattr9(LISTFID, STAT_MTIME, &stat)) {
+		return false;
+	}
+	jhdr.mtime_sec = stat.mtime_sec;
+	jhdr.mtime_nsec = stat.mtime_nsec;
+	return true;
+}
+
+// Net effect of the journal: names hidden from the index file, and names added to it
+static void journalApply(char op, int32_t cnid, const char *name) {
+	if (op == '-') {
+		for (int i=0; i<njents; i++) {
+			if (jents[i].add && !strcmp(jents[i].name, name)) {
+				jents[i] = jents[--njents];
+				return;
+			}
+		}
+	}
+
+	if (njents == NJOURNAL + 2) return; // can't happen, there are no more than nrecs+2
+	struct jent *j = &jents[njents++];
+	j->add = op == '+';
+	j->cnid = cnid;
+	strcpy(j->name, name);
+	visible(name, j->key);
+}
+
+// Append a record to the journal file, creating it if necessary: op[1] cnid[4] len[1] name[len]
+static void journalAppend(char op, int32_t cnid, const char *name) {
+	if (!journalOpen) {
+		char jname[16];
+		sprintf(jname, "%08lx.log", indexcnid);
+		WalkPath9(INDEXDIRFID, JOURNALFID, "");
+		if (Lcreate9(JOURNALFID, O_RDWR|O_TRUNC|O_CREAT, 0666, 0, jname, NULL, NULL)) return;
+		journalOpen = true;
+		jend = sizeof (struct indexhdr);
+	}
+
+	char rec[6 + MAXNAME];
+	int len = strlen(name);
+	rec[0] = op;
+	memcpy(rec + 1, &cnid, 4);
+	rec[5] = len;
+	memcpy(rec + 6, name, len);
+	Write9(JOURNALFID, rec, jend, 6 + len, NULL);
+	jend += 6 + len;
+	nrecs++;
+}
+
+// Write jhdr to the journal, after the records, so that a torn update leaves a stale stamp
+static void journalStamp(void) {
+	if (!journalOpen) {
+		char jname[16];
+		sprintf(jname, "%08lx.log", indexcnid);
+		WalkPath9(INDEXDIRFID, JOURNALFID, "");
+		if (Lcreate9(JOURNALFID, O_RDWR|O_TRUNC|O_CREAT, 0666, 0, jname, NULL, NULL)) return;
+		journalOpen = true;
+		jend = sizeof (struct indexhdr);
+	}
+
+	struct indexhdr h = jhdr;
+	h.magic = JOURNALMAGIC;
+	Write9(JOURNALFID, &h, 0, sizeof h, NULL);
+}
+
+// Order names by key, and by the exact name where RelString holds them equal
+static int entrycmp(const unsigned char *akey, const char *aname, const unsigned char *bkey, const char *bname) {
+	int diff = keycmp(akey, bkey);
+	if (diff) return diff;
+	return strcmp(aname, bname);
+}
+
+// The first journalled name strictly between two names, where a NULL bound is open
+static const struct jent *nextAdd(const unsigned char *afterkey, const char *after,
+	const unsigned char *beforekey, const char *before) {
+	const struct jent *best = NULL;
+	for (int i=0; i<njents; i++) {
+		const struct jent *j = &jents[i];
+		if (!j->add) continue;
+		if (after && entrycmp(j->key, j->name, afterkey, after) <= 0) continue;
+		if (before && entrycmp(j->key, j->name, beforekey, before) >= 0) continue;
+		if (best && entrycmp(j->key, j->name, best->key, best->name) >= 0) continue;
+		best = j;
+	}
+	return best;
+}
+
+static bool journalRemoved(const char *name) {
+	for (int i=0; i<njents; i++) {
+		if (!jents[i].add && !strcmp(jents[i].name, name)) return true;
+	}
+	return false;
+}
+
+// Fold the journal into a freshly written index file, and delete the journal
+static void indexCompact(void) {
+	char idxname[16], newidx[16], jname[16];
+	int32_t cnid = indexcnid;
+	sprintf(idxname, "%08lx", cnid);
+	sprintf(newidx, "%08lx.new", cnid);
+	sprintf(jname, "%08lx.log", cnid);
+
+	WalkPath9(INDEXDIRFID, RUNSFID, "");
+	if (Lcreate9(RUNSFID, O_WRONLY|O_TRUNC|O_CREAT, 0666, 0, newidx, NULL, NULL)) {
+		SortedIndexDelete(cnid); // the journal is already out of step
+		return;
+	}
+
+	char *in = ArenaPush(LOADBUF);
+	char *out = ArenaPush(OUTBUF);
+	uint32_t inat = sizeof jhdr, outat = sizeof jhdr;
+	int have = 0, pos = 0, used = 0;
+	bool eof = false;
+	char last[MAXNAME] = "";
+	unsigned char lastkey[32] = "";
+	bool first = true;
+	for (;;) {
+		if (have - pos < RECMAX && !eof) {
+			memmove(in, in + pos, have - pos);
+			have -= pos;
+			pos = 0;
+			uint32_t got = 0;
+			Read9(INDEXFID, in + have, inat, LOADBUF - have, &got);
+			if (got < LOADBUF - have) eof = true;
+			inat += got;
+			have += got;
+		}
+
+		const char *rec = NULL;
+		int len = 0;
+		char name[MAXNAME] = "";
+		unsigned char key[32] = "";
+		if (pos + 5 <= have && pos + 5 + (uint8_t)in[pos+4] <= have) {
+			rec = in + pos;
+			len = 5 + (uint8_t)rec[4];
+			memcpy(name, rec + 5, len - 5);
+			name[len - 5] = 0;
+			visible(name, key);
+		}
+
+		// Journalled names that go before this record
+		const struct jent *j = nextAdd(first ? NULL : lastkey, last, rec ? key : NULL, name);
+		char add[RECMAX];
+		if (j) {
+			int namelen = strlen(j->name);
+			memcpy(add, &j->cnid, 4);
+			add[4] = namelen;
+			memcpy(add + 5, j->name, namelen);
+			strcpy(last, j->name);
+			memcpy(lastkey, j->key, sizeof lastkey);
+			first = false;
+			rec = add;
+			len = 5 + namelen;
+		} else if (rec == NULL) {
+			break;
+		} else {
+			pos += len;
+			if (journalRemoved(name)) continue;
+			strcpy(last, name);
+			memcpy(lastkey, key, sizeof lastkey);
+			first = false;
+		}
+
+		if (used + len > OUTBUF) {
+			Write9(RUNSFID, out, outat, used, NULL);
+			outat += used;
+			used = 0;
+		}
+		memcpy(out + used, rec, len);
+		used += len;
+	}
+	if (used) Write9(RUNSFID, out, outat, used, NULL);
+	Write9(RUNSFID, &jhdr, 0, sizeof jhdr, NULL);
+	ArenaPop(in);
+	Clunk9(RUNSFID);
+
+	indexClose();
+	Renameat9(INDEXDIRFID, newidx, INDEXDIRFID, idxname);
+	Unlinkat9(INDEXDIRFID, jname, 0);
+	printf("sorted index of %08lx: compacted\n", cnid);
+}
+
+// Pack as many names as will fit, starting at this file offset, just after this name,
+// merging in the journal
+static void indexLoad(const char *after, uint32_t offset) {
+	startPacking();
+	cur->isComplete = true;
+	cur->nextOffset = offset;
+
+	// Lost the index since opening it: list nothing, and the mtime check will sort it out
+	if (indexcnid != cur->cnid && !indexOpen()) {
+		cur->mtime_sec = cur->mtime_nsec = 0;
+		startUnpacking();
+		return;
+	}
+
+	char *buf = ArenaPush(LOADBUF);
+	uint32_t got = 0;
+	Read9(INDEXFID, buf, offset, LOADBUF, &got);
+
+	char last[MAXNAME];
+	unsigned char lastkey[32];
+	bool first = after[0] == 0;
+	strcpy(last, after);
+	visible(after, lastkey);
+
+	int pos = 0;
+	for (;;) {
+		bool whole = pos + 5 <= got && pos + 5 + (uint8_t)buf[pos+4] <= got;
+
+		// Cut off by the end of the buffer rather than the end of the file
+		if (!whole && (pos < got || got == LOADBUF)) {
+			cur->isComplete = false;
+			break;
+		}
+
+		int32_t cnid = 0;
+		char name[MAXNAME] = "";
+		unsigned char key[32] = "";
+		int len = 0;
+		if (whole) {
+			len = (uint8_t)buf[pos+4];
+			memcpy(&cnid, buf + pos, 4);
+			memcpy(name, buf + pos + 5, len);
+			name[len] = 0;
+			visible(name, key);
+		}
+
+		const struct jent *j = nextAdd(first ? NULL : lastkey, last, whole ? key : NULL, name);
+		if (j) {
+			if (!pack(j->cnid, j->name)) {
+				cur->isComplete = false;
+				break;
+			}
+			strcpy(last, j->name);
+			memcpy(lastkey, j->key, sizeof lastkey);
+			first = false;
+			continue;
+		}
+		if (!whole) break; // the end of the file, and of the journal
+
+		if (!journalRemoved(name)) {
+			if (!pack(cnid, name)) {
+				cur->isComplete = false;
+				break;
+			}
+			strcpy(last, name);
+			memcpy(lastkey, key, sizeof lastkey);
+			first = false;
+		}
+		pos += 5 + len;
+	}
+
+	cur->nextOffset = offset + pos;
+	ArenaPop(buf);
+	startUnpacking();
+}
+
+// Sort the whole directory at DIRFID into an index file, as an external merge sort:
+// sorted runs that each fit in memory, then a merge of the runs.
+// Returns false if there are too many runs to merge in one go.
+static bool indexBuild(void) {
+	if (!indexDir()) return false;
+
+	char runsname[16], newidx[16], idxname[16];
+	sprintf(runsname, "%08lx.runs", cur->cnid);
+	sprintf(newidx, "%08lx.new", cur->cnid);
+	sprintf(idxname, "%08lx", cur->cnid);
+
+	indexClose();
+	if (!isIndexed(cur->cnid) && nindexed == NINDEXED) return false;
+
+	WalkPath9(INDEXDIRFID, RUNSFID, "");
+	if (Lcreate9(RUNSFID, O_RDWR|O_TRUNC|O_CREAT, 0666, 0, runsname, NULL, NULL)) return false;
+
+	WalkPath9(DIRFID, LISTFID, "");
+	if (Lopen9(LISTFID, O_RDONLY|O_DIRECTORY, NULL, NULL)) panic("failed simple open for readdir");
+
+	// Pass 1: cut the directory into runs, each sorted in memory
+	char *out = ArenaPush(OUTBUF);
+	char *rdbuf = ArenaPush(RDBUF2);
+	char *run = ArenaPush(RUNBUF);
+	unsigned char **recs = ArenaPush(MAXRUN * sizeof *recs);
+	uint32_t runat[MAXRUNS+1];
+	int nruns = 0, nrecs = 0;
+	uint32_t runused = 0, written = 0;
+	struct indexhdr hdr = {.magic=INDEXMAGIC, .mtime_sec=cur->mtime_sec, .mtime_nsec=cur->mtime_nsec};
+	bool ok = true;
+
+	uint64_t magic = 0;
+	uint32_t count = 0;
+	while (ok && (Readdir9(LISTFID, magic, RDBUF2, &count, rdbuf), count>0)) {
+		char *ptr = rdbuf;
+		while (ptr < rdbuf + count) {
+			struct Qid9 qid = {};
+			char type = 0;
+			char name[MAXNAME] = "";
+			unsigned char key[32] = "";
+
+			DirRecord9(&ptr, &qid, &magic, &type, name);
+			if (!visible(name, key)) continue;
+
+			hdr.nall++;
+			if (type != 4) hdr.nfiles++;
+
+			int len = strlen(name);
+			if (nrecs == MAXRUN || runused + 32 + 5 + len > RUNBUF) {
+				if (nruns == MAXRUNS) {
+					ok = false;
+					break;
+				}
+				runat[nruns++] = written;
+				written = writeRun(recs, nrecs, written, out);
+				nrecs = runused = 0;
+			}
+
+			// In memory each record is prefixed with its sort key
+			unsigned char *rec = (unsigned char *)run + runused;
+			int32_t cnid = QID2CNID(fixQID(qid, type));
+			memcpy(rec, key, 32);
+			memcpy(rec + 32, &cnid, 4);
+			rec[36] = len;
+			memcpy(rec + 37, name, len);
+			recs[nrecs++] = rec;
+			runused += 37 + len;
+		}
+	}
+	if (ok && nrecs > 0) {
+		if (nruns == MAXRUNS) {
+			ok = false;
+		} else {
+			runat[nruns++] = written;
+			written = writeRun(recs, nrecs, written, out);
+		}
+	}
+	runat[nruns] = written;
+	Clunk9(LISTFID);
+	ArenaPop(rdbuf);
+
+	// Pass 2: merge the runs into the index proper, smallest key at the top of a heap
+	WalkPath9(INDEXDIRFID, INDEXFID, "");
+	if (ok && Lcreate9(INDEXFID, O_WRONLY|O_TRUNC|O_CREAT, 0666, 0, newidx, NULL, NULL)) {
+		ok = false;
+	}
+
+	if (ok) {
+		struct runhead *heads = ArenaPush(nruns * sizeof *heads);
+		int heap[MAXRUNS], nheap = 0;
+		for (int i=0; i<nruns; i++) {
+			heads[i] = (struct runhead){.at=runat[i], .end=runat[i+1], .buf=ArenaPush(MERGEBUF)};
+			if (runNext(&heads[i])) heap[nheap++] = i;
+		}
+		for (int i=nheap/2-1; i>=0; i--) {
+			siftDown(heads, heap, nheap, i);
+		}
+
+		uint32_t outat = sizeof hdr;
+		int used = 0;
+		while (nheap > 0) {
+			struct runhead *h = &heads[heap[0]];
+			int len = 5 + (uint8_t)h->buf[h->pos+4];
+			if (used + len > OUTBUF) {
+				Write9(INDEXFID, out, outat, used, NULL);
+				outat += used;
+				used = 0;
+			}
+			memcpy(out + used, h->buf + h->pos, len);
+			used += len;
+			h->pos += len;
+
+			if (!runNext(h)) heap[0] = heap[--nheap];
+			siftDown(heads, heap, nheap, 0);
+		}
+		if (used) Write9(INDEXFID, out, outat, used, NULL);
+		Write9(INDEXFID, &hdr, 0, sizeof hdr, NULL);
+		Clunk9(INDEXFID);
+	}
+	ArenaPop(out);
+
+	Clunk9(RUNSFID);
+	Unlinkat9(INDEXDIRFID, runsname, 0);
+	if (ok) {
+		char jname[16];
+		sprintf(jname, "%08lx.log", cur->cnid);
+		Renameat9(INDEXDIRFID, newidx, INDEXDIRFID, idxname);
+		Unlinkat9(INDEXDIRFID, jname, 0); // describes the old index
+		setIndexed(cur->cnid, true);
+	}
+	printf("sorted index of %08lx: %s, %ld entries in %d runs\n", cur->cnid, ok ? "built" : "too large", hdr.nall, nruns);
+	return ok;
+}
+
+// Sort a run of in-memory records and append them (without their keys) to the scratch file
+static uint32_t writeRun(unsigned char **recs, int n, uint32_t at, char *out) {
+	qsort(recs, n, sizeof *recs, cmpKey);
+
+	int used = 0;
+	for (int i=0; i<n; i++) {
+		int len = 5 + recs[i][36];
+		if (used + len > OUTBUF) {
+			Write9(RUNSFID, out, at, used, NULL);
+			at += used;
+			used = 0;
+		}
+		memcpy(out + used, recs[i] + 32, len);
+		used += len;
+	}
+	if (used) Write9(RUNSFID, out, at, used, NULL);
+	return at + used;
+}
+
+static int cmpKey(const void *a, const void *b) {
+	return keycmp(*(unsigned char *const *)a, *(unsigned char *const *)b);
+}
+
+// Make sure the run's current record is wholly in its buffer, false if the run is exhausted
+static bool runNext(struct runhead *h) {
+	if (h->have - h->pos < RECMAX && h->at < h->end) {
+		memmove(h->buf, h->buf + h->pos, h->have - h->pos);
+		h->have -= h->pos;
+		h->pos = 0;
+
+		uint32_t want = MERGEBUF - h->have, got = 0;
+		if (want > h->end - h->at) want = h->end - h->at;
+		Read9(RUNSFID, h->buf + h->have, h->at, want, &got);
+		h->at += got;
+		h->have += got;
+	}
+	if (h->pos >= h->have) return false;
+
+	char name[MAXNAME];
+	int len = (uint8_t)h->buf[h->pos+4];
+	memcpy(name, h->buf + h->pos + 5, len);
+	name[len] = 0;
+	visible(name, h->key);
+	return true;
+}
+
+static void siftDown(struct runhead *heads, int *heap, int n, int i) {
+	for (;;) {
+		int least = i, l = 2*i+1, r = 2*i+2;
+		if (l < n && keycmp(heads[heap[l]].key, heads[heap[least]].key) < 0) least = l;
+		if (r < n && keycmp(heads[heap[r]].key, heads[heap[least]].key) < 0) least = r;
+		if (least == i) return;
+		int swap = heap[i];
+		heap[i] = heap[least];
+		heap[least] = swap;
+		i = least;
+	}
+}
 
 // cycle is startPacking, [pack...], startUnpacking, [unpack...]
 static void startPacking(void) {
-	packedSize = packedLastName[0] = packedLastID = 0;
+	cur->packedSize = cur->packedLastName[0] = cur->packedLastID = 0;
 }
 
 static bool pack(int32_t cnid, const char *name) {
 	int reuseID = 0, reuseName = 0;
 
 	// determine common prefixes
-	while (((char *)&packedLastID)[reuseID] == ((char *)&cnid)[reuseID] && reuseID < 3) reuseID++;
-	while (packedLastName[reuseName] == name[reuseName] && reuseName < 0x3f) reuseName++;
+	while (((char *)&cur->packedLastID)[reuseID] == ((char *)&cnid)[reuseID] && reuseID < 3) reuseID++;
+	while (cur->packedLastName[reuseName] == name[reuseName] && reuseName < 0x3f) reuseName++;
 
 	int changeID = 4 - reuseID;
 	int changeName = strlen(name) + 1 - reuseName;
 
-	packedLastID = cnid;
-	memcpy(packedLastName + reuseName, name + reuseName, changeName);
+	cur->packedLastID = cnid;
+	memcpy(cur->packedLastName + reuseName, name + reuseName, changeName);
 
-	if (packedSize + 1 + changeID + changeName > sizeof packed) return false; // out of room
+	if (cur->packedSize + 1 + changeID + changeName > sizeof cur->packed) return false; // out of room
 
-	packed[packedSize++] = reuseID<<6 | reuseName;
-	memcpy(packed + packedSize, (char *)&cnid + reuseID, changeID);
-	packedSize += changeID;
-	memcpy(packed + packedSize, name + reuseName, changeName);
-	packedSize += changeName;
+	cur->packed[cur->packedSize++] = reuseID<<6 | reuseName;
+	memcpy(cur->packed + cur->packedSize, (char *)&cnid + reuseID, changeID);
+	cur->packedSize += changeID;
+	memcpy(cur->packed + cur->packedSize, name + reuseName, changeName);
+	cur->packedSize += changeName;
 	return true;
 }
 
 static void startUnpacking(void) {
-	packedPtr = packedLastName[0] = packedLastID = 0;
+	cur->packedPtr = cur->packedLastName[0] = cur->packedLastID = 0;
 }
 
 static bool unpack(int32_t *cnid, char *name) {
-	if (packedPtr >= packedSize) return false;
+	if (cur->packedPtr >= cur->packedSize) return false;
 
-	int reuseID = (0xc0 & packed[packedPtr]) >> 6;
-	int reuseName = 0x3f & packed[packedPtr];
-	packedPtr++;
+	int reuseID = (0xc0 & cur->packed[cur->packedPtr]) >> 6;
+	int reuseName = 0x3f & cur->packed[cur->packedPtr];
+	cur->packedPtr++;
 
 	int changeID = 4 - reuseID;
-	memcpy((char *)&packedLastID + reuseID, packed + packedPtr, changeID);
-	packedPtr += changeID;
+	memcpy((char *)&cur->packedLastID + reuseID, cur->packed + cur->packedPtr, changeID);
+	cur->packedPtr += changeID;
 
-	int changeName = strlen(packed + packedPtr) + 1;
-	memcpy(packedLastName + reuseName, packed + packedPtr, changeName);
-	packedPtr += changeName;
+	int changeName = strlen(cur->packed + cur->packedPtr) + 1;
+	memcpy(cur->packedLastName + reuseName, cur->packed + cur->packedPtr, changeName);
+	cur->packedPtr += changeName;
 
-	if (cnid != NULL) *cnid = packedLastID;
-	if (name != NULL) memcpy(name, packedLastName, reuseName + changeName);
+	if (cnid != NULL) *cnid = cur->packedLastID;
+	if (name != NULL) memcpy(name, cur->packedLastName, reuseName + changeName);
 	return true;
 }
@@ -5,3 +5,8 @@
 #include <stdint.h>
 #include "9p.h"
 int32_t ReadDirSorted(uint32_t navfid, int32_t pcnid, int16_t index, bool dirOK, char retname[MAXNAME]);
+int16_t CountDirSorted(int32_t pcnid, bool dirOK);
+void SortedIndexHold(int32_t pcnid);
+void SortedIndexUpdate(int32_t pcnid, const char *oldname, int32_t cnid, const char *newname);
+void SortedIndexTouch(int32_t pcnid);
+void SortedIndexDelete(int32_t cnid);
@@ -34,3 +34,26 @@ struct virtq_used {
 	uint16_t idx;
 	struct virtq_used_elem ring[999]; // 8 bytes each
 } __attribute((scalar_storage_order("little-endian")));
+
+// Packed ring (VIRTIO_F_RING_PACKED)
+
+struct pvirtq_desc { // all little-endian
+	uint32_t addr; // guest-physical
+	uint32_t addr_hi;
+	uint32_t len;
+	uint16_t id; // buffer ID
+	uint16_t flags;
+} __attribute((scalar_storage_order("little-endian")));
+
+/* Same meanings as the split ring, plus these two wrap counter bits. */
+#define VIRTQ_DESC_F_AVAIL (1 << 7)
+#define VIRTQ_DESC_F_USED (1 << 15)
+
+struct pvirtq_event_suppress {
+	uint16_t desc; // offset[15] wrap[1]
+	uint16_t flags;
+} __attribute((scalar_storage_order("little-endian")));
+
+#define RING_EVENT_FLAGS_ENABLE 0
+#define RING_EVENT_FLAGS_DISABLE 1
+#define RING_EVENT_FLAGS_DESC 2
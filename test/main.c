@@ -23,6 +23,7 @@ void testNavigation(void);
 void testSetFPos(void);
 void testRead(void);
 void testWrite(void);
+void testAsync(void);
 void testOpenPerms(void);
 
 static void shutDownIfOnlyApp(void) {
@@ -42,6 +43,7 @@ int main(void) {
 	testSetFPos();
 	testRead();
 	testWrite();
+	testAsync();
 	testOpenPerms();
 
 	TAPPlan();
@@ -0,0 +1,154 @@
+/* Copyright (c) Elliot Nunn */
+/* Licensed under the MIT license */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <Devices.h>
+#include <Events.h>
+#include <Files.h>
+#include <Memory.h>
+
+#include "constnames.h"
+#include "scratch.h"
+#include "tap.h"
+
+enum {K = 1024};
+
+static char pattern[64*K], buf[40*K], back[40*K];
+
+// Written by the completion routine, possibly at interrupt time
+static struct IOParam *volatile donepb;
+static volatile short doneresult;
+static volatile int donecount;
+
+static void completed(struct IOParam *pb) {
+	donepb = pb;
+	doneresult = pb->ioResult;
+	donecount++;
+}
+
+// ioCompletion gets the parameter block in A0, so pass it on to a C function
+static void *glue(void) {
+	static uint16_t code[] = {
+		0x48e7, 0xe0c0, // movem.l d0-d2/a0-a1,-(sp)
+		0x2f08,         // move.l a0,-(sp)
+		0x4eb9, 0, 0,   // jsr completed, address at code[4]
+		0x588f,         // addq.l #4,sp
+		0x4cdf, 0x0307, // movem.l (sp)+,d0-d2/a0-a1
+		0x4e75,         // rts
+	};
+
+	if (code[4] == 0 && code[5] == 0) {
+		code[4] = (uint32_t)completed >> 16;
+		code[5] = (uint32_t)completed;
+		BlockMove(code, code, sizeof code); // clear i-cache
+	}
+	return code;
+}
+
+void testAsync(void) {
+	puts("# Testing ReadAsync and WriteAsync");
+	puts("# (Note: a call may complete before the trap returns, so ioResult==1 is not required then)");
+
+	struct line {
+		bool write;
+		int filesize, initialpos, mode, delta, reqcount, actcount, finalpos, err;
+	};
+
+	struct line lines[] = {
+		// Small enough to go through the file cache
+		{.write=false, .filesize=1000, .initialpos=0, .mode=fsFromStart, .delta=100, .reqcount=200, .actcount=200, .finalpos=300, .err=noErr},
+		{.write=false, .filesize=150, .initialpos=0, .mode=fsFromStart, .delta=100, .reqcount=200, .actcount=50, .finalpos=150, .err=eofErr},
+		{.write=false, .filesize=1000, .initialpos=500, .mode=fsAtMark, .delta=0, .reqcount=200, .actcount=200, .finalpos=700, .err=noErr},
+		{.write=false, .filesize=1000, .initialpos=0, .mode=fsFromLEOF, .delta=-200, .reqcount=200, .actcount=200, .finalpos=1000, .err=noErr},
+		{.write=true, .filesize=1000, .initialpos=0, .mode=fsFromStart, .delta=100, .reqcount=200, .actcount=200, .finalpos=300, .err=noErr},
+		{.write=true, .filesize=1000, .initialpos=0, .mode=fsFromLEOF, .delta=0, .reqcount=200, .actcount=200, .finalpos=1200, .err=noErr},
+		// Big enough to go straight to the buffer
+		{.write=false, .filesize=40*K, .initialpos=0, .mode=fsFromStart, .delta=0, .reqcount=40*K, .actcount=40*K, .finalpos=40*K, .err=noErr},
+		{.write=false, .filesize=40*K, .initialpos=0, .mode=fsFromStart, .delta=8*K, .reqcount=40*K, .actcount=32*K, .finalpos=40*K, .err=eofErr},
+		{.write=false, .filesize=64*K, .initialpos=4*K, .mode=fsFromMark, .delta=4*K, .reqcount=40*K, .actcount=40*K, .finalpos=48*K, .err=noErr},
+		{.write=false, .filesize=64*K, .initialpos=0, .mode=fsFromLEOF, .delta=-40*K, .reqcount=40*K, .actcount=40*K, .finalpos=64*K, .err=noErr},
+		{.write=true, .filesize=40*K, .initialpos=0, .mode=fsFromStart, .delta=0, .reqcount=40*K, .actcount=40*K, .finalpos=40*K, .err=noErr},
+		{.write=true, .filesize=40*K, .initialpos=0, .mode=fsFromStart, .delta=8*K, .reqcount=40*K, .actcount=40*K, .finalpos=48*K, .err=noErr},
+		{.write=true, .filesize=40*K, .initialpos=0, .mode=fsFromLEOF, .delta=0, .reqcount=40*K, .actcount=40*K, .finalpos=80*K, .err=noErr},
+		{-1}
+	};
+
+	for (int i=0; i<sizeof pattern; i++) {
+		pattern[i] = 'a' + i%26;
+	}
+
+	for (struct line *l=lines; l->filesize!=-1; l++) {
+		short ref = MkScratchFileAlphabetic(0);
+
+		struct IOParam wpb = {.ioRefNum=ref, .ioBuffer=pattern, .ioReqCount=l->filesize};
+		if (PBWriteSync((void *)&wpb) || wpb.ioActCount != l->filesize) TAPBailOut("Could not write scratch");
+
+		// Touch the buffer with a sync read first, as a program reading in a loop would,
+		// so the driver has seen it before and can leave the call in flight
+		struct IOParam warmpb = {.ioRefNum=ref, .ioPosMode=fsFromStart, .ioPosOffset=0, .ioReqCount=l->reqcount, .ioBuffer=buf};
+		PBReadSync((void *)&warmpb);
+
+		// Pre-set the mark
+		struct IOParam setuppb = {.ioRefNum=ref, .ioPosMode=fsFromStart, .ioPosOffset=l->initialpos};
+		PBSetFPosSync((void *)&setuppb);
+		long thepos = 99;
+		GetFPos(ref, &thepos);
+		if (thepos != l->initialpos) TAPBailOut("Could not pre-set mark, wanted %d got %d", l->initialpos, thepos);
+
+		for (int i=0; i<l->reqcount; i++) {
+			buf[i] = l->write ? 'A' + i%26 : 0;
+		}
+
+		donepb = NULL;
+		doneresult = 99;
+		donecount = 0;
+
+		struct IOParam pb = {.ioCompletion=glue(), .ioRefNum=ref, .ioPosMode=l->mode, .ioPosOffset=l->delta,
+			.ioReqCount=l->reqcount, .ioActCount=99, .ioBuffer=buf};
+		if (l->write) {
+			PBWriteAsync((void *)&pb);
+		} else {
+			PBReadAsync((void *)&pb);
+		}
+		short atreturn = pb.ioResult;
+		int doneatreturn = donecount;
+
+		long timeout = TickCount() + 10*60;
+		while (pb.ioResult > 0) {
+			if (TickCount() > timeout) TAPBailOut("Async call never completed");
+		}
+
+		thepos = 99;
+		GetFPos(ref, &thepos);
+
+		// The data that should now be in the buffer (read) or in the file (write)
+		long start = l->finalpos - l->actcount;
+		bool dataok;
+		if (l->write) {
+			struct IOParam rpb = {.ioRefNum=ref, .ioPosMode=fsFromStart, .ioPosOffset=start, .ioReqCount=l->actcount, .ioBuffer=back};
+			PBReadSync((void *)&rpb);
+			dataok = rpb.ioActCount == l->actcount && !memcmp(back, buf, l->actcount);
+		} else {
+			dataok = !memcmp(buf, pattern + start, l->actcount);
+		}
+
+		bool ok = (atreturn == 1 || doneatreturn != 0) &&
+			donecount == 1 && donepb == &pb && doneresult == l->err &&
+			pb.ioResult == l->err && pb.ioActCount == l->actcount &&
+			pb.ioPosOffset == l->finalpos && thepos == l->finalpos && dataok;
+		TAPResult(ok, "%s(filesize=%d, initialpos=%d, mode=%s, delta=%d, reqcount=%d) -> (actcount=%d, mark=%d, err=%s)",
+			l->write ? "WriteAsync" : "ReadAsync",
+			l->filesize, l->initialpos, PosModeName(l->mode), l->delta, l->reqcount, l->actcount, l->finalpos, ErrName(l->err));
+
+		if (!ok) {
+			printf("# got (ioResult at return=%d, completions=%d, actcount=%d, mark=%d, fcbCrPs=%d, err=%s, data %s)\n",
+				atreturn, donecount, pb.ioActCount, pb.ioPosOffset, thepos, ErrName(pb.ioResult), dataok ? "ok" : "wrong");
+		}
+
+		FSClose(ref);
+	}
+}
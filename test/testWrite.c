@@ -592,4 +592,76 @@ void testWrite(void) {
 		FSClose(ref);
 		FSDelete("\pscratch", 0);
 	}
+
+	// Small writes are held back by the driver, but nothing else may notice
+	puts("# Testing what other calls see of a small write");
+
+	struct after {
+		int filesize, pos, writesize, seteof; // seteof -1 = no SetEOF
+		bool otherpath, reopen; // read back through a second path, or after closing
+		int eof;
+		char data[16];
+	};
+
+	struct after afters[] = {
+		{.filesize=0, .pos=0, .writesize=3, .seteof=-1, .eof=3, .data="ABC"},
+		{.filesize=10, .pos=2, .writesize=3, .seteof=-1, .eof=10, .data="abABCfghij"},
+		{.filesize=10, .pos=8, .writesize=4, .seteof=-1, .eof=12, .data="abcdefghABCD"},
+		{.filesize=0, .pos=0, .writesize=5, .seteof=-1, .otherpath=true, .eof=5, .data="ABCDE"},
+		{.filesize=10, .pos=2, .writesize=3, .seteof=-1, .otherpath=true, .eof=10, .data="abABCfghij"},
+		{.filesize=10, .pos=8, .writesize=4, .seteof=-1, .otherpath=true, .eof=12, .data="abcdefghABCD"},
+		{.filesize=0, .pos=0, .writesize=8, .seteof=3, .reopen=true, .eof=3, .data="ABC"},
+		{.filesize=10, .pos=6, .writesize=4, .seteof=7, .reopen=true, .eof=7, .data="abcdefA"},
+		{.filesize=10, .pos=2, .writesize=3, .seteof=1, .reopen=true, .eof=1, .data="a"},
+		{.filesize=4, .pos=2, .writesize=4, .seteof=12, .reopen=true, .eof=12, .data="abABCD"},
+		{-1}
+	};
+
+	for (struct after *l=afters; l->filesize!=-1; l++) {
+		short ref = MkScratchFileAlphabetic(l->filesize);
+
+		struct IOParam pb = {.ioRefNum=ref, .ioPosMode=fsFromStart, .ioPosOffset=l->pos, .ioReqCount=l->writesize, .ioBuffer="ABCDEFGHIJ"};
+		PBWriteSync((void *)&pb);
+		if (pb.ioResult != noErr) TAPBailOut("Write failure");
+
+		if (l->seteof >= 0 && SetEOF(ref, l->seteof)) TAPBailOut("SetEOF failure");
+
+		long eof = 99;
+		GetEOF(ref, &eof);
+
+		// Read back through the same path, a second one, or a new one after closing
+		short readref = ref;
+		if (l->reopen) FSClose(ref);
+		if (l->reopen || l->otherpath) {
+			struct FileParam opb = {.ioVRefNum=VolRef(), .ioNamePtr="\pScratchAlphabetic", .ioPermssn=fsRdPerm};
+			if (PBOpenSync((void *)&opb)) TAPBailOut("Could not open scratch again");
+			readref = opb.ioFRefNum;
+		}
+
+		// Bytes past the end of a SetEOF extension are undefined, so compare only the string
+		char buf[20] = {};
+		struct IOParam backpb = {.ioRefNum=readref, .ioPosMode=fsFromStart, .ioPosOffset=0, .ioReqCount=sizeof buf - 1, .ioBuffer=buf};
+		PBReadSync((void *)&backpb);
+		if (backpb.ioResult != noErr && backpb.ioResult != eofErr) TAPBailOut("Readback failure");
+
+		bool ok = eof == l->eof &&
+			backpb.ioActCount == l->eof &&
+			!strncmp(l->data, buf, strlen(l->data)) &&
+			(l->eof > (int)strlen(l->data) || strlen(buf) == l->eof);
+
+		char seteof[20] = "";
+		if (l->seteof >= 0) sprintf(seteof, ", SetEOF(%d)", l->seteof);
+
+		TAPResult(ok, "Write(filesize=%d, pos=%d, writesize=%d)%s, GetEOF%s, Read -> (data=\"%s\", eof=%d)",
+			l->filesize, l->pos, l->writesize, seteof,
+			l->reopen ? ", Close, Open" : l->otherpath ? ", Open another path" : "",
+			l->data, l->eof);
+
+		if (!ok) {
+			printf("# got (data=\"%s\", eof=%ld, read=%ld)\n", buf, eof, backpb.ioActCount);
+		}
+
+		if (l->otherpath) FSClose(ref);
+		FSClose(readref);
+	}
 }
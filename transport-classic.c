@@ -76,6 +76,11 @@ bool VInit(short refNum) {
 	}
 	VSetFeature(32, true);
 
+	// Ring features are used transparently by virtqueue.c
+	VSetFeature(28, VGetDevFeature(28)); // VIRTIO_F_INDIRECT_DESC
+	VSetFeature(29, VGetDevFeature(29)); // VIRTIO_F_EVENT_IDX
+	VSetFeature(34, VGetDevFeature(34)); // VIRTIO_F_RING_PACKED
+
 	if (SIntInstall(&slotInterrupt, slot)) return false;
 	RegisterCleanupVoidPtr(cleanupIntHandler, &slotInterrupt);
 	if (SIntInstall(&slotInterruptBackstop, slot)) return false;
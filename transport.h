@@ -23,7 +23,8 @@ bool VFeaturesOK(void);
 void VDriverOK(void);
 void VFail(void);
 
-// Tell the device where to find the three (split) virtqueue rings
+// Tell the device where to find the three virtqueue areas
+// (split: desc/avail/used rings, packed: desc ring/driver event/device event)
 uint16_t VQueueMaxSize(uint16_t q);
 void VQueueSet(uint16_t q, uint16_t size, uint32_t desc, uint32_t avail, uint32_t used);
 
@@ -22,18 +22,58 @@
 enum {
 	MAX_VQ = 2,
 	MAX_RING = 256,
+	MAX_INDIRECT = 1024, // longest chain Qemu accepts
+	INDIRECT_TABLES = 2, // per queue
+	NO_TABLE = 0xff,
 };
 
 struct virtq {
 	uint16_t size;
+	uint16_t nfree;
+	bool packed;
+	bool eventidx; // VIRTIO_F_EVENT_IDX
+	uint32_t freed; // set by poll, to wake up a waiting QSend
+
+	// Split ring
 	uint16_t used_ctr;
+	uint16_t free_head; // free descriptors are linked by their "next" field
 	struct virtq_desc *desc;
 	struct virtq_avail *avail;
 	struct virtq_used *used;
+
+	// Packed ring
+	struct pvirtq_desc *pdesc;
+	struct pvirtq_event_suppress *driver_event;
+	struct pvirtq_event_suppress *device_event;
+	uint16_t next_avail, next_used;
+	bool avail_wrap, used_wrap;
+	uint16_t nfreeids;
+	uint16_t freeids[MAX_RING];
+	uint16_t chainlen[MAX_RING]; // indexed by buffer ID
+
+	// Indexed by head descriptor (split) or buffer ID (packed)
 	volatile uint32_t *retlenptrs[MAX_RING];
+	uint8_t tableof[MAX_RING];
+
+	// Indirect descriptor tables, each used by one chain at a time
+	uint16_t maxchain;
+	uint16_t tablecap;
+	uint8_t ntables;
+	bool tablebusy[INDIRECT_TABLES];
+	void *tables[INDIRECT_TABLES];
+	uint32_t tablephys[INDIRECT_TABLES];
 };
 
+static uint16_t putSplit(uint16_t q, uint16_t n_out, uint16_t n_in, uint32_t *addrs, uint32_t *sizes, int table, bool *notify);
+static uint16_t putPacked(uint16_t q, uint16_t n_out, uint16_t n_in, uint32_t *addrs, uint32_t *sizes, int table, bool *notify);
+static bool needEvent(uint16_t event, uint16_t newidx, uint16_t oldidx);
+static bool usedPacked(uint16_t q);
+static int freeTable(uint16_t q, uint16_t n);
+static void waitFreed(uint16_t q, short sr);
 static void poll(uint16_t q);
+static void pollSplit(uint16_t q);
+static void pollPacked(uint16_t q);
+static void finish(uint16_t q, uint16_t idx, uint32_t len);
 
 static volatile struct virtq queues[MAX_VQ];
 
@@ -54,21 +94,87 @@ uint16_t QInit(uint16_t q, uint16_t max_size) {
 	RegisterCleanup(VReset); // remember this is registered AFTER FreePages so executed BEFORE
 
 	// Underlying transport needs the physical addresses of the rings
+	// (for a packed ring: descriptors, driver event area, device event area)
 	VQueueSet(q, size, phys[0], phys[1], phys[2]);
 
-	// But we only need to keep the logical pointers
-	queues[q].desc = pages;
-	queues[q].avail = (void *)((char *)pages + 0x1000);
-	queues[q].used = (void *)((char *)pages + 0x2000);
-
 	queues[q].size = size;
+	queues[q].nfree = size;
+	queues[q].maxchain = size;
+	for (int i=0; i<MAX_RING; i++) queues[q].tableof[i] = NO_TABLE;
 
-	// Mark all descriptors free
-	for (int i=0; i<queues[q].size; i++) queues[q].desc[i].next = 0xffff;
+	// The transport accepts these whenever they are offered
+	queues[q].packed = VGetDevFeature(34); // VIRTIO_F_RING_PACKED
+	queues[q].eventidx = VGetDevFeature(29); // VIRTIO_F_EVENT_IDX
+
+	// But we only need to keep the logical pointers
+	if (queues[q].packed) {
+		queues[q].pdesc = pages;
+		queues[q].driver_event = (void *)((char *)pages + 0x1000);
+		queues[q].device_event = (void *)((char *)pages + 0x2000);
+
+		// Both wrap counters start at 1, and every buffer ID is free
+		queues[q].avail_wrap = queues[q].used_wrap = true;
+		for (int i=0; i<size; i++) queues[q].freeids[i] = i;
+		queues[q].nfreeids = size;
+
+		// Interrupt when the first descriptor is used
+		if (queues[q].eventidx) {
+			queues[q].driver_event->desc = 0 | 0x8000;
+			queues[q].driver_event->flags = RING_EVENT_FLAGS_DESC;
+		}
+	} else {
+		queues[q].desc = pages;
+		queues[q].avail = (void *)((char *)pages + 0x1000);
+		queues[q].used = (void *)((char *)pages + 0x2000);
+
+		// Link all descriptors into the free list
+		for (int i=0; i<size; i++) queues[q].desc[i].next = i + 1;
+		queues[q].free_head = 0;
+	}
 
 	return size;
 }
 
+// Accept chains longer than the ring, using indirect descriptor tables,
+// return the longest chain that QSend will now accept
+uint16_t QIndirect(uint16_t q, uint16_t max_chain) {
+	// The transport accepts VIRTIO_F_INDIRECT_DESC whenever it is offered
+	if (!VGetDevFeature(28)) return queues[q].maxchain;
+
+	if (max_chain > MAX_INDIRECT) max_chain = MAX_INDIRECT;
+	size_t pages = (max_chain * sizeof (struct virtq_desc) + 0xfff) / 0x1000;
+	uint16_t cap = max_chain;
+
+	while (queues[q].ntables < INDIRECT_TABLES) {
+		uint32_t phys[MAX_INDIRECT * sizeof (struct virtq_desc) / 0x1000];
+		void *table = AllocPages(pages, phys);
+		if (table == NULL) break;
+
+		RegisterCleanupVoidPtr(FreePages, table);
+		RegisterCleanup(VReset); // executed BEFORE FreePages
+
+		// The device reads a table by its physical address,
+		// so only the physically contiguous part is usable
+		int contig = 1;
+		while (contig < pages && phys[contig] == phys[0] + contig*0x1000) contig++;
+		if (cap > contig * 0x1000 / sizeof (struct virtq_desc)) {
+			cap = contig * 0x1000 / sizeof (struct virtq_desc);
+		}
+
+		queues[q].tables[queues[q].ntables] = table;
+		queues[q].tablephys[queues[q].ntables] = phys[0];
+		queues[q].ntables++;
+	}
+
+	queues[q].tablecap = cap;
+	if (queues[q].ntables && cap > queues[q].maxchain) {
+		queues[q].maxchain = cap;
+	}
+
+	return queues[q].maxchain;
+}
+
+// Waits if the descriptors or indirect tables are all in use
 void QSend(uint16_t q, uint16_t n_out, uint16_t n_in, uint32_t *addrs, uint32_t *sizes, volatile uint32_t *retsize, bool wait) {
 	volatile uint32_t myval;
 	if (retsize == NULL && wait) {
@@ -78,89 +184,324 @@ void QSend(uint16_t q, uint16_t n_out, uint16_t n_in, uint32_t *addrs, uint32_t
 		*retsize = 0;
 	}
 
+	uint16_t n = n_out + n_in;
+	if (n > queues[q].maxchain) panic("QSend chain too long");
+
 	short sr = DisableInterrupts();
 
-	// Reverse iterate through user's buffers, create a linked descriptor list
-	uint16_t remain = n_out + n_in;
-	uint16_t nextbuf = 0; // doesn't matter, there is no "next"
-	for (uint16_t buf=queues[q].size-1; buf!=0xffff && remain; buf--) {
-		if (queues[q].desc[buf].next != 0xffff) continue; // not a free desc
+	// A chain of more than one buffer can go in an indirect table,
+	// otherwise it needs a ring descriptor for every buffer
+	int table;
+	uint16_t need;
+	for (;;) {
+		table = freeTable(q, n);
+		need = (table != NO_TABLE) ? 1 : n;
+		if (need <= queues[q].nfree) break;
+		waitFreed(q, sr);
+	}
+
+	uint16_t idx;
+	bool notify;
+	if (queues[q].packed) {
+		idx = putPacked(q, n_out, n_in, addrs, sizes, table, &notify);
+	} else {
+		idx = putSplit(q, n_out, n_in, addrs, sizes, table, &notify);
+	}
+
+	queues[q].nfree -= need;
+	queues[q].retlenptrs[idx] = retsize;
+	queues[q].tableof[idx] = table;
+	if (table != NO_TABLE) queues[q].tablebusy[table] = true;
 
-		remain--;
+	if (notify) VNotify(q);
 
-		queues[q].desc[buf] = (struct virtq_desc){
-			.addr = addrs[remain],
-			.len = sizes[remain],
-			.flags =
-				((remain<n_out+n_in-1) ? VIRTQ_DESC_F_NEXT : 0) |
-				((remain>=n_out) ? VIRTQ_DESC_F_WRITE : 0),
-			.next = nextbuf
-		};
+	ReenableInterrupts(sr);
 
-		nextbuf = buf;
-	}
+	if (wait) QWait(q, retsize);
+}
 
-	// maybe this should wait for more descriptors to be available?
-	if (remain) panic("attempted QSend when out of descriptors");
+// Return the head descriptor
+static uint16_t putSplit(uint16_t q, uint16_t n_out, uint16_t n_in, uint32_t *addrs, uint32_t *sizes, int table, bool *notify) {
+	uint16_t n = n_out + n_in;
+	uint16_t head = queues[q].free_head;
+
+	if (table != NO_TABLE) {
+		struct virtq_desc *tbl = queues[q].tables[table];
+		for (uint16_t i=0; i<n; i++) {
+			tbl[i] = (struct virtq_desc){
+				.addr = addrs[i],
+				.len = sizes[i],
+				.flags =
+					((i<n-1) ? VIRTQ_DESC_F_NEXT : 0) |
+					((i>=n_out) ? VIRTQ_DESC_F_WRITE : 0),
+				.next = i+1
+			};
+		}
 
-	queues[q].retlenptrs[nextbuf] = retsize;
+		// One ring descriptor points to the whole table
+		queues[q].free_head = queues[q].desc[head].next;
+		queues[q].desc[head].addr = queues[q].tablephys[table];
+		queues[q].desc[head].len = n * sizeof (struct virtq_desc);
+		queues[q].desc[head].flags = VIRTQ_DESC_F_INDIRECT;
+	} else {
+		// The free list is already linked, so take the chain straight off the front
+		uint16_t buf = head;
+		for (uint16_t i=0; i<n; i++) {
+			queues[q].desc[buf].addr = addrs[i];
+			queues[q].desc[buf].len = sizes[i];
+			queues[q].desc[buf].flags =
+				((i<n-1) ? VIRTQ_DESC_F_NEXT : 0) |
+				((i>=n_out) ? VIRTQ_DESC_F_WRITE : 0);
+			buf = queues[q].desc[buf].next;
+		}
+		queues[q].free_head = buf;
+	}
 
 	// Put a pointer to the "head" descriptor in the avail queue
 	uint16_t idx = queues[q].avail->idx;
-	queues[q].avail->ring[idx & (queues[q].size - 1)] = nextbuf; // first in chain
+	queues[q].avail->ring[idx & (queues[q].size - 1)] = head; // first in chain
 	SynchronizeIO();
 	queues[q].avail->idx = idx + 1;
 	SynchronizeIO();
 
-	if (queues[q].used->flags == 0) VNotify(q);
+	// With EVENT_IDX, the avail_event field sits just after the used ring
+	// (and conveniently lines up with the "id" field of a used element)
+	if (queues[q].eventidx) {
+		*notify = needEvent(queues[q].used->ring[queues[q].size].id, idx + 1, idx);
+	} else {
+		*notify = queues[q].used->flags == 0;
+	}
+
+	return head;
+}
+
+// Return the buffer ID
+static uint16_t putPacked(uint16_t q, uint16_t n_out, uint16_t n_in, uint32_t *addrs, uint32_t *sizes, int table, bool *notify) {
+	uint16_t n = n_out + n_in;
+	uint16_t id = queues[q].freeids[--queues[q].nfreeids];
+
+	// An indirect table has the same descriptor format, minus the chaining
+	uint32_t tableaddr, tablesize;
+	if (table != NO_TABLE) {
+		struct pvirtq_desc *tbl = queues[q].tables[table];
+		for (uint16_t i=0; i<n; i++) {
+			tbl[i] = (struct pvirtq_desc){
+				.addr = addrs[i],
+				.len = sizes[i],
+				.flags = (i>=n_out) ? VIRTQ_DESC_F_WRITE : 0
+			};
+		}
 
-	if (wait) {
-		if (Interruptible(sr)) {
-			// Block the emulator and wait efficiently
-			ReenableInterruptsAndWaitFor(sr, retsize);
+		tableaddr = queues[q].tablephys[table];
+		tablesize = n * sizeof (struct pvirtq_desc);
+		addrs = &tableaddr;
+		sizes = &tablesize;
+		n = 1;
+	}
+
+	queues[q].chainlen[id] = n;
+
+	// The device may start on the chain as soon as the head is marked available,
+	// so fill in the others first
+	uint16_t head = queues[q].next_avail;
+	uint16_t headflags = 0;
+	for (uint16_t i=0; i<n; i++) {
+		uint16_t flags =
+			((i<n-1) ? VIRTQ_DESC_F_NEXT : 0) |
+			((i>=n_out && table == NO_TABLE) ? VIRTQ_DESC_F_WRITE : 0) |
+			((table != NO_TABLE) ? VIRTQ_DESC_F_INDIRECT : 0) |
+			(queues[q].avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED);
+
+		uint16_t pos = queues[q].next_avail;
+		queues[q].pdesc[pos].addr = addrs[i];
+		queues[q].pdesc[pos].addr_hi = 0;
+		queues[q].pdesc[pos].len = sizes[i];
+		queues[q].pdesc[pos].id = id;
+		if (i == 0) {
+			headflags = flags;
 		} else {
-			// Unavoidable poll
-			do {
-				poll(q);
-			} while (*retsize == 0);
-			ReenableInterrupts(sr);
+			queues[q].pdesc[pos].flags = flags;
 		}
+
+		if (++queues[q].next_avail == queues[q].size) {
+			queues[q].next_avail = 0;
+			queues[q].avail_wrap = !queues[q].avail_wrap;
+		}
+	}
+
+	SynchronizeIO();
+	queues[q].pdesc[head].flags = headflags;
+	SynchronizeIO();
+
+	uint16_t evflags = queues[q].device_event->flags;
+	if (evflags == RING_EVENT_FLAGS_DESC) {
+		// The event offset might be in the previous lap of the ring
+		uint16_t offwrap = queues[q].device_event->desc;
+		uint16_t event = offwrap & 0x7fff;
+		if ((offwrap >> 15) != queues[q].avail_wrap) event -= queues[q].size;
+		*notify = needEvent(event, queues[q].next_avail, queues[q].next_avail - n);
+	} else {
+		*notify = evflags != RING_EVENT_FLAGS_DISABLE;
+	}
+
+	return id;
+}
+
+// Has the index passed the event since the old index? (from the Virtio spec)
+static bool needEvent(uint16_t event, uint16_t newidx, uint16_t oldidx) {
+	return (uint16_t)(newidx - event - 1) < (uint16_t)(newidx - oldidx);
+}
+
+// Block until the buffer with this retsize pointer is returned
+void QWait(uint16_t q, volatile uint32_t *retsize) {
+	short sr = DisableInterrupts();
+
+	if (*retsize != 0) {
+		ReenableInterrupts(sr);
+	} else if (Interruptible(sr)) {
+		// Block the emulator and wait efficiently
+		ReenableInterruptsAndWaitFor(sr, retsize);
 	} else {
+		// Unavoidable poll
+		do {
+			poll(q);
+		} while (*retsize == 0);
 		ReenableInterrupts(sr);
 	}
 }
 
+// Return a free indirect table big enough for the chain, or NO_TABLE
+static int freeTable(uint16_t q, uint16_t n) {
+	if (n < 2 || n > queues[q].tablecap) return NO_TABLE;
+
+	for (int i=0; i<queues[q].ntables; i++) {
+		if (!queues[q].tablebusy[i]) return i;
+	}
+	return NO_TABLE;
+}
+
+// Sleep until poll returns some buffers (interrupts masked before and after)
+static void waitFreed(uint16_t q, short sr) {
+	queues[q].freed = 0;
+	if (Interruptible(sr)) {
+		ReenableInterruptsAndWaitFor(sr, &queues[q].freed);
+		DisableInterrupts();
+	} else {
+		do {
+			poll(q);
+		} while (queues[q].freed == 0);
+	}
+}
+
 // Called by transport at interrupt time, fear no further interruption
 void QNotified(void) {
-	for (uint16_t q=0; queues[q].size != 0; q++) {
+	for (uint16_t q=0; q<MAX_VQ && queues[q].size != 0; q++) {
+		if (queues[q].nfree == queues[q].size) continue; // nothing in flight
 		poll(q);
 	}
 }
 
-// Call DNotified for each buffer in the used ring
+// Call DNotified for each buffer the device has returned
 // not reentrant, only ever called with interrupts masked
 static void poll(uint16_t q) {
-	uint16_t i = queues[q].used_ctr;
+	if (queues[q].packed) {
+		pollPacked(q);
+	} else {
+		pollSplit(q);
+	}
+}
+
+static void pollSplit(uint16_t q) {
 	uint16_t mask = queues[q].size - 1;
-	uint16_t end = queues[q].used->idx;
-	queues[q].used_ctr = end;
-
-	for (; i != end; i++) {
-		uint16_t first = queues[q].used->ring[i&mask].id;
-		size_t len = queues[q].used->ring[i&mask].len;
-
-		uint16_t buf = first;
-		for (;;) {
-			uint16_t nextbuf = queues[q].desc[buf].next;
-			queues[q].desc[buf].next = 0xffff;
-			if ((queues[q].desc[buf].flags & VIRTQ_DESC_F_NEXT) == 0) break;
-			buf = nextbuf;
+
+	for (;;) {
+		uint16_t i = queues[q].used_ctr;
+		uint16_t end = queues[q].used->idx;
+		queues[q].used_ctr = end;
+
+		for (; i != end; i++) {
+			uint16_t first = queues[q].used->ring[i&mask].id;
+			size_t len = queues[q].used->ring[i&mask].len;
+
+			// Splice the whole chain back onto the free list
+			uint16_t buf = first;
+			queues[q].nfree++;
+			while (queues[q].desc[buf].flags & VIRTQ_DESC_F_NEXT) {
+				buf = queues[q].desc[buf].next;
+				queues[q].nfree++;
+			}
+			queues[q].desc[buf].next = queues[q].free_head;
+			queues[q].free_head = first;
+
+			finish(q, first, len);
 		}
 
-		volatile uint32_t *retsize = queues[q].retlenptrs[first];
-		if (retsize != NULL) {
-			*retsize = len;
+		if (!queues[q].eventidx) break;
+
+		// Ask for one interrupt when the next buffer is used,
+		// and catch any that were used before the device could see the request
+		// (the used_event field sits just after the avail ring)
+		queues[q].avail->ring[queues[q].size] = queues[q].used_ctr;
+		SynchronizeIO();
+		if (queues[q].used->idx == queues[q].used_ctr) break;
+	}
+}
+
+// The device overwrites descriptors in ring order, one per returned chain
+static void pollPacked(uint16_t q) {
+	for (;;) {
+		if (!usedPacked(q)) {
+			if (!queues[q].eventidx) break;
+
+			// Ask for one interrupt when the next descriptor is used,
+			// and catch any that were used before the device could see the request
+			queues[q].driver_event->desc = queues[q].next_used | (queues[q].used_wrap ? 0x8000 : 0);
+			SynchronizeIO();
+			if (!usedPacked(q)) break;
 		}
-		DNotified(q, queues[q].retlenptrs[first]);
+
+		uint16_t pos = queues[q].next_used;
+		SynchronizeIO(); // read the rest of the descriptor after the flags
+		uint16_t id = queues[q].pdesc[pos].id;
+		uint32_t len = queues[q].pdesc[pos].len;
+
+		// Skip over the rest of the chain
+		pos += queues[q].chainlen[id];
+		if (pos >= queues[q].size) {
+			pos -= queues[q].size;
+			queues[q].used_wrap = !queues[q].used_wrap;
+		}
+		queues[q].next_used = pos;
+		queues[q].nfree += queues[q].chainlen[id];
+
+		finish(q, id, len);
+	}
+}
+
+static bool usedPacked(uint16_t q) {
+	uint16_t flags = queues[q].pdesc[queues[q].next_used].flags;
+	bool avail = (flags & VIRTQ_DESC_F_AVAIL) != 0;
+	bool used = (flags & VIRTQ_DESC_F_USED) != 0;
+	return avail == used && used == queues[q].used_wrap;
+}
+
+// Release a returned chain and tell the driver
+static void finish(uint16_t q, uint16_t idx, uint32_t len) {
+	volatile uint32_t *retsize = queues[q].retlenptrs[idx];
+
+	if (queues[q].tableof[idx] != NO_TABLE) {
+		queues[q].tablebusy[queues[q].tableof[idx]] = false;
+		queues[q].tableof[idx] = NO_TABLE;
+	}
+
+	// DNotified might send another buffer with this ID straight away
+	if (queues[q].packed) {
+		queues[q].freeids[queues[q].nfreeids++] = idx;
+	}
+
+	if (retsize != NULL) {
+		*retsize = len;
 	}
+	queues[q].freed = 1;
+	DNotified(q, retsize);
 }
@@ -9,7 +9,11 @@
 // Create a descriptor ring for this virtqueue, return actual size
 uint16_t QInit(uint16_t q, uint16_t max_size);
 
-// Never blocks, just panics if not enough descriptors available
+// Use indirect descriptors (if available) to accept chains longer than the ring,
+// return the longest chain that QSend will accept
+uint16_t QIndirect(uint16_t q, uint16_t max_chain);
+
+// Waits if the descriptors or indirect tables are all in use
 void QSend(
 	uint16_t q,
 	uint16_t n_out, uint16_t n_in,
@@ -17,5 +21,8 @@ void QSend(
 	volatile uint32_t *retsize,
 	bool wait);
 
+// Block until the device returns a buffer sent with wait=false
+void QWait(uint16_t q, volatile uint32_t *retsize);
+
 // Called by transport about a change to the used ring
 void QNotified(void);